@@ -39,6 +39,19 @@ struct mgos_vfs_fs {
   struct mgos_vfs_dev *dev;
   void *fs_data;
   int refs;
+  /*
+   * Generation counter, bumped by the VFS on every operation that may change
+   * space usage. Filesystems that reclaim space on their own (e.g. background
+   * GC) should bump it too, it invalidates cached statvfs values.
+   */
+  uint32_t gen;
+};
+
+/* Filesystem space information, all values are in bytes. */
+struct mgos_vfs_statvfs {
+  size_t space_total;
+  size_t space_used;
+  size_t space_free;
 };
 
 #ifdef CS_MMAP
@@ -120,6 +133,16 @@ int closedir(DIR *pdir);
 #else
 #include <dirent.h>
 #endif /* MGOS_VFS_DEFINE_DIRENT */
+
+/*
+ * Directory entry as returned by mgos_vfs_getdents().
+ * Entries are packed one after another, d_reclen is the offset of the next.
+ */
+struct mgos_vfs_dent {
+  long d_off;              /* Position after this entry, for seekdir. */
+  unsigned short d_reclen; /* Size of this record, including padding. */
+  char d_name[];           /* NUL-terminated. */
+};
 #endif /* MG_ENABLE_DIRECTORY_LISTING */
 
 /*
@@ -162,10 +185,37 @@ struct mgos_vfs_fs_ops {
   uint8_t (*read_mmapped_byte)(struct mgos_vfs_mmap_desc *desc, uint32_t addr);
 #endif /* CS_MMAP */
 
+  /* Optional methods, may be NULL. */
+
+  /* Return total, used and available space in one go. If not provided,
+   * get_space_{total,used,free} are used. */
+  bool (*statvfs)(struct mgos_vfs_fs *fs, struct mgos_vfs_statvfs *st);
+#if MG_ENABLE_DIRECTORY_LISTING
+  /*
+   * Fill buf with as many packed entries as fit. Returns number of bytes
+   * used, 0 at the end of directory or -1 on error. Special entries may be
+   * included, VFS hides them.
+   */
+  int (*getdents)(struct mgos_vfs_fs *fs, DIR *pdir, void *buf, size_t len);
+  /*
+   * Directory position cookies. Both or neither must be provided, if only
+   * one is, it is ignored. If not provided, VFS uses entry index as the
+   * position and seeks by re-reading the directory.
+   */
+  long (*telldir)(struct mgos_vfs_fs *fs, DIR *pdir);
+  void (*seekdir)(struct mgos_vfs_fs *fs, DIR *pdir, long loc);
+  /* readdir that also fills in st_mode, st_size and st_mtime of the entry.
+   * If not provided, VFS uses readdir followed by stat. */
+  struct dirent *(*readdirplus)(struct mgos_vfs_fs *fs, DIR *pdir,
+                                struct stat *st);
+  /* opendir that only returns entries matching the pattern,
+   * see mgos_vfs_fnmatch(). If not provided, VFS filters entries itself. */
+  DIR *(*opendir_filter)(struct mgos_vfs_fs *fs, const char *path,
+                         const char *pattern);
+#endif
+
 #if 0 /* These parts of the libc API are not supported for now. */
   int (*link)(struct mgos_vfs_fs *fs, const char *n1, const char *n2);
-  long (*telldir)(struct mgos_vfs_fs *fs, DIR *pdir);
-  void (*seekdir)(struct mgos_vfs_fs *fs, DIR *pdir, long offset);
   int (*mkdir)(struct mgos_vfs_fs *fs, const char *name, mode_t mode);
   int (*rmdir)(struct mgos_vfs_fs *fs, const char *name);
 #endif
@@ -236,6 +286,13 @@ size_t mgos_vfs_get_space_total(const char *path);
  */
 size_t mgos_vfs_get_space_free(const char *path);
 
+/*
+ * Get total, used and free space of a file system at the specified mountpoint.
+ * Values are cached and only re-read from the filesystem after an operation
+ * that may have changed them (write, unlink, GC, etc).
+ */
+bool mgos_vfs_statvfs(const char *path, struct mgos_vfs_statvfs *st);
+
 /*
  * Perform GC of a filesystem at the specified mountpoint.
  */
@@ -266,8 +323,36 @@ int mgos_vfs_rename(const char *src, const char *dst);
 DIR *mgos_vfs_opendir(const char *path);
 struct dirent *mgos_vfs_readdir(DIR *pdir);
 int mgos_vfs_closedir(DIR *pdir);
+/*
+ * Read as many entries as fit in buf, see struct mgos_vfs_dent.
+ * Returns number of bytes used, 0 at the end of directory or -1 on error
+ * (EINVAL if buf is too small for the next entry).
+ */
+int mgos_vfs_getdents(DIR *pdir, void *buf, size_t len);
+/* Current position in the directory, can be used with mgos_vfs_seekdir()
+ * on this or another DIR opened for the same directory. */
+long mgos_vfs_telldir(DIR *pdir);
+void mgos_vfs_seekdir(DIR *pdir, long loc);
+/*
+ * Like mgos_vfs_readdir() but also returns attributes of the entry
+ * (type, size and modification time), saving a separate stat call.
+ * If attributes could not be obtained, st is zeroed.
+ */
+struct dirent *mgos_vfs_readdirplus(DIR *pdir, struct stat *st);
+/*
+ * Open a directory for reading only the entries whose names match
+ * the pattern, e.g. "*.log" or "cert_*". See mgos_vfs_fnmatch().
+ * NULL pattern matches everything.
+ */
+DIR *mgos_vfs_opendir_filter(const char *path, const char *pattern);
 #endif
 
+/*
+ * Match name against a shell-style pattern: '*' matches any sequence
+ * of characters, '?' matches any single character.
+ */
+bool mgos_vfs_fnmatch(const char *pattern, const char *name);
+
 /* If this is enabled, it also defines open, read, write -> mog_vfs_* shims. */
 #ifndef MGOS_VFS_DEFINE_LIBC_API
 #define MGOS_VFS_DEFINE_LIBC_API 0
@@ -288,6 +373,18 @@ int mgos_vfs_closedir(DIR *pdir);
 #define MGOS_VFS_DEFINE_LIBC_REENT_DIR_API 0
 #endif
 
+/*
+ * Max size of the per-mount directory listing cache, 0 to disable.
+ * Listing is cached after a full readdir pass and is dropped when files
+ * are created, removed or renamed via VFS. Only one listing per mount is
+ * collected at a time, other DIRs opened meanwhile read from the FS.
+ * Entries returned from the cache only have d_name set, other dirent
+ * fields are zero.
+ */
+#ifndef MGOS_VFS_DCACHE_MAX_SIZE
+#define MGOS_VFS_DCACHE_MAX_SIZE 0
+#endif
+
 /* Define mmap, munmap. */
 #ifndef MGOS_VFS_DEFINE_LIBC_MMAP_API
 #if defined(CS_MMAP)
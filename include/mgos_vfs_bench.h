@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Synthetic workload generator. Runs a weighted random mix of typical
+ * device filesystem access patterns through the public mgos_vfs_* API
+ * and reports throughput, latency distribution and device wear.
+ * Uses nothing but the VFS API, so it can run on any mount.
+ * Compiled in only if MGOS_VFS_ENABLE_BENCH is set, otherwise
+ * mgos_vfs_bench_run() fails and the rest are no-ops.
+ */
+
+#ifndef CS_FW_SRC_MGOS_VFS_BENCH_H_
+#define CS_FW_SRC_MGOS_VFS_BENCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frozen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MGOS_VFS_ENABLE_BENCH
+#define MGOS_VFS_ENABLE_BENCH 0
+#endif
+
+enum mgos_vfs_bench_wl {
+  /* Read a config file, modify it, write to a temp file, rename over. */
+  MGOS_VFS_BENCH_WL_CONFIG = 0,
+  /* Append a record to a log, rotate when it grows too big. */
+  MGOS_VFS_BENCH_WL_LOG,
+  /* Write a large file sequentially in chunks, then remove it. */
+  MGOS_VFS_BENCH_WL_OTA,
+  /* Create, overwrite or remove one of many small files. */
+  MGOS_VFS_BENCH_WL_SMALL,
+  /* List the directory. */
+  MGOS_VFS_BENCH_WL_LIST,
+  MGOS_VFS_BENCH_WL_MAX,
+};
+
+struct mgos_vfs_bench_cfg {
+  /* Prefix of the files used by the benchmark, e.g. "/bench_". */
+  const char *prefix;
+  /* Directory to list, e.g. "/". */
+  const char *dir;
+  /* Device to measure wear of (registered name), may be NULL. */
+  const char *dev_name;
+  int num_ops;
+  uint32_t seed;
+  /* Relative frequencies of the workloads, 0 to disable. */
+  int weights[MGOS_VFS_BENCH_WL_MAX];
+  size_t config_size;
+  size_t log_record_size;
+  size_t log_max_size;
+  int log_num_files;
+  size_t ota_size;
+  size_t ota_chunk_size;
+  int small_num_files;
+  size_t small_size;
+  /* Remove the files when done. */
+  bool cleanup;
+};
+
+/* Same buckets as mgos_vfs_op_stats. */
+#define MGOS_VFS_BENCH_NUM_BUCKETS 20
+
+struct mgos_vfs_bench_wl_result {
+  uint32_t ops;
+  uint32_t errors;
+  uint64_t bytes;
+  uint64_t total_us;
+  uint32_t max_us;
+  uint32_t hist[MGOS_VFS_BENCH_NUM_BUCKETS];
+};
+
+struct mgos_vfs_bench_result {
+  struct mgos_vfs_bench_wl_result wl[MGOS_VFS_BENCH_WL_MAX];
+  uint64_t total_us;
+  /* Device wear, only if dev_name is set and stats / wear map enabled. */
+  uint64_t dev_written;
+  uint64_t dev_erased;
+  uint32_t dev_erases;
+  uint32_t max_unit_erases; /* Most erases of a single erase unit. */
+};
+
+/* Fill the config with defaults. */
+void mgos_vfs_bench_cfg_init(struct mgos_vfs_bench_cfg *cfg);
+
+/* Returns short name of the workload, e.g. "log". */
+const char *mgos_vfs_bench_wl_name(enum mgos_vfs_bench_wl wl);
+
+/*
+ * Run the benchmark. Errors are counted in the results, returns false if
+ * the benchmark could not be run at all.
+ */
+bool mgos_vfs_bench_run(const struct mgos_vfs_bench_cfg *cfg,
+                        struct mgos_vfs_bench_result *res);
+
+/*
+ * Latency (upper bound of the histogram bucket) below which the given
+ * percentage of operations completed.
+ */
+uint32_t mgos_vfs_bench_percentile(const struct mgos_vfs_bench_wl_result *r,
+                                   int pct);
+
+/*
+ * Print results as JSON:
+ *   {"total_us": 123, "log": {"ops": 10, "errors": 0, "bytes": 640,
+ *    "kb_per_s": 12.5, "avg_us": 100, "p50_us": 64, "p99_us": 512,
+ *    "max_us": 300}, ..., "dev": {"written": 2048, "erased": 4096,
+ *    "erases": 1, "max_unit_erases": 1}}
+ */
+int mgos_vfs_bench_print_json(const struct mgos_vfs_bench_result *res,
+                              struct json_out *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_FW_SRC_MGOS_VFS_BENCH_H_ */
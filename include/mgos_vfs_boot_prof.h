@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Filesystem bring-up profiler: timestamps of the phases of
+ * mgos_core_fs_init() (device registration, encryption setup, probing,
+ * mounting, etc). Phases nest. The bring-up itself is started with
+ * MGOS_VFS_BOOT_FS_INIT_BEGIN(); when it ends, a report is logged and
+ * recording stops. Phases that run before it (e.g. devices registered by
+ * the platform early) are recorded as separate top-level phases.
+ * Compiled in only if MGOS_VFS_ENABLE_BOOT_PROF is set.
+ */
+
+#ifndef CS_FW_SRC_MGOS_VFS_BOOT_PROF_H_
+#define CS_FW_SRC_MGOS_VFS_BOOT_PROF_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frozen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MGOS_VFS_ENABLE_BOOT_PROF
+#define MGOS_VFS_ENABLE_BOOT_PROF 0
+#endif
+
+/* Max number of phases recorded, the rest are dropped. */
+#ifndef MGOS_VFS_BOOT_PROF_MAX_PHASES
+#define MGOS_VFS_BOOT_PROF_MAX_PHASES 32
+#endif
+
+struct mgos_vfs_boot_phase {
+  const char *name; /* Static string, e.g. "mount". */
+  char arg[16];     /* Phase argument (path, device name), may be truncated. */
+  int depth;
+  bool ok;
+  int64_t start_us; /* Uptime at the start. */
+  uint32_t dur_us;  /* Duration, 0 if the phase has not ended. */
+};
+
+/*
+ * Copy up to max_phases phases to phases (which may be NULL), in order
+ * of their start. Returns the number of phases recorded.
+ */
+int mgos_vfs_boot_prof_get(struct mgos_vfs_boot_phase *phases,
+                           int max_phases);
+
+/*
+ * Print the recorded phases as JSON:
+ *   [{"name": "fs_init", "arg": "", "depth": 0, "start_us": 120000,
+ *     "dur_us": 53000, "ok": true}, ...]
+ */
+int mgos_vfs_boot_prof_print_json(struct json_out *out);
+
+/* Log the report. */
+void mgos_vfs_boot_prof_print(void);
+
+#if MGOS_VFS_ENABLE_BOOT_PROF
+/* Start a phase, name must be static, arg (may be NULL) is copied. */
+void mgos_vfs_boot_prof_begin(const char *name, const char *arg);
+/* Start the "fs_init" phase, the report is logged when it ends. */
+void mgos_vfs_boot_prof_begin_fs_init(void);
+/* End the innermost phase. */
+void mgos_vfs_boot_prof_end(bool ok);
+
+#define MGOS_VFS_BOOT_FS_INIT_BEGIN() mgos_vfs_boot_prof_begin_fs_init()
+#define MGOS_VFS_BOOT_PHASE_BEGIN(name, arg) \
+  mgos_vfs_boot_prof_begin((name), (arg))
+#define MGOS_VFS_BOOT_PHASE_END(ok) mgos_vfs_boot_prof_end(ok)
+#else
+#define MGOS_VFS_BOOT_FS_INIT_BEGIN() (void) 0
+#define MGOS_VFS_BOOT_PHASE_BEGIN(name, arg) (void) 0
+#define MGOS_VFS_BOOT_PHASE_END(ok) (void) 0
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_FW_SRC_MGOS_VFS_BOOT_PROF_H_ */
@@ -13,17 +13,107 @@
 #include "common/queue.h"
 
 #include "mgos_system.h"
+#include "mgos_vfs_lock_prof.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * Erase discarded blocks in the background, see mgos_vfs_dev_discard().
+ * Requires timers, so it should not be enabled in the boot loader.
+ */
+#ifndef MGOS_VFS_DEV_ENABLE_ERASE_AHEAD
+#define MGOS_VFS_DEV_ENABLE_ERASE_AHEAD 0
+#endif
+
+/* How often to erase the next discarded block, one block per tick. */
+#ifndef MGOS_VFS_DEV_ERASE_AHEAD_INTERVAL_MS
+#define MGOS_VFS_DEV_ERASE_AHEAD_INTERVAL_MS 100
+#endif
+
+/* Maintain per-device I/O counters, see mgos_vfs_dev_get_stats(). */
+#ifndef MGOS_VFS_DEV_ENABLE_STATS
+#define MGOS_VFS_DEV_ENABLE_STATS 0
+#endif
+
+/* Keep per-erase-block erase counters, see mgos_vfs_dev_get_wear_map(). */
+#ifndef MGOS_VFS_DEV_ENABLE_WEAR_MAP
+#define MGOS_VFS_DEV_ENABLE_WEAR_MAP 0
+#endif
+
+/*
+ * Per-device write and erase queue, see mgos_vfs_dev_set_queue().
+ * Requires timers, so it should not be enabled in the boot loader.
+ */
+#ifndef MGOS_VFS_DEV_ENABLE_QUEUE
+#define MGOS_VFS_DEV_ENABLE_QUEUE 0
+#endif
+
+/* Max number of queued requests (after merging) before the queue is flushed. */
+#ifndef MGOS_VFS_DEV_QUEUE_MAX_ENTRIES
+#define MGOS_VFS_DEV_QUEUE_MAX_ENTRIES 32
+#endif
+
+/*
+ * Run asynchronous operations of drivers that do not implement them on the
+ * main task, see mgos_vfs_dev_read_async(). Not for the boot loader.
+ */
+#ifndef MGOS_VFS_DEV_ENABLE_ASYNC
+#define MGOS_VFS_DEV_ENABLE_ASYNC 0
+#endif
+
+/* How often to save the wear map, see mgos_vfs_dev_persist_wear_map(). */
+#ifndef MGOS_VFS_DEV_WEAR_SAVE_INTERVAL_MS
+#define MGOS_VFS_DEV_WEAR_SAVE_INTERVAL_MS (60 * 60 * 1000)
+#endif
+
+struct json_out;
+
+enum mgos_vfs_dev_op_type {
+  MGOS_VFS_DEV_OP_READ = 0,
+  MGOS_VFS_DEV_OP_WRITE = 1,
+  MGOS_VFS_DEV_OP_ERASE = 2,
+  MGOS_VFS_DEV_OP_MAX,
+};
+
+struct mgos_vfs_dev_op_stats {
+  uint32_t ops;      /* Number of calls, including failed ones. */
+  uint64_t bytes;    /* Bytes read, written or erased successfully. */
+  uint64_t total_us; /* Time spent in the driver. */
+  uint32_t max_us;   /* Longest call. */
+};
+
+/* Number of error codes, see enum mgos_vfs_dev_err. */
+#define MGOS_VFS_DEV_NUM_ERRS 9
+
+struct mgos_vfs_dev_stats {
+  struct mgos_vfs_dev_op_stats op[MGOS_VFS_DEV_OP_MAX];
+  /* Failed calls, indexed by negated error code. Unknown codes count as IO. */
+  uint32_t errors[MGOS_VFS_DEV_NUM_ERRS];
+};
+
 struct mgos_vfs_dev {
   const struct mgos_vfs_dev_ops *ops;
   char *name;
   void *dev_data;
   struct mgos_rlock_type *lock;
+#if MGOS_VFS_ENABLE_LOCK_PROF
+  struct mgos_vfs_lock_prof_state lock_prof;
+#endif
   int refs;
+#if MGOS_VFS_DEV_ENABLE_ERASE_AHEAD
+  struct mgos_vfs_dev_erase_ahead *ea;
+#endif
+#if MGOS_VFS_DEV_ENABLE_STATS
+  struct mgos_vfs_dev_stats stats;
+#endif
+#if MGOS_VFS_DEV_ENABLE_WEAR_MAP
+  struct mgos_vfs_dev_wear *wear;
+#endif
+#if MGOS_VFS_DEV_ENABLE_QUEUE
+  struct mgos_vfs_dev_queue *queue;
+#endif
   SLIST_ENTRY(mgos_vfs_dev) next;
 };
 
@@ -39,6 +129,19 @@ enum mgos_vfs_dev_err {
   MGOS_VFS_DEV_ERR_IO = -8,       /* Some other kind of I/O error. */
 };
 
+/* A request for mgos_vfs_dev_submit(). */
+struct mgos_vfs_dev_req {
+  enum mgos_vfs_dev_op_type type;
+  size_t offset;
+  size_t len;
+  void *buf; /* Destination for reads, source for writes. */
+  enum mgos_vfs_dev_err res;
+};
+
+/* Completion callback of an asynchronous operation. */
+typedef void (*mgos_vfs_dev_cb_t)(struct mgos_vfs_dev *dev,
+                                  enum mgos_vfs_dev_err res, void *cb_arg);
+
 #define MGOS_VFS_DEV_NUM_ERASE_SIZES 8
 
 struct mgos_vfs_dev_ops {
@@ -57,8 +160,46 @@ struct mgos_vfs_dev_ops {
    * Unused output slots will be 0. */
   enum mgos_vfs_dev_err (*get_erase_sizes)(
       struct mgos_vfs_dev *dev, size_t sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES]);
+  /* Optional: the range is no longer in use and will be erased before
+   * it is written to again. Drivers that implement this take care of
+   * preparing the range themselves, generic erase-ahead is not used. */
+  enum mgos_vfs_dev_err (*discard)(struct mgos_vfs_dev *dev, size_t offset,
+                                   size_t len);
+  /* Optional: write out any data buffered by the driver. */
+  enum mgos_vfs_dev_err (*flush)(struct mgos_vfs_dev *dev);
+  /* Optional: execute a batch of requests, see mgos_vfs_dev_submit().
+   * Requests may be merged or reordered as long as the outcome is the same
+   * as executing them in order. Set res of the requests that were executed
+   * and return the first error. Without it, requests are executed one by one
+   * with read, write and erase. */
+  enum mgos_vfs_dev_err (*submit)(struct mgos_vfs_dev *dev,
+                                  struct mgos_vfs_dev_req *reqs, int n);
+  /* Optional: start an operation and return without waiting for it to
+   * complete, e.g. poll flash status from a timer or an interrupt.
+   * If 0 is returned, cb must be invoked exactly once, from the main task
+   * (use mgos_invoke_cb() from an ISR); otherwise it must not be invoked.
+   * The device is only locked while the operation is being started: the
+   * driver must wait for an operation in progress before starting another
+   * one, including a synchronous one. */
+  enum mgos_vfs_dev_err (*read_async)(struct mgos_vfs_dev *dev, size_t offset,
+                                      size_t len, void *dst,
+                                      mgos_vfs_dev_cb_t cb, void *cb_arg);
+  enum mgos_vfs_dev_err (*write_async)(struct mgos_vfs_dev *dev, size_t offset,
+                                       size_t len, const void *src,
+                                       mgos_vfs_dev_cb_t cb, void *cb_arg);
+  enum mgos_vfs_dev_err (*erase_async)(struct mgos_vfs_dev *dev, size_t offset,
+                                       size_t len, mgos_vfs_dev_cb_t cb,
+                                       void *cb_arg);
 };
 
+/*
+ * Creates the device registry lock and registers the generic device types
+ * (cache, concat/stripe, compress, encrypt - whichever are enabled).
+ * Must be called from mgos_vfs_common_init() before any device is created
+ * or registered. Safe to call again after a failure.
+ */
+bool mgos_vfs_dev_init(void);
+
 bool mgos_vfs_dev_register_type(const char *name,
                                 const struct mgos_vfs_dev_ops *ops);
 
@@ -102,11 +243,122 @@ enum mgos_vfs_dev_err mgos_vfs_dev_write(struct mgos_vfs_dev *dev,
 enum mgos_vfs_dev_err mgos_vfs_dev_erase(struct mgos_vfs_dev *dev,
                                          size_t offset, size_t len);
 
+/*
+ * Execute a batch of read, write and erase requests, in order, with the
+ * device locked once. Drivers may implement this more efficiently than
+ * separate calls (e.g. set up the controller once).
+ * Stops at the first failed request and returns its error; res of each
+ * request is set, requests that were not executed get MGOS_VFS_DEV_ERR_IO.
+ */
+enum mgos_vfs_dev_err mgos_vfs_dev_submit(struct mgos_vfs_dev *dev,
+                                          struct mgos_vfs_dev_req *reqs, int n);
+
+/*
+ * Asynchronous read, write and erase: start the operation and invoke cb with
+ * the result when it is complete. The buffer must stay valid until then and
+ * the device is kept open.
+ * Drivers that implement the *_async ops return right away and the CPU is
+ * free for other tasks while the flash is busy. Otherwise the operation is
+ * executed later on the main task if MGOS_VFS_DEV_ENABLE_ASYNC is set, or
+ * right away, with cb invoked before returning, if not.
+ * No in-tree flash driver implements them, so for those the fallback only
+ * moves the busy-wait to the main task, it does not free the CPU.
+ * Order relative to other operations on the device is not guaranteed.
+ * If an error is returned, cb is not invoked.
+ */
+enum mgos_vfs_dev_err mgos_vfs_dev_read_async(struct mgos_vfs_dev *dev,
+                                              size_t offset, size_t len,
+                                              void *dst, mgos_vfs_dev_cb_t cb,
+                                              void *cb_arg);
+enum mgos_vfs_dev_err mgos_vfs_dev_write_async(struct mgos_vfs_dev *dev,
+                                               size_t offset, size_t len,
+                                               const void *src,
+                                               mgos_vfs_dev_cb_t cb,
+                                               void *cb_arg);
+enum mgos_vfs_dev_err mgos_vfs_dev_erase_async(struct mgos_vfs_dev *dev,
+                                               size_t offset, size_t len,
+                                               mgos_vfs_dev_cb_t cb,
+                                               void *cb_arg);
+
+/*
+ * Hint that the range will be erased before it is used again.
+ * Only whole erase blocks within the range are affected.
+ * With MGOS_VFS_DEV_ENABLE_ERASE_AHEAD, such blocks are erased in the
+ * background and a subsequent mgos_vfs_dev_erase() of a block that has not
+ * been written to since completes immediately.
+ * Without it (and without driver support) this is a no-op.
+ */
+enum mgos_vfs_dev_err mgos_vfs_dev_discard(struct mgos_vfs_dev *dev,
+                                           size_t offset, size_t len);
+
 size_t mgos_vfs_dev_get_size(struct mgos_vfs_dev *dev);
 
+/*
+ * Write out data buffered by the device (and devices it is stacked on),
+ * including the request queue. A no-op for devices that do not buffer writes.
+ */
+enum mgos_vfs_dev_err mgos_vfs_dev_flush(struct mgos_vfs_dev *dev);
+
+/*
+ * Get I/O counters of the device. Erases that were skipped because the
+ * block was known to be blank are not counted, background erases are.
+ * Returns false if MGOS_VFS_DEV_ENABLE_STATS is not set.
+ */
+bool mgos_vfs_dev_get_stats(struct mgos_vfs_dev *dev,
+                            struct mgos_vfs_dev_stats *st);
+
+/* Reset I/O counters of the device. */
+void mgos_vfs_dev_reset_stats(struct mgos_vfs_dev *dev);
+
+/*
+ * Get erase counts of the device, one per smallest erase unit.
+ * Counters saturate at 0xffff.
+ * Up to max_units counters are copied to counts (which may be NULL),
+ * unit_size receives the size of the unit.
+ * Returns the number of units, 0 if the map is not available.
+ */
+size_t mgos_vfs_dev_get_wear_map(struct mgos_vfs_dev *dev, uint16_t *counts,
+                                 size_t max_units, size_t *unit_size);
+
+/* Print the wear map as JSON: {"unit": 4096, "counts": [1,5,...]}. */
+int mgos_vfs_dev_print_wear_map_json(struct mgos_vfs_dev *dev,
+                                     struct json_out *out);
+
+/* Save the wear map to a file. */
+bool mgos_vfs_dev_save_wear_map(struct mgos_vfs_dev *dev, const char *path);
+
+/*
+ * Keep the wear map in a file: counts saved previously are added to the
+ * current ones and the file is updated every
+ * MGOS_VFS_DEV_WEAR_SAVE_INTERVAL_MS if there were erases.
+ * The file is only loaded by the first call for the device, subsequent ones
+ * (e.g. after a remount) only change the path.
+ */
+bool mgos_vfs_dev_persist_wear_map(struct mgos_vfs_dev *dev, const char *path);
+
 enum mgos_vfs_dev_err mgos_vfs_dev_get_erase_sizes(
     struct mgos_vfs_dev *dev, size_t erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES]);
 
+/*
+ * Queue writes and erases of the device instead of executing them right away.
+ * Queued writes that overlap or are adjacent are merged, data written to the
+ * same location is combined as NOR flash does (bits can only be cleared), so
+ * this should only be enabled for flash devices. Erases of the same or
+ * adjacent ranges are coalesced, queued data in erased range is dropped.
+ * The queue is executed in order of offset, erases first, when there is
+ * max_bytes of write data or MGOS_VFS_DEV_QUEUE_MAX_ENTRIES requests queued,
+ * flush_ms after the first request was queued (if > 0), on
+ * mgos_vfs_dev_flush() and before a read of a range with queued requests.
+ * Reads of other ranges are not delayed.
+ * Errors of queued requests are returned by the call that flushed them;
+ * an error of a timer flush is returned by the next flush, read, write or
+ * erase of the device (the latter three are then not executed).
+ * max_bytes of 0 flushes the queue and disables it.
+ * Returns false if MGOS_VFS_DEV_ENABLE_QUEUE is not set.
+ */
+bool mgos_vfs_dev_set_queue(struct mgos_vfs_dev *dev, size_t max_bytes,
+                            int flush_ms);
+
 /* Close a previously opened or created device. */
 bool mgos_vfs_dev_close(struct mgos_vfs_dev *dev);
 
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Write-back sector cache, stacked on top of another device.
+ *
+ * Options:
+ *   dev      - name of the underlying device, required.
+ *   lines    - number of sectors to cache, default 8.
+ *   sector   - sector size, default is the smallest erase size of the
+ *              underlying device.
+ *   unit     - write unit of the underlying device, default 16. Sector size
+ *              must be a multiple of it.
+ *   flush_ms - write back dirty sectors this often, 0 to only write back
+ *              on eviction, mgos_vfs_dev_flush() and close. Default 1000.
+ *
+ * Partial reads and writes of a sector bring it into the cache, whole
+ * sector accesses that miss go straight to the device. Erases of cached
+ * sectors are deferred until write-back, so a sector that is erased and
+ * rewritten repeatedly is only erased and programmed once per flush.
+ * Data that has not been written back is lost on power failure.
+ * Written data is cached as is, on NOR flash this relies on the filesystem
+ * only clearing bits when rewriting programmed bytes, as they all do.
+ * Dirty data is tracked in units, on write-back only units that were
+ * written to are programmed, runs of them with one write. On flash with ECC
+ * (e.g. STM32L4 double-words) or with encryption, the unit must be the
+ * program granularity or a multiple of it, so that no unit is programmed
+ * that the filesystem has not written.
+ *
+ * Compiled in only if MGOS_VFS_DEV_ENABLE_CACHE is set.
+ * Requires timers, so it should not be enabled in the boot loader.
+ */
+
+#ifndef CS_FW_SRC_MGOS_VFS_DEV_CACHE_H_
+#define CS_FW_SRC_MGOS_VFS_DEV_CACHE_H_
+
+#include <stdbool.h>
+
+#include "mgos_vfs_dev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MGOS_VFS_DEV_ENABLE_CACHE
+#define MGOS_VFS_DEV_ENABLE_CACHE 0
+#endif
+
+#define MGOS_VFS_DEV_TYPE_CACHE "cache"
+
+bool mgos_vfs_dev_cache_register_type(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_FW_SRC_MGOS_VFS_DEV_CACHE_H_ */
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compressing device, stacked on top of another device.
+ *
+ * The logical device is split into fixed-size blocks, each block is
+ * compressed (LZF) and appended to a log on the underlying device.
+ * A RAM map (4 bytes per block) points to the latest copy of each block,
+ * segments (erase units of the underlying device) are garbage-collected
+ * when free space runs low.
+ *
+ * Options:
+ *   dev   - name of the underlying device, required.
+ *   block - block size, also the erase size of this device. Default 1024.
+ *   size  - logical size, default is twice the size of the underlying
+ *           device. Writes fail with NOSPC if data does not compress well
+ *           enough to fit.
+ *   flush_ms - write back the current block this often, 0 to only write it
+ *           back when needed. Default 1000.
+ *
+ * The last written block is kept in RAM until another block is accessed,
+ * on mgos_vfs_dev_flush() (also done on umount), close or by the flush
+ * timer, so sequential page writes are compressed once. Since it is always
+ * the last write that is pending, a power failure only loses a suffix of
+ * the writes.
+ *
+ * A device that does not contain compressed segments is formatted.
+ * Compiled in only if MGOS_VFS_DEV_ENABLE_COMPRESS is set.
+ */
+
+#ifndef CS_FW_SRC_MGOS_VFS_DEV_COMPRESS_H_
+#define CS_FW_SRC_MGOS_VFS_DEV_COMPRESS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mgos_vfs_dev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MGOS_VFS_DEV_ENABLE_COMPRESS
+#define MGOS_VFS_DEV_ENABLE_COMPRESS 0
+#endif
+
+#define MGOS_VFS_DEV_TYPE_COMPRESS "compress"
+
+struct mgos_vfs_dev_compress_info {
+  size_t size;          /* Logical size. */
+  size_t phys_size;     /* Size of the underlying device. */
+  size_t used;          /* Logical bytes in blocks that have data. */
+  size_t phys_used;     /* Bytes in the log taken by live records. */
+  size_t phys_free;     /* Bytes available to new records without GC. */
+  unsigned int num_gcs; /* Segments reclaimed. */
+};
+
+bool mgos_vfs_dev_compress_register_type(void);
+
+/*
+ * Get space usage of a compressing device, used / phys_used is the
+ * current compression ratio. Returns false if dev is not one.
+ */
+bool mgos_vfs_dev_compress_get_info(struct mgos_vfs_dev *dev,
+                                    struct mgos_vfs_dev_compress_info *info);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_FW_SRC_MGOS_VFS_DEV_COMPRESS_H_ */
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Encrypting device, stacked on top of another device.
+ *
+ * Data is encrypted in units (sectors) of a fixed size, each unit is
+ * processed with a single AES call with the unit number as the tweak (XTS)
+ * or the nonce (CTR), so hardware AES engines are fed whole sectors.
+ *
+ * Options:
+ *   dev  - name of the underlying device, required.
+ *   key  - hex-encoded key, required. 32 or 64 bytes for XTS (AES-128 or
+ *          AES-256), 16 or 32 bytes for CTR.
+ *   mode - "xts" (default) or "ctr". XTS requires MBEDTLS_CIPHER_MODE_XTS.
+ *          CTR reveals the XOR of old and new plaintext if a unit is
+ *          rewritten, use it only where XTS is not available.
+ *   unit - unit size, a multiple of 16 that divides the erase size of the
+ *          underlying device. Default 256.
+ *
+ * Blank (all 0xff) units read as 0xff and all-0xff units are not written,
+ * so erased state is preserved. Partial unit writes are done by
+ * read-modify-write, so on NOR flash a unit can only be programmed once
+ * between erases: unit must not be larger than the program unit of the
+ * filesystem (e.g. LFS prog_size). SPIFFS, which rewrites individual
+ * bytes, needs a device that allows overwrites underneath (e.g. compress).
+ *
+ * Requires mbedTLS. Compiled in only if MGOS_VFS_DEV_ENABLE_ENCRYPT is set.
+ */
+
+#ifndef CS_FW_SRC_MGOS_VFS_DEV_ENCRYPT_H_
+#define CS_FW_SRC_MGOS_VFS_DEV_ENCRYPT_H_
+
+#include <stdbool.h>
+
+#include "mgos_vfs_dev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MGOS_VFS_DEV_ENABLE_ENCRYPT
+#define MGOS_VFS_DEV_ENABLE_ENCRYPT 0
+#endif
+
+/* Whole units are encrypted and written this many bytes at a time. */
+#ifndef MGOS_VFS_DEV_ENCRYPT_WRITE_BUF_SIZE
+#define MGOS_VFS_DEV_ENCRYPT_WRITE_BUF_SIZE 4096
+#endif
+
+#define MGOS_VFS_DEV_TYPE_ENCRYPT "encrypt"
+
+bool mgos_vfs_dev_encrypt_register_type(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_FW_SRC_MGOS_VFS_DEV_ENCRYPT_H_ */
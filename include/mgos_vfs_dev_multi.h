@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Devices that combine several registered devices into one.
+ *
+ * "concat" appends the devices one after another.
+ *   Options: {devs: ["dev0", "dev1", ...]}
+ *   Erase size is the largest of the smallest erase sizes of the devices,
+ *   each device size must be a multiple of it.
+ *
+ * "stripe" interleaves the devices in chunks: chunk 0 is on dev0, chunk 1
+ * is on dev1 and so on, so sequential I/O alternates between them.
+ *   Options: {devs: ["dev0", "dev1", ...], chunk: 4096}
+ *   Chunk must be a multiple of the smallest erase sizes of all the devices
+ *   and is also the erase size of the stripe. Default is the largest of the
+ *   smallest erase sizes. Size is that of the smallest device (rounded down
+ *   to the chunk size) times the number of devices.
+ *
+ * Synchronous read, write and erase access the devices one after another.
+ * The asynchronous ones (mgos_vfs_dev_read_async() etc.) start the pieces on
+ * all the devices at once, so they overlap when the drivers implement the
+ * *_async ops. With the generic fallback the pieces still run one after
+ * another on the main task.
+ *
+ * Compiled in only if MGOS_VFS_DEV_ENABLE_MULTI is set.
+ */
+
+#ifndef CS_FW_SRC_MGOS_VFS_DEV_MULTI_H_
+#define CS_FW_SRC_MGOS_VFS_DEV_MULTI_H_
+
+#include <stdbool.h>
+
+#include "mgos_vfs_dev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MGOS_VFS_DEV_ENABLE_MULTI
+#define MGOS_VFS_DEV_ENABLE_MULTI 0
+#endif
+
+#define MGOS_VFS_DEV_TYPE_CONCAT "concat"
+#define MGOS_VFS_DEV_TYPE_STRIPE "stripe"
+
+bool mgos_vfs_dev_multi_register_types(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_FW_SRC_MGOS_VFS_DEV_MULTI_H_ */
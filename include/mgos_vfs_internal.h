@@ -7,6 +7,10 @@
 #define CS_FW_SRC_MGOS_VFS_INTERNAL_H_
 
 #include "mgos_vfs.h"
+#include "mgos_vfs_boot_prof.h"
+#include "mgos_vfs_lock_prof.h"
+#include "mgos_vfs_stats.h"
+#include "mgos_vfs_trace.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -21,6 +25,17 @@ const char *mgos_vfs_get_root_fs_opts(void);
 
 #define MOUNT_ID_FROM_VFD(fd) (((fd) >> 8) & 0xff)
 
+/* Hooks around VFS operations: stats and tracing. */
+#define MGOS_VFS_OP_BEGIN(op, start)                                     \
+  MGOS_VFS_TRACE_BEGIN(MGOS_VFS_TRACE_CAT_VFS, mgos_vfs_op_name(op), 0); \
+  MGOS_VFS_STATS_BEGIN(start)
+#define MGOS_VFS_OP_END(me, op, start, ok, bytes)                  \
+  do {                                                             \
+    MGOS_VFS_STATS_END(me, op, start, ok, bytes);                  \
+    MGOS_VFS_TRACE_END(MGOS_VFS_TRACE_CAT_VFS, mgos_vfs_op_name(op), \
+                       (uint32_t)(bytes));                         \
+  } while (0)
+
 #ifdef __cplusplus
 }
 #endif
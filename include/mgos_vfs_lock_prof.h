@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Wait and hold time accounting for the global VFS lock and per-device
+ * locks, per call site (function that takes the lock).
+ * Compiled in only if MGOS_VFS_ENABLE_LOCK_PROF is set.
+ */
+
+#ifndef CS_FW_SRC_MGOS_VFS_LOCK_PROF_H_
+#define CS_FW_SRC_MGOS_VFS_LOCK_PROF_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frozen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MGOS_VFS_ENABLE_LOCK_PROF
+#define MGOS_VFS_ENABLE_LOCK_PROF 0
+#endif
+
+/* Max number of distinct call sites, the rest are not accounted. */
+#ifndef MGOS_VFS_LOCK_PROF_MAX_SITES
+#define MGOS_VFS_LOCK_PROF_MAX_SITES 48
+#endif
+
+struct mgos_vfs_lock_site {
+  const char *lock; /* "vfs" or "dev". */
+  const char *site; /* Function that took the lock. */
+  uint32_t count;   /* Acquisitions of a lock that was not held already. */
+  uint32_t nested;  /* Acquisitions by a task that already held it. */
+  uint64_t wait_us; /* Time spent waiting for the lock. */
+  uint32_t max_wait_us;
+  uint64_t hold_us; /* Time the lock was held, nested acquisitions included. */
+  uint32_t max_hold_us;
+};
+
+/*
+ * Copy up to max_sites entries to sites (which may be NULL).
+ * Returns the number of call sites recorded.
+ */
+int mgos_vfs_lock_prof_get(struct mgos_vfs_lock_site *sites, int max_sites);
+
+/* Reset all the counters. */
+void mgos_vfs_lock_prof_reset(void);
+
+/*
+ * Print call sites as JSON:
+ *   [{"lock": "vfs", "site": "mgos_vfs_open", "count": 1, "nested": 0,
+ *     "wait_us": 5, "max_wait_us": 5, "hold_us": 20, "max_hold_us": 20}, ...]
+ */
+int mgos_vfs_lock_prof_print_json(struct json_out *out);
+
+#if MGOS_VFS_ENABLE_LOCK_PROF
+/* State of a profiled lock, only modified by the holder. */
+struct mgos_vfs_lock_prof_state {
+  int depth;
+  int site;
+  int64_t acquired;
+};
+
+/* Called after the lock has been taken, wait_start is when we started. */
+void mgos_vfs_lock_prof_acquired(struct mgos_vfs_lock_prof_state *st,
+                                 const char *lock, const char *site,
+                                 int64_t wait_start);
+/* Called before the lock is released. */
+void mgos_vfs_lock_prof_release(struct mgos_vfs_lock_prof_state *st);
+int64_t mgos_vfs_lock_prof_now(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_FW_SRC_MGOS_VFS_LOCK_PROF_H_ */
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Per-mount, per-operation VFS statistics: call and error counts, bytes
+ * transferred and latency histograms.
+ * Compiled in only if MGOS_VFS_ENABLE_STATS is set.
+ */
+
+#ifndef CS_FW_SRC_MGOS_VFS_STATS_H_
+#define CS_FW_SRC_MGOS_VFS_STATS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frozen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MGOS_VFS_ENABLE_STATS
+#define MGOS_VFS_ENABLE_STATS 0
+#endif
+
+/*
+ * Write amplification is tracked if both MGOS_VFS_ENABLE_STATS and
+ * MGOS_VFS_DEV_ENABLE_STATS are set. The rolling window consists of
+ * MGOS_VFS_WAF_WINDOW_SAMPLES samples taken every
+ * MGOS_VFS_WAF_SAMPLE_INTERVAL_MS.
+ */
+#ifndef MGOS_VFS_WAF_SAMPLE_INTERVAL_MS
+#define MGOS_VFS_WAF_SAMPLE_INTERVAL_MS 10000
+#endif
+
+#ifndef MGOS_VFS_WAF_WINDOW_SAMPLES
+#define MGOS_VFS_WAF_WINDOW_SAMPLES 6
+#endif
+
+/*
+ * If set (in addition to MGOS_VFS_ENABLE_STATS), free heap is sampled
+ * before and after each operation. Allocations made by other tasks while
+ * the operation is in progress are attributed to it as well.
+ */
+#ifndef MGOS_VFS_ENABLE_HEAP_STATS
+#define MGOS_VFS_ENABLE_HEAP_STATS 0
+#endif
+
+enum mgos_vfs_op {
+  MGOS_VFS_OP_OPEN = 0,
+  MGOS_VFS_OP_CLOSE,
+  MGOS_VFS_OP_READ,
+  MGOS_VFS_OP_WRITE,
+  MGOS_VFS_OP_STAT,
+  MGOS_VFS_OP_FSTAT,
+  MGOS_VFS_OP_LSEEK,
+  MGOS_VFS_OP_UNLINK,
+  MGOS_VFS_OP_RENAME,
+  MGOS_VFS_OP_OPENDIR,
+  MGOS_VFS_OP_READDIR,
+  MGOS_VFS_OP_GETDENTS,
+  MGOS_VFS_OP_CLOSEDIR,
+  MGOS_VFS_OP_STATVFS,
+  MGOS_VFS_OP_GC,
+  MGOS_VFS_OP_MAX,
+};
+
+/*
+ * Latency histogram: bucket 0 counts calls that took less than 1 us,
+ * bucket i (i > 0) counts calls that took [2^(i-1), 2^i) us,
+ * the last bucket also includes everything above.
+ */
+#define MGOS_VFS_STATS_NUM_BUCKETS 20
+
+struct mgos_vfs_op_stats {
+  uint32_t calls;
+  uint32_t errors;
+  uint64_t bytes;
+  uint64_t total_us;
+  uint32_t max_us;
+  uint32_t hist[MGOS_VFS_STATS_NUM_BUCKETS];
+  /* Heap stats, only with MGOS_VFS_ENABLE_HEAP_STATS. */
+  int64_t heap_delta;      /* Heap retained by all calls, < 0 if released. */
+  int32_t max_heap_delta;  /* Most heap retained by a single call. */
+  uint32_t max_heap_peak;  /* Most heap used by a single call at its peak. */
+  uint32_t heap_low_marks; /* Calls that lowered the min free heap mark. */
+};
+
+struct mgos_vfs_waf {
+  uint64_t app_bytes;   /* Written via mgos_vfs_write(). */
+  uint64_t dev_written; /* Programmed on the device. */
+  uint64_t dev_erased;  /* Erased on the device. */
+  /* dev_written / app_bytes, since the start and over the window. */
+  float waf;
+  float waf_window;
+  /* dev_erased / app_bytes, since the start and over the window. */
+  float erase_factor;
+  float erase_factor_window;
+};
+
+/* Returns short name of the operation, e.g. "read". */
+const char *mgos_vfs_op_name(enum mgos_vfs_op op);
+
+/*
+ * Get stats of the operation for the filesystem mounted at path.
+ * Returns false if there is no such mount or stats are not enabled.
+ */
+bool mgos_vfs_get_op_stats(const char *path, enum mgos_vfs_op op,
+                           struct mgos_vfs_op_stats *st);
+
+/*
+ * Get write amplification for the filesystem mounted at path.
+ * Returns false if there is no such mount, it has no device or
+ * stats are not enabled.
+ */
+bool mgos_vfs_get_waf(const char *path, struct mgos_vfs_waf *waf);
+
+/* Reset stats of all the mounts. */
+void mgos_vfs_reset_stats(void);
+
+/*
+ * Print stats of all the mounts as JSON:
+ *   {"/": {"read": {"calls": 1, "errors": 0, "bytes": 10, "total_us": 5,
+ *                   "max_us": 5, "hist": [0, 0, 0, 1, ...]}, ...}, ...}
+ * Operations that have not been called are omitted.
+ * If write amplification is tracked, it is included as
+ *   "waf": {"app_bytes": 100, "dev_written": 256, ...}.
+ * If heap stats are enabled, each operation also has
+ *   "heap": {"delta": 0, "max_delta": 64, "max_peak": 300, "low_marks": 1}.
+ */
+int mgos_vfs_stats_print_json(struct json_out *out);
+
+#if MGOS_VFS_ENABLE_STATS
+struct mgos_vfs_stats;
+struct mgos_vfs_dev;
+
+/* State captured at the start of an operation. */
+struct mgos_vfs_stats_start {
+  int64_t ts;
+#if MGOS_VFS_ENABLE_HEAP_STATS
+  size_t free_heap;
+  size_t min_free_heap;
+#endif
+};
+
+/* Used by the VFS to manage per-mount stats and record operations. */
+struct mgos_vfs_stats *mgos_vfs_stats_create(const char *prefix,
+                                             struct mgos_vfs_dev *dev);
+void mgos_vfs_stats_free(struct mgos_vfs_stats *s);
+int64_t mgos_vfs_stats_now(void);
+void mgos_vfs_stats_begin(struct mgos_vfs_stats_start *start);
+void mgos_vfs_stats_record(struct mgos_vfs_stats *s, enum mgos_vfs_op op,
+                           const struct mgos_vfs_stats_start *start, bool ok,
+                           size_t bytes);
+
+#define MGOS_VFS_STATS_BEGIN(start)     \
+  struct mgos_vfs_stats_start start; \
+  mgos_vfs_stats_begin(&(start))
+#define MGOS_VFS_STATS_END(me, op, start, ok, bytes)                       \
+  do {                                                                     \
+    if ((me) != NULL) {                                                    \
+      mgos_vfs_stats_record((me)->stats, (op), &(start), (ok), (bytes)); \
+    }                                                                      \
+  } while (0)
+#else
+#define MGOS_VFS_STATS_BEGIN(start) (void) 0
+#define MGOS_VFS_STATS_END(me, op, start, ok, bytes) (void) 0
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_FW_SRC_MGOS_VFS_STATS_H_ */
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Timeline of VFS and device operations, recorded into a RAM ring buffer
+ * and exported in the Chrome trace event format (chrome://tracing,
+ * Perfetto). Compiled in only if MGOS_VFS_ENABLE_TRACE is set.
+ */
+
+#ifndef CS_FW_SRC_MGOS_VFS_TRACE_H_
+#define CS_FW_SRC_MGOS_VFS_TRACE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frozen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MGOS_VFS_ENABLE_TRACE
+#define MGOS_VFS_ENABLE_TRACE 0
+#endif
+
+/* Size of the ring buffer, oldest events are overwritten. */
+#ifndef MGOS_VFS_TRACE_NUM_EVENTS
+#define MGOS_VFS_TRACE_NUM_EVENTS 512
+#endif
+
+/*
+ * Events are attributed to the calling task (FreeRTOS task handle), so
+ * operations of different tasks are shown on separate tracks. Without it
+ * all events go to one track.
+ */
+#ifndef MGOS_VFS_TRACE_FREERTOS
+#define MGOS_VFS_TRACE_FREERTOS 0
+#endif
+
+/* Max number of distinct tasks, events of the rest share the last track. */
+#ifndef MGOS_VFS_TRACE_MAX_TASKS
+#define MGOS_VFS_TRACE_MAX_TASKS 8
+#endif
+
+enum mgos_vfs_trace_cat {
+  MGOS_VFS_TRACE_CAT_VFS = 0,
+  MGOS_VFS_TRACE_CAT_DEV = 1,
+};
+
+/*
+ * Start or stop recording. The buffer is allocated when recording starts
+ * for the first time and is kept (with the events) when it stops.
+ */
+bool mgos_vfs_trace_enable(bool enable);
+
+/* Drop recorded events. */
+void mgos_vfs_trace_clear(void);
+
+/*
+ * Print recorded events as a Chrome trace:
+ *   {"traceEvents": [{"name": "read", "cat": "vfs", "ph": "B", "ts": 123,
+ *                     "pid": 0, "tid": 1}, ...]}
+ * tid is a small number assigned to each task in order of appearance.
+ */
+int mgos_vfs_trace_print_json(struct json_out *out);
+
+#if MGOS_VFS_ENABLE_TRACE
+/* Record an event, ph is 'B' (begin) or 'E' (end). name must be static. */
+void mgos_vfs_trace_event(enum mgos_vfs_trace_cat cat, const char *name,
+                          char ph, uint32_t arg);
+
+#define MGOS_VFS_TRACE_BEGIN(cat, name, arg) \
+  mgos_vfs_trace_event((cat), (name), 'B', (arg))
+#define MGOS_VFS_TRACE_END(cat, name, arg) \
+  mgos_vfs_trace_event((cat), (name), 'E', (arg))
+#else
+#define MGOS_VFS_TRACE_BEGIN(cat, name, arg) (void) 0
+#define MGOS_VFS_TRACE_END(cat, name, arg) (void) 0
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_FW_SRC_MGOS_VFS_TRACE_H_ */
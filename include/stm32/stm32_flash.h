@@ -44,6 +44,13 @@ bool stm32_flash_region_is_erased(int offset, int len);
 /* Verify that a sector is erased */
 bool stm32_flash_sector_is_erased(int sector);
 
+/*
+ * Unlock flash control for a series of writes and erases, calls nest.
+ * Writes and erases do this themselves, this only saves re-locking.
+ */
+void stm32_flash_unlock(void);
+void stm32_flash_lock(void);
+
 #ifdef STM32L4
 #define FLASH_ERR_FLAGS                                        \
   (FLASH_FLAG_OPERR | FLASH_FLAG_PROGERR | FLASH_FLAG_WRPERR | \
@@ -20,6 +20,7 @@
 #include "frozen.h"
 
 #include "mgos_vfs.h"
+#include "mgos_vfs_boot_prof.h"
 #include "mgos_vfs_fs_spiffs.h"
 
 #include "cc32xx_fs.h"
@@ -42,6 +43,8 @@ bool cc3200_fs_container_mount(const char *path, const char *container_prefix) {
 }
 
 bool mgos_core_fs_init(void) {
+  bool res = false;
+  MGOS_VFS_BOOT_FS_INIT_BEGIN();
   if (!(
 #ifdef MGOS_HAVE_OTA_COMMON
           cc3200_fs_container_mount("/",
@@ -50,12 +53,16 @@ bool mgos_core_fs_init(void) {
           cc3200_fs_container_mount("/", "spiffs.img.0") &&
 #endif
           cc32xx_fs_slfs_mount("/slfs"))) {
-    return false;
+    goto out;
   }
-  return true;
+  res = true;
+out:
+  MGOS_VFS_BOOT_PHASE_END(res);
+  return res;
 }
 
 bool mgos_vfs_common_init(void) {
-  return (cc3200_vfs_dev_slfs_container_register_type() &&
+  return (mgos_vfs_dev_init() &&
+          cc3200_vfs_dev_slfs_container_register_type() &&
           cc32xx_vfs_fs_slfs_register_type());
 }
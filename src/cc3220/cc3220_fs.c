@@ -18,6 +18,7 @@
 #include "common/str_util.h"
 
 #include "mgos_vfs.h"
+#include "mgos_vfs_boot_prof.h"
 #include "mgos_vfs_fs_spiffs.h"
 
 #include "cc32xx_fs.h"
@@ -26,8 +27,9 @@
 #include "cc3220_vfs_dev_flash.h"
 
 bool mgos_core_fs_init(void) {
+  MGOS_VFS_BOOT_FS_INIT_BEGIN();
   // clang-format off
-  return (mgos_vfs_mount(
+  bool res = (mgos_vfs_mount(
              "/", MGOS_DEV_TYPE_FLASH,
              "{offset: " CS_STRINGIFY_MACRO(MGOS_FS_OFFSET) ", "
              "size: " CS_STRINGIFY_MACRO(MGOS_FS_SIZE) ", "
@@ -38,9 +40,12 @@ bool mgos_core_fs_init(void) {
              "es: " CS_STRINGIFY_MACRO(MGOS_FS_ERASE_SIZE) "}") &&
          cc32xx_fs_slfs_mount("/slfs"));
   // clang-format on
+  MGOS_VFS_BOOT_PHASE_END(res);
+  return res;
 }
 
 bool mgos_vfs_common_init(void) {
-  return (cc3220_vfs_dev_flash_register_type() &&
+  return (mgos_vfs_dev_init() &&
+          cc3220_vfs_dev_flash_register_type() &&
           cc32xx_vfs_fs_slfs_register_type());
 }
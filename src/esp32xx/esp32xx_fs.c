@@ -92,24 +92,37 @@ static void esp32xx_register_partition_devs(void) {
 }
 
 bool mgos_core_fs_init(void) {
+  bool res = false;
+  const esp_partition_t *fs_part = NULL;
+  MGOS_VFS_BOOT_FS_INIT_BEGIN();
 #if CS_SPIFFS_ENABLE_ENCRYPTION
-  if (esp_flash_encryption_enabled() && !esp32xx_fs_crypt_init()) {
-    LOG(LL_ERROR, ("Failed to initialize FS encryption key"));
-    return MGOS_INIT_FS_INIT_FAILED;
+  if (esp_flash_encryption_enabled()) {
+    MGOS_VFS_BOOT_PHASE_BEGIN("crypt_init", NULL);
+    bool crypt_ok = esp32xx_fs_crypt_init();
+    MGOS_VFS_BOOT_PHASE_END(crypt_ok);
+    if (!crypt_ok) {
+      LOG(LL_ERROR, ("Failed to initialize FS encryption key"));
+      goto out;
+    }
   }
 #endif
+  MGOS_VFS_BOOT_PHASE_BEGIN("register_devs", NULL);
   esp32xx_register_partition_devs();
-  const esp_partition_t *fs_part =
-      esp32xx_find_fs_for_app_slot(esp32xx_get_boot_slot());
+  MGOS_VFS_BOOT_PHASE_END(true);
+  fs_part = esp32xx_find_fs_for_app_slot(esp32xx_get_boot_slot());
   if (fs_part == NULL) {
     LOG(LL_ERROR, ("No FS partition"));
-    return false;
+    goto out;
   }
-  return esp32xx_fs_mount_part(fs_part->label, "/", mgos_vfs_get_root_fs_type(),
-                               mgos_vfs_get_root_fs_opts());
+  res = esp32xx_fs_mount_part(fs_part->label, "/", mgos_vfs_get_root_fs_type(),
+                              mgos_vfs_get_root_fs_opts());
+out:
+  MGOS_VFS_BOOT_PHASE_END(res);
+  return res;
 }
 
 bool mgos_vfs_common_init(void) {
+  if (!mgos_vfs_dev_init()) return false;
   esp_vfs_t esp_vfs = {
     .flags = ESP_VFS_FLAG_DEFAULT,
     /* ESP API uses void * as first argument, hence all the ugly casts. */
@@ -126,6 +139,8 @@ bool mgos_vfs_common_init(void) {
     .opendir = mgos_vfs_opendir,
     .readdir = mgos_vfs_readdir,
     .closedir = mgos_vfs_closedir,
+    .telldir = mgos_vfs_telldir,
+    .seekdir = mgos_vfs_seekdir,
 #endif
   };
   if (esp_vfs_register("", &esp_vfs, NULL) != ESP_OK) {
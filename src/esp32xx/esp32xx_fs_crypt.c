@@ -17,10 +17,14 @@
 
 #ifdef MGOS_HAVE_VFS_FS_SPIFFS
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "spiffs.h"
 #include "spiffs_nucleus.h"
 
 #include "esp_spi_flash.h"
+#include "nvs.h"
 
 #include "mbedtls/aes.h"
 
@@ -53,54 +57,155 @@
  *   - AES-256 in CBC mode (but no chaining, only single block mode).
  *   - Key derived by using hardware flash decryption of 32 bytes of 0xff.
  *   - For each encryption, object id and file offset are used to set up an IV.
+ *   - Decryption is batched, see mgos_vfs_fs_spiffs_decrypt_block().
  */
 
 mbedtls_aes_context s_aes_ctx_enc, s_aes_ctx_dec;
 
-bool esp32xx_fs_crypt_init(void) {
-  uint8_t tmp[32];
-  uint32_t addr = 0;
-  for (addr = 0; addr < spi_flash_get_chip_size(); addr += 32) {
+/*
+ * The seed address is stored in NVS: it is only looked up by scanning on
+ * first boot. This also keeps the key stable if the area before the seed
+ * becomes blank later (e.g. after an erase).
+ */
+#define FS_CRYPT_NVS_NAMESPACE "mgos_vfs"
+#define FS_CRYPT_NVS_SEED_KEY "fs_seed"
+#define FS_CRYPT_SEED_SIZE 32
+#define FS_CRYPT_SCAN_CHUNK_SIZE 4096
+
+static bool fs_crypt_is_blank(const uint32_t *p, size_t len) {
+  size_t i;
+  for (i = 0; i < len / sizeof(*p); i++) {
+    if (p[i] != 0xffffffff) return false;
+  }
+  return true;
+}
+
+static bool fs_crypt_seed_is_blank(uint32_t addr) {
+  uint32_t tmp[FS_CRYPT_SEED_SIZE / sizeof(uint32_t)];
+  if (spi_flash_read(addr, tmp, sizeof(tmp)) != ESP_OK) return false;
+  return fs_crypt_is_blank(tmp, sizeof(tmp));
+}
+
+static bool fs_crypt_load_seed_addr(uint32_t *addr) {
+  nvs_handle h;
+  bool res = false;
+  if (nvs_open(FS_CRYPT_NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+    return false;
+  }
+  res = (nvs_get_u32(h, FS_CRYPT_NVS_SEED_KEY, addr) == ESP_OK);
+  nvs_close(h);
+  return res;
+}
+
+static void fs_crypt_save_seed_addr(uint32_t addr) {
+  nvs_handle h;
+  bool res = false;
+  if (nvs_open(FS_CRYPT_NVS_NAMESPACE, NVS_READWRITE, &h) == ESP_OK) {
+    res = (nvs_set_u32(h, FS_CRYPT_NVS_SEED_KEY, addr) == ESP_OK &&
+           nvs_commit(h) == ESP_OK);
+    nvs_close(h);
+  }
+  if (!res) {
+    /* Not fatal, will scan again on next boot. */
+    LOG(LL_WARN, ("Failed to save FS encryption seed address"));
+  }
+}
+
+/* Find the first blank seed-sized area, reading flash in large chunks. */
+static bool fs_crypt_scan_seed(uint32_t *addr) {
+  bool res = false;
+  uint32_t a, off, chip_size = spi_flash_get_chip_size();
+  uint32_t *buf = (uint32_t *) malloc(FS_CRYPT_SCAN_CHUNK_SIZE);
+  if (buf == NULL) return false;
+  for (a = 0; a < chip_size && !res; a += FS_CRYPT_SCAN_CHUNK_SIZE) {
+    uint32_t n = chip_size - a;
+    if (n > FS_CRYPT_SCAN_CHUNK_SIZE) n = FS_CRYPT_SCAN_CHUNK_SIZE;
     mgos_wdt_feed();
-    if (spi_flash_read(addr, tmp, sizeof(tmp)) != ESP_OK) {
-      LOG(LL_ERROR, ("SPI read error at 0x%x", addr));
-      return false;
+    if (spi_flash_read(a, buf, n) != ESP_OK) {
+      LOG(LL_ERROR, ("SPI read error at 0x%x", a));
+      break;
     }
-    int j;
-    for (j = 0; j < sizeof(tmp); j++) {
-      if (tmp[j] != 0xff) break;
+    for (off = 0; off + FS_CRYPT_SEED_SIZE <= n; off += FS_CRYPT_SEED_SIZE) {
+      if (fs_crypt_is_blank(buf + off / sizeof(*buf), FS_CRYPT_SEED_SIZE)) {
+        *addr = a + off;
+        res = true;
+        break;
+      }
     }
-    if (j < sizeof(tmp)) continue;
-    /* Found a suitably empty location, now decrypt it. */
-    if (spi_flash_read_encrypted(addr, tmp, sizeof(tmp)) != ESP_OK) {
-      LOG(LL_ERROR, ("SPI encrypted read error at 0x%x", addr));
+  }
+  free(buf);
+  return res;
+}
+
+bool esp32xx_fs_crypt_init(void) {
+  uint8_t tmp[FS_CRYPT_SEED_SIZE];
+  uint32_t addr = 0;
+  bool saved = fs_crypt_load_seed_addr(&addr);
+  if (saved && !fs_crypt_seed_is_blank(addr)) {
+    LOG(LL_ERROR, ("FS encryption seed area @ 0x%x is no longer blank, "
+                   "data encrypted with the old key cannot be read",
+                   addr));
+    saved = false;
+  }
+  if (!saved) {
+    if (!fs_crypt_scan_seed(&addr)) {
+      LOG(LL_ERROR, ("Could not find a suitable seed area for FS encryption"));
       return false;
     }
-    /* Now in tmp we have 32 x 0xff processed with the flash encryption key. */
-    mbedtls_aes_init(&s_aes_ctx_enc);
-    mbedtls_aes_setkey_enc(&s_aes_ctx_enc, tmp, 256);
-    mbedtls_aes_init(&s_aes_ctx_dec);
-    mbedtls_aes_setkey_dec(&s_aes_ctx_dec, tmp, 256);
-    LOG(LL_INFO, ("FS encryption key set up, seed @ 0x%x", addr));
-    return true;
+    fs_crypt_save_seed_addr(addr);
+  }
+  /* Found a suitably empty location, now decrypt it. */
+  if (spi_flash_read_encrypted(addr, tmp, sizeof(tmp)) != ESP_OK) {
+    LOG(LL_ERROR, ("SPI encrypted read error at 0x%x", addr));
+    return false;
   }
-  LOG(LL_ERROR, ("Could not a suitable seed area for FS encryption"));
-  return false;
+  /* Now in tmp we have 32 x 0xff processed with the flash encryption key. */
+  mbedtls_aes_init(&s_aes_ctx_enc);
+  mbedtls_aes_setkey_enc(&s_aes_ctx_enc, tmp, 256);
+  mbedtls_aes_init(&s_aes_ctx_dec);
+  mbedtls_aes_setkey_dec(&s_aes_ctx_dec, tmp, 256);
+  LOG(LL_INFO, ("FS encryption key set up, seed @ 0x%x%s", addr,
+                (saved ? "" : " (scanned)")));
+  return true;
+}
+
+/*
+ * Blocks are processed in chunks, each chunk is decrypted with a single CBC
+ * call (which on chips with AES DMA is done by DMA) and then fixed up:
+ * CBC XORs block i with ciphertext i-1 instead of its own IV.
+ */
+#define FS_CRYPT_CHUNK_SIZE 256
+
+static void fs_crypt_iv(spiffs_obj_id obj_id, uint32_t offset, uint32_t *iv) {
+  iv[0] = 0xdeadbeef;
+  iv[1] = obj_id;
+  iv[2] = 0x900df00d;
+  iv[3] = offset;
+}
+
+static void fs_crypt_xor(uint8_t *dst, const uint8_t *src) {
+  int i;
+  for (i = 0; i < 16; i++) dst[i] ^= src[i];
 }
 
 bool mgos_vfs_fs_spiffs_encrypt_block(spiffs_obj_id obj_id, uint32_t offset,
                                       void *data, uint32_t len) {
   if (len % 16 != 0) return false;
   uint8_t *p = (uint8_t *) data;
+  uint32_t iv[4];
+  /*
+   * Blocks are not chained, so CBC cannot be used for more than one block.
+   * Pre-XOR IVs and encrypt each block with ECB, which needs no IV setup.
+   */
+  fs_crypt_iv(obj_id, offset, iv);
   while (len > 0) {
-    uint32_t iv[4] = {0xdeadbeef, obj_id, 0x900df00d, offset};
-    if (mbedtls_aes_crypt_cbc(&s_aes_ctx_enc, MBEDTLS_AES_ENCRYPT, 16,
-                              (uint8_t *) iv, p, p) != 0) {
+    fs_crypt_xor(p, (const uint8_t *) iv);
+    if (mbedtls_aes_crypt_ecb(&s_aes_ctx_enc, MBEDTLS_AES_ENCRYPT, p, p) != 0) {
       return false;
     }
     p += 16;
     len -= 16;
-    offset += 16;
+    iv[3] += 16;
   }
   return true;
 }
@@ -109,15 +214,26 @@ bool mgos_vfs_fs_spiffs_decrypt_block(spiffs_obj_id obj_id, uint32_t offset,
                                       void *data, uint32_t len) {
   if (len % 16 != 0) return false;
   uint8_t *p = (uint8_t *) data;
+  uint8_t ct[FS_CRYPT_CHUNK_SIZE];
+  uint32_t iv[4], cbc_iv[4];
   while (len > 0) {
-    uint32_t iv[4] = {0xdeadbeef, obj_id, 0x900df00d, offset};
-    if (mbedtls_aes_crypt_cbc(&s_aes_ctx_dec, MBEDTLS_AES_DECRYPT, 16,
-                              (uint8_t *) iv, p, p) != 0) {
+    uint32_t i, n = (len < sizeof(ct) ? len : sizeof(ct));
+    /* Keep the ciphertext for the fixup. */
+    memcpy(ct, p, n);
+    fs_crypt_iv(obj_id, offset, iv);
+    memcpy(cbc_iv, iv, sizeof(cbc_iv));
+    if (mbedtls_aes_crypt_cbc(&s_aes_ctx_dec, MBEDTLS_AES_DECRYPT, n,
+                              (uint8_t *) cbc_iv, ct, p) != 0) {
       return false;
     }
-    p += 16;
-    len -= 16;
-    offset += 16;
+    for (i = 16; i < n; i += 16) {
+      iv[3] = offset + i;
+      fs_crypt_xor(p + i, ct + i - 16);
+      fs_crypt_xor(p + i, (const uint8_t *) iv);
+    }
+    p += n;
+    len -= n;
+    offset += n;
   }
   return true;
 }
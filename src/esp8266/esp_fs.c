@@ -46,13 +46,16 @@ bool mgos_core_fs_init(void) {
   rboot_config *bcfg = get_rboot_config();
   uint32_t root_fs_addr = bcfg->fs_addresses[bcfg->current_rom];
   uint32_t root_fs_size = bcfg->fs_sizes[bcfg->current_rom];
-  return (mgos_vfs_dev_create_and_register(MGOS_VFS_DEV_TYPE_SYSFLASH, "",
-                                           ESP8266_SYSFLASH_DEV_NAME) &&
-          esp_fs_mount2(root_fs_addr, root_fs_size, MGOS_VFS_ROOT_DEV_NAME,
-                        mgos_vfs_get_root_fs_type(),
-                        mgos_vfs_get_root_fs_opts(), "/"));
+  MGOS_VFS_BOOT_FS_INIT_BEGIN();
+  bool res = (mgos_vfs_dev_create_and_register(MGOS_VFS_DEV_TYPE_SYSFLASH, "",
+                                               ESP8266_SYSFLASH_DEV_NAME) &&
+              esp_fs_mount2(root_fs_addr, root_fs_size, MGOS_VFS_ROOT_DEV_NAME,
+                            mgos_vfs_get_root_fs_type(),
+                            mgos_vfs_get_root_fs_opts(), "/"));
+  MGOS_VFS_BOOT_PHASE_END(res);
+  return res;
 }
 
 bool mgos_vfs_common_init(void) {
-  return esp_vfs_dev_sysflash_register_type();
+  return (mgos_vfs_dev_init() && esp_vfs_dev_sysflash_register_type());
 }
@@ -17,6 +17,7 @@
 
 #include "mgos_vfs_internal.h"
 
+#include <fcntl.h>
 #include <string.h>
 #if MGOS_VFS_DEFINE_LIBC_REENT_API
 #include <sys/reent.h>
@@ -44,6 +45,12 @@
 
 #define MAKE_VFD(mount_id, fs_fd) (((mount_id) << 8) | ((fs_fd) &0xff))
 
+#if MG_ENABLE_DIRECTORY_LISTING && MGOS_VFS_DCACHE_MAX_SIZE > 0
+#define MGOS_VFS_ENABLE_DCACHE 1
+#else
+#define MGOS_VFS_ENABLE_DCACHE 0
+#endif
+
 struct mgos_vfs_fs_type_entry {
   const char *type;
   const struct mgos_vfs_fs_ops *ops;
@@ -58,9 +65,53 @@ struct mgos_vfs_mount_entry {
   char *prefix;
   size_t prefix_len;
   struct mgos_vfs_fs *fs;
+  /* Cached space info, valid while st_gen == fs->gen. */
+  struct mgos_vfs_statvfs st;
+  uint32_t st_gen;
+  bool st_valid;
+#if MGOS_VFS_ENABLE_DCACHE
+  /* Cached directory listing and its invalidation counter. */
+  struct mgos_vfs_dcache *dc;
+  uint32_t dc_epoch;
+  /* A listing is being filled by one of the open DIRs. Only one at a time,
+   * so the size limit holds per mount. */
+  bool dc_filling;
+#endif
+#if MGOS_VFS_ENABLE_STATS
+  struct mgos_vfs_stats *stats;
+#endif
   SLIST_ENTRY(mgos_vfs_mount_entry) next;
 };
 
+#if MGOS_VFS_ENABLE_DCACHE
+/* Listing of one directory, shared by the mount entry and open DIRs. */
+struct mgos_vfs_dcache {
+  char *fs_path;
+  /* Raw entries, including special ones, as consecutive NUL-terminated
+   * strings. Position of an entry is its index. */
+  char *names;
+  size_t len, cap;
+  int refs;
+};
+
+static void mgos_vfs_dcache_unref(struct mgos_vfs_dcache *dc) {
+  if (dc == NULL || --dc->refs > 0) return;
+  free(dc->fs_path);
+  free(dc->names);
+  free(dc);
+}
+
+/* Must be called with VFS locked. */
+static void mgos_vfs_dcache_invalidate(struct mgos_vfs_mount_entry *me) {
+  mgos_vfs_dcache_unref(me->dc);
+  me->dc = NULL;
+  me->dc_epoch++;
+}
+#else
+#define mgos_vfs_dcache_unref(dc) (void) 0
+#define mgos_vfs_dcache_invalidate(me) (void) 0
+#endif
+
 SLIST_HEAD(s_mounts, mgos_vfs_mount_entry)
 s_mounts = SLIST_HEAD_INITIALIZER(s_mounts);
 
@@ -81,6 +132,22 @@ bool mgos_vfs_fs_register_type(const char *type,
   return true;
 }
 
+#if MGOS_VFS_ENABLE_LOCK_PROF
+static struct mgos_vfs_lock_prof_state s_lock_prof;
+
+#define mgos_vfs_lock() mgos_vfs_lock_at(__func__)
+
+static inline void mgos_vfs_lock_at(const char *site) {
+  int64_t start = mgos_vfs_lock_prof_now();
+  mgos_lock();
+  mgos_vfs_lock_prof_acquired(&s_lock_prof, "vfs", site, start);
+}
+
+static inline void mgos_vfs_unlock(void) {
+  mgos_vfs_lock_prof_release(&s_lock_prof);
+  mgos_unlock();
+}
+#else
 static inline void mgos_vfs_lock(void) {
   mgos_lock();
 }
@@ -88,6 +155,7 @@ static inline void mgos_vfs_lock(void) {
 static inline void mgos_vfs_unlock(void) {
   mgos_unlock();
 }
+#endif
 
 static const struct mgos_vfs_fs_type_entry *find_fs_type(const char *fs_type) {
   if (fs_type == NULL) return NULL;
@@ -145,6 +213,7 @@ bool mgos_vfs_mount_dev(const char *path, struct mgos_vfs_dev *dev,
     return false;
   }
   if (fs_type == NULL) {
+    MGOS_VFS_BOOT_PHASE_BEGIN("probe", dev->name);
 #ifdef MGOS_HAVE_VFS_FS_LFS
     if (mgos_vfs_fs_lfs_probe(dev)) {
       fs_type = MGOS_VFS_FS_TYPE_LFS;
@@ -159,8 +228,10 @@ bool mgos_vfs_mount_dev(const char *path, struct mgos_vfs_dev *dev,
 #endif
     {
       LOG(LL_ERROR, ("FS type for %s could not be detected", dev->name));
+      MGOS_VFS_BOOT_PHASE_END(false);
       return false;
     }
+    MGOS_VFS_BOOT_PHASE_END(true);
   }
   const struct mgos_vfs_fs_type_entry *fte = find_fs_type(fs_type);
   if (fte == NULL) return false;
@@ -172,12 +243,17 @@ bool mgos_vfs_mount_dev(const char *path, struct mgos_vfs_dev *dev,
   fs->dev = dev;
   LOG(LL_INFO, ("%s: %s @ %s, opts %s", path, fs_type,
                 (dev->name ? dev->name : ""), fs_opts));
+  MGOS_VFS_BOOT_PHASE_BEGIN("mount", path);
   if (fs->ops->mount(fs, fs_opts)) {
     mgos_vfs_hal_mount(path, fs);
+    MGOS_VFS_BOOT_PHASE_END(true);
+    MGOS_VFS_BOOT_PHASE_BEGIN("fs_info", path);
     mgos_vfs_print_fs_info(path);
+    MGOS_VFS_BOOT_PHASE_END(true);
     if (fs->dev != NULL) fs->dev->refs++;
     return true;
   } else {
+    MGOS_VFS_BOOT_PHASE_END(false);
     free(fs);
     LOG(LL_INFO, ("FS %s %s: mount failed", fs_type, fs_opts));
     return false;
@@ -332,20 +408,45 @@ bool mgos_vfs_hal_mount(const char *path, struct mgos_vfs_fs *fs) {
   me->prefix = strdup(path);
   me->prefix_len = strlen(path);
   me->fs = fs;
+#if MGOS_VFS_ENABLE_STATS
+  me->stats = mgos_vfs_stats_create(path, fs->dev);
+#endif
   SLIST_INSERT_HEAD(&s_mounts, me, next);
   mgos_vfs_unlock();
   return true;
 }
 
-void mgos_vfs_print_fs_info(const char *path) {
-  struct mgos_vfs_mount_entry *me = find_mount_by_path(path, NULL);
-  if (me == NULL) return;
+/* Must be called with VFS locked. */
+static bool mgos_vfs_statvfs_me(struct mgos_vfs_mount_entry *me,
+                                struct mgos_vfs_statvfs *st) {
   struct mgos_vfs_fs *fs = me->fs;
+  /* Sample the generation before asking the FS, so that a change that
+   * happens concurrently invalidates the result. */
+  uint32_t gen = fs->gen;
+  if (!me->st_valid || me->st_gen != gen) {
+    if (fs->ops->statvfs != NULL) {
+      if (!fs->ops->statvfs(fs, &me->st)) {
+        me->st_valid = false;
+        return false;
+      }
+    } else {
+      me->st.space_total = fs->ops->get_space_total(fs);
+      me->st.space_used = fs->ops->get_space_used(fs);
+      me->st.space_free = fs->ops->get_space_free(fs);
+    }
+    me->st_gen = gen;
+    me->st_valid = true;
+  }
+  *st = me->st;
+  return true;
+}
+
+void mgos_vfs_print_fs_info(const char *path) {
+  struct mgos_vfs_statvfs st;
+  if (!mgos_vfs_statvfs(path, &st)) return;
   LOG(LL_INFO, ("%s: size %u, used: %u, free: %u", path,
-                (unsigned int) fs->ops->get_space_total(fs),
-                (unsigned int) fs->ops->get_space_used(fs),
-                (unsigned int) fs->ops->get_space_free(fs)));
-  fs->refs--;
+                (unsigned int) st.space_total, (unsigned int) st.space_used,
+                (unsigned int) st.space_free));
 }
 
 int mgos_vfs_open(const char *path, int flags, int mode) {
@@ -353,6 +454,7 @@ int mgos_vfs_open(const char *path, int flags, int mode) {
   char *fs_path = NULL;
   struct mgos_vfs_mount_entry *me = find_mount_by_path(path, &fs_path);
   struct mgos_vfs_fs *fs = NULL;
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_OPEN, start);
   mgos_vfs_lock();
   if (me == NULL) {
     errno = ENOENT;
@@ -360,6 +462,8 @@ int mgos_vfs_open(const char *path, int flags, int mode) {
   }
   fs = me->fs;
   fs_fd = fs->ops->open(fs, fs_path, flags, mode);
+  if (flags & (O_CREAT | O_TRUNC)) fs->gen++;
+  if ((flags & O_CREAT) && fs_fd >= 0) mgos_vfs_dcache_invalidate(me);
   if (fs_fd >= 0) {
     if (fs_fd <= 0xff) {
       vfd = MAKE_VFD(me->mount_id, fs_fd);
@@ -371,6 +475,7 @@ int mgos_vfs_open(const char *path, int flags, int mode) {
     vfd = fs_fd;
   }
 out:
+  MGOS_VFS_OP_END(me, MGOS_VFS_OP_OPEN, start, (vfd >= 0), 0);
   mgos_vfs_unlock();
   LOG(LL_DEBUG,
       ("%s %s 0x%x 0x%x => %p %s %d => %d (refs %d)", "open", path, flags, mode,
@@ -394,6 +499,7 @@ int mgos_vfs_close(int vfd) {
   int ret = -1, fs_fd = MGOS_VFS_VFD_TO_FS_FD(vfd);
   struct mgos_vfs_mount_entry *me = find_mount_by_vfd(vfd);
   struct mgos_vfs_fs *fs = NULL;
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_CLOSE, start);
   mgos_vfs_lock();
   if (me == NULL) {
     errno = EBADF;
@@ -401,7 +507,10 @@ int mgos_vfs_close(int vfd) {
   }
   fs = me->fs;
   ret = fs->ops->close(fs, fs_fd);
+  /* Buffered data may be flushed on close. */
+  fs->gen++;
 out:
+  MGOS_VFS_OP_END(me, MGOS_VFS_OP_CLOSE, start, (ret == 0), 0);
   if (ret == 0) {
     me->fs->refs--;
   }
@@ -426,6 +535,7 @@ ssize_t mgos_vfs_read(int vfd, void *dst, size_t len) {
   int ret = -1, fs_fd = MGOS_VFS_VFD_TO_FS_FD(vfd);
   struct mgos_vfs_mount_entry *me = find_mount_by_vfd(vfd);
   struct mgos_vfs_fs *fs = NULL;
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_READ, start);
   if (me == NULL) {
     errno = EBADF;
     goto out;
@@ -433,6 +543,8 @@ ssize_t mgos_vfs_read(int vfd, void *dst, size_t len) {
   fs = me->fs;
   ret = fs->ops->read(fs, fs_fd, dst, len);
 out:
+  MGOS_VFS_OP_END(me, MGOS_VFS_OP_READ, start, (ret >= 0),
+                     (ret > 0 ? ret : 0));
   LOG(LL_VERBOSE_DEBUG, ("%s %d %u => %p:%d => %d", "read", vfd,
                          (unsigned int) len, fs, fs_fd, ret));
   return ret;
@@ -455,12 +567,13 @@ ssize_t mgos_vfs_write(int vfd, const void *src, size_t len) {
   int mid = MOUNT_ID_FROM_VFD(vfd);
   struct mgos_vfs_mount_entry *me = NULL;
   struct mgos_vfs_fs *fs = NULL;
-  /* Handle stdout and stderr. */
+  /* Handle stdout and stderr, these are not counted or traced. */
+  if (mid == 0 && (fs_fd == 1 || fs_fd == 2)) {
+    mgos_debug_write(fs_fd, src, len);
+    return len;
+  }
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_WRITE, start);
   if (mid == 0) {
-    if (fs_fd == 1 || fs_fd == 2) {
-      mgos_debug_write(fs_fd, src, len);
-      return len;
-    }
     errno = EBADF;
     goto out;
   }
@@ -471,7 +584,10 @@ ssize_t mgos_vfs_write(int vfd, const void *src, size_t len) {
   }
   fs = me->fs;
   ret = fs->ops->write(fs, fs_fd, src, len);
+  if (ret > 0) fs->gen++;
 out:
+  MGOS_VFS_OP_END(me, MGOS_VFS_OP_WRITE, start, (ret >= 0),
+                     (ret > 0 ? ret : 0));
   LOG(LL_DEBUG, ("%s %d %u => %p:%d => %d", "write", vfd, (unsigned int) len,
                  fs, fs_fd, (int) ret));
   return ret;
@@ -493,6 +609,7 @@ int mgos_vfs_stat(const char *path, struct stat *st) {
   char *fs_path = NULL;
   struct mgos_vfs_mount_entry *me = find_mount_by_path(path, &fs_path);
   struct mgos_vfs_fs *fs = NULL;
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_STAT, start);
   mgos_vfs_lock();
   if (me == NULL) {
     errno = ENOENT;
@@ -501,6 +618,7 @@ int mgos_vfs_stat(const char *path, struct stat *st) {
   fs = me->fs;
   ret = fs->ops->stat(fs, fs_path, st);
 out:
+  MGOS_VFS_OP_END(me, MGOS_VFS_OP_STAT, start, (ret == 0), 0);
   if (me != NULL) me->fs->refs--;
   mgos_vfs_unlock();
   LOG(LL_DEBUG,
@@ -525,6 +643,7 @@ int mgos_vfs_fstat(int vfd, struct stat *st) {
   int ret = -1, fs_fd = MGOS_VFS_VFD_TO_FS_FD(vfd);
   struct mgos_vfs_mount_entry *me = find_mount_by_vfd(vfd);
   struct mgos_vfs_fs *fs = NULL;
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_FSTAT, start);
   if (me == NULL) {
     errno = ENOENT;
     goto out;
@@ -532,6 +651,7 @@ int mgos_vfs_fstat(int vfd, struct stat *st) {
   fs = me->fs;
   ret = fs->ops->fstat(fs, fs_fd, st);
 out:
+  MGOS_VFS_OP_END(me, MGOS_VFS_OP_FSTAT, start, (ret == 0), 0);
   LOG(LL_DEBUG, ("%s %d => %p:%d => %d (size %d)", "fstat", vfd, fs, fs_fd, ret,
                  (int) (ret == 0 ? st->st_size : 0)));
   return ret;
@@ -553,6 +673,7 @@ off_t mgos_vfs_lseek(int vfd, off_t offset, int whence) {
   int fs_fd = MGOS_VFS_VFD_TO_FS_FD(vfd);
   struct mgos_vfs_mount_entry *me = find_mount_by_vfd(vfd);
   struct mgos_vfs_fs *fs = NULL;
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_LSEEK, start);
   if (me == NULL) {
     errno = EBADF;
     goto out;
@@ -560,6 +681,7 @@ off_t mgos_vfs_lseek(int vfd, off_t offset, int whence) {
   fs = me->fs;
   ret = fs->ops->lseek(fs, fs_fd, offset, whence);
 out:
+  MGOS_VFS_OP_END(me, MGOS_VFS_OP_LSEEK, start, (ret >= 0), 0);
   LOG(LL_DEBUG, ("%s %d %ld %d => %p:%d => %ld", "lseek", vfd,
                  (long int) offset, whence, fs, fs_fd, (long int) ret));
   return ret;
@@ -581,6 +703,7 @@ int mgos_vfs_unlink(const char *path) {
   char *fs_path = NULL;
   struct mgos_vfs_mount_entry *me = find_mount_by_path(path, &fs_path);
   struct mgos_vfs_fs *fs = NULL;
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_UNLINK, start);
   mgos_vfs_lock();
   if (me == NULL) {
     errno = ENOENT;
@@ -588,7 +711,10 @@ int mgos_vfs_unlink(const char *path) {
   }
   fs = me->fs;
   ret = fs->ops->unlink(fs, fs_path);
+  fs->gen++;
+  if (ret == 0) mgos_vfs_dcache_invalidate(me);
 out:
+  MGOS_VFS_OP_END(me, MGOS_VFS_OP_UNLINK, start, (ret == 0), 0);
   if (me != NULL) me->fs->refs--;
   mgos_vfs_unlock();
   LOG(LL_DEBUG, ("%s %s => %p %s => %d", "unlink", path, fs,
@@ -614,6 +740,7 @@ int mgos_vfs_rename(const char *src, const char *dst) {
   char *fs_src = NULL, *fs_dst = NULL;
   struct mgos_vfs_mount_entry *me = find_mount_by_path(src, &fs_src);
   struct mgos_vfs_mount_entry *me_dst = find_mount_by_path(dst, &fs_dst);
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_RENAME, start);
   mgos_vfs_lock();
   if (me == NULL || me_dst == NULL) {
     errno = ENODEV;
@@ -624,7 +751,10 @@ int mgos_vfs_rename(const char *src, const char *dst) {
   }
   fs = me->fs;
   ret = fs->ops->rename(fs, fs_src, fs_dst);
+  fs->gen++;
+  if (ret == 0) mgos_vfs_dcache_invalidate(me);
 out:
+  MGOS_VFS_OP_END(me, MGOS_VFS_OP_RENAME, start, (ret == 0), 0);
   if (me != NULL) me->fs->refs--;
   if (me_dst != NULL) me_dst->fs->refs--;
   mgos_vfs_unlock();
@@ -658,19 +788,254 @@ struct mgos_vfs_DIR {
 #endif
   struct mgos_vfs_mount_entry *me;
   DIR *fs_dir;
+  char *fs_path;
+  /* Number of entries read from fs_dir, used as position if the FS does not
+   * provide its own position cookies. */
+  long pos;
+  /* Entry that has been read from the FS but not returned yet
+   * and its position. */
+  struct dirent *stash;
+  long stash_off;
+  /* Name pattern and whether the FS applies it itself. */
+  char *pattern;
+  bool fs_filtered;
+#if MGOS_VFS_ENABLE_DCACHE
+  /* If fs_dir is NULL, the listing being served, otherwise the one being
+   * filled, if any. */
+  struct mgos_vfs_dcache *dc;
+  uint32_t dc_epoch;
+  size_t dc_off;
+  struct dirent dc_de;
+  bool dc_filling;
+#endif
 };
 
-struct mgos_vfs_dirent {
-  struct mgos_vfs_mount_entry *me;
-  struct dirent *fs_dirent;
-};
+/* Currently we do not support multiple directory levels,
+ * special entries are hidden. */
+static inline bool is_special_entry(const char *name) {
+  return (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')));
+}
 
-DIR *mgos_vfs_opendir(const char *path) {
+/* Returns true if the entry should not be returned to the caller. */
+static inline bool skip_entry(const struct mgos_vfs_DIR *dir,
+                              const char *name) {
+  return (is_special_entry(name) ||
+          (dir->pattern != NULL && !dir->fs_filtered &&
+           !mgos_vfs_fnmatch(dir->pattern, name)));
+}
+
+/*
+ * Whether the FS provides its own position cookies. Both telldir and seekdir
+ * are needed, otherwise its cookies would be mixed with entry indices.
+ */
+static bool mgos_vfs_fs_has_dir_pos(const struct mgos_vfs_fs *fs) {
+  return (fs->ops->telldir != NULL && fs->ops->seekdir != NULL);
+}
+
+/* Must be called with VFS locked. */
+static DIR *mgos_vfs_fs_opendir(struct mgos_vfs_DIR *dir) {
+  struct mgos_vfs_fs *fs = dir->me->fs;
+  if (dir->fs_filtered) {
+    return fs->ops->opendir_filter(fs, dir->fs_path, dir->pattern);
+  }
+  return fs->ops->opendir(fs, dir->fs_path);
+}
+
+#if MGOS_VFS_ENABLE_DCACHE
+/*
+ * Serve the directory from cache if possible (returns true),
+ * otherwise start filling the cache.
+ * Must be called with VFS locked.
+ */
+static bool mgos_vfs_dcache_open(struct mgos_vfs_DIR *dir) {
+  struct mgos_vfs_mount_entry *me = dir->me;
+  struct mgos_vfs_dcache *dc = me->dc;
+  /* Positions of cached entries are indices, cannot mix with FS cookies. */
+  if (mgos_vfs_fs_has_dir_pos(me->fs)) return false;
+  if (dc != NULL && strcmp(dc->fs_path, dir->fs_path) == 0) {
+    dc->refs++;
+    dir->dc = dc;
+    /* The cache has all the entries, filter them ourselves. */
+    dir->fs_filtered = false;
+    return true;
+  }
+  if (dir->fs_filtered || me->dc_filling) return false;
+  dc = (struct mgos_vfs_dcache *) calloc(1, sizeof(*dc));
+  if (dc == NULL) return false;
+  dc->fs_path = strdup(dir->fs_path);
+  if (dc->fs_path == NULL) {
+    free(dc);
+    return false;
+  }
+  dc->refs = 1;
+  dir->dc = dc;
+  dir->dc_epoch = me->dc_epoch;
+  dir->dc_filling = me->dc_filling = true;
+  return false;
+}
+
+/*
+ * Drop the listing, served or being filled.
+ * Must be called with VFS locked.
+ */
+static void mgos_vfs_dcache_close(struct mgos_vfs_DIR *dir) {
+  if (dir->dc_filling) {
+    dir->me->dc_filling = false;
+    dir->dc_filling = false;
+  }
+  mgos_vfs_dcache_unref(dir->dc);
+  dir->dc = NULL;
+}
+
+/*
+ * Record an entry read from the FS. NULL name means end of directory,
+ * at which point the listing is handed over to the mount entry, unless
+ * it has been invalidated in the meantime.
+ * Must be called with VFS locked.
+ */
+static void mgos_vfs_dcache_fill(struct mgos_vfs_DIR *dir, const char *name) {
+  struct mgos_vfs_dcache *dc = dir->dc;
+  struct mgos_vfs_mount_entry *me = dir->me;
+  size_t name_len;
+  if (dc == NULL) return;
+  if (name == NULL) {
+    if (dir->dc_epoch == me->dc_epoch) {
+      char *names = (char *) realloc(dc->names, dc->len);
+      if (names != NULL || dc->len == 0) {
+        dc->names = names;
+        dc->cap = dc->len;
+      }
+      mgos_vfs_dcache_unref(me->dc);
+      me->dc = dc;
+      LOG(LL_DEBUG, ("%s: cached %s (%u)", me->prefix, dc->fs_path,
+                     (unsigned int) dc->len));
+      dir->dc = NULL;
+    }
+    mgos_vfs_dcache_close(dir);
+    return;
+  }
+  name_len = strlen(name) + 1;
+  if (dc->len + name_len > dc->cap) {
+    size_t cap = dc->cap * 2;
+    char *names = NULL;
+    if (cap < dc->len + name_len) cap = dc->len + name_len + 64;
+    if (cap > MGOS_VFS_DCACHE_MAX_SIZE) cap = MGOS_VFS_DCACHE_MAX_SIZE;
+    if (dc->len + name_len <= cap) {
+      names = (char *) realloc(dc->names, cap);
+    }
+    if (names == NULL) {
+      /* Too big or out of memory, give up. */
+      mgos_vfs_dcache_close(dir);
+      return;
+    }
+    dc->names = names;
+    dc->cap = cap;
+  }
+  memcpy(dc->names + dc->len, name, name_len);
+  dc->len += name_len;
+}
+
+/* Must be called with VFS locked. */
+static struct dirent *mgos_vfs_dcache_next(struct mgos_vfs_DIR *dir) {
+  struct mgos_vfs_dcache *dc = dir->dc;
+  const char *name;
+  size_t name_len;
+  if (dir->dc_off >= dc->len) return NULL;
+  name = dc->names + dir->dc_off;
+  name_len = strlen(name);
+  dir->dc_off += name_len + 1;
+  dir->pos++;
+  if (name_len >= sizeof(dir->dc_de.d_name)) {
+    name_len = sizeof(dir->dc_de.d_name) - 1;
+  }
+  memcpy(dir->dc_de.d_name, name, name_len);
+  dir->dc_de.d_name[name_len] = '\0';
+  return &dir->dc_de;
+}
+#else
+#define mgos_vfs_dcache_open(dir) false
+#define mgos_vfs_dcache_fill(dir, name) (void) 0
+#define mgos_vfs_dcache_close(dir) (void) 0
+#endif
+
+/*
+ * Read next raw entry, special ones included, from the cache or the FS.
+ * Must be called with VFS locked.
+ */
+static struct dirent *mgos_vfs_read_dirent(struct mgos_vfs_DIR *dir) {
+  struct dirent *de;
+  struct mgos_vfs_fs *fs = dir->me->fs;
+#if MGOS_VFS_ENABLE_DCACHE
+  if (dir->fs_dir == NULL) return mgos_vfs_dcache_next(dir);
+#endif
+  de = fs->ops->readdir(fs, dir->fs_dir);
+  mgos_vfs_dcache_fill(dir, (de != NULL ? de->d_name : NULL));
+  if (de != NULL) dir->pos++;
+  return de;
+}
+
+/* Must be called with VFS locked. */
+static bool mgos_vfs_rewinddir_locked(struct mgos_vfs_DIR *dir) {
+  struct mgos_vfs_fs *fs = dir->me->fs;
+  DIR *fs_dir;
+#if MGOS_VFS_ENABLE_DCACHE
+  if (dir->fs_dir == NULL) {
+    dir->dc_off = 0;
+    dir->pos = 0;
+    return true;
+  }
+#endif
+  /* Re-open the directory. */
+  fs_dir = mgos_vfs_fs_opendir(dir);
+  if (fs_dir == NULL) return false;
+  fs->ops->closedir(fs, dir->fs_dir);
+  dir->fs_dir = fs_dir;
+  dir->pos = 0;
+#if MGOS_VFS_ENABLE_DCACHE
+  /* Listing being filled starts over as well. */
+  if (dir->dc != NULL) dir->dc->len = 0;
+#endif
+  return true;
+}
+
+/* Must be called with VFS locked. */
+static long mgos_vfs_telldir_locked(struct mgos_vfs_DIR *dir) {
+  struct mgos_vfs_fs *fs = dir->me->fs;
+  if (dir->stash != NULL) return dir->stash_off;
+  if (mgos_vfs_fs_has_dir_pos(fs)) return fs->ops->telldir(fs, dir->fs_dir);
+  return dir->pos;
+}
+
+/*
+ * Return next non-special entry. If off is not NULL, it receives the position
+ * of the returned entry (or of the end, if there are no more entries).
+ * Must be called with VFS locked.
+ */
+static struct dirent *mgos_vfs_next_dirent(struct mgos_vfs_DIR *dir,
+                                           long *off) {
+  struct dirent *de = NULL;
+  if (dir->stash != NULL) {
+    de = dir->stash;
+    if (off != NULL) *off = dir->stash_off;
+    dir->stash = NULL;
+    return de;
+  }
+  do {
+    if (off != NULL) *off = mgos_vfs_telldir_locked(dir);
+    de = mgos_vfs_read_dirent(dir);
+    if (de == NULL) break;
+  } while (skip_entry(dir, de->d_name));
+  return de;
+}
+
+DIR *mgos_vfs_opendir_filter(const char *path, const char *pattern) {
   struct mgos_vfs_DIR *dir = NULL;
   char *fs_path = NULL;
   DIR *fs_dir = NULL;
   struct mgos_vfs_fs *fs = NULL;
   struct mgos_vfs_mount_entry *me = find_mount_by_path(path, &fs_path);
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_OPENDIR, start);
   mgos_vfs_lock();
   if (me == NULL) {
     errno = ENOENT;
@@ -681,23 +1046,47 @@ DIR *mgos_vfs_opendir(const char *path) {
   if (dir == NULL) {
     goto out;
   }
-  fs_dir = fs->ops->opendir(fs, fs_path);
+  dir->me = me;
+  dir->fs_path = fs_path;
+  if (pattern != NULL && strcmp(pattern, "*") != 0) {
+    dir->pattern = strdup(pattern);
+    if (dir->pattern == NULL) {
+      /* Do not return an unfiltered listing. */
+      free(dir);
+      dir = NULL;
+      errno = ENOMEM;
+      goto out;
+    }
+    dir->fs_filtered = (fs->ops->opendir_filter != NULL);
+  }
+  if (mgos_vfs_dcache_open(dir)) {
+    fs_path = NULL;
+    goto out;
+  }
+  fs_dir = mgos_vfs_fs_opendir(dir);
   if (fs_dir != NULL) {
-    dir->me = me;
     dir->fs_dir = fs_dir;
+    fs_path = NULL;
   } else {
+    mgos_vfs_dcache_close(dir);
+    free(dir->pattern);
     free(dir);
     dir = NULL;
   }
 out:
+  MGOS_VFS_OP_END(me, MGOS_VFS_OP_OPENDIR, start, (dir != NULL), 0);
   if (me != NULL && dir == NULL) me->fs->refs--;
   mgos_vfs_unlock();
-  LOG(LL_DEBUG,
-      ("%s %s => %p %s %p => %p (refs %d)", "opendir", path, fs,
-       (fs_path ? fs_path : ""), fs_dir, dir, (me ? me->fs->refs : -1)));
+  LOG(LL_DEBUG, ("%s %s %s => %p %s %p => %p (refs %d)", "opendir", path,
+                 (pattern ? pattern : ""), fs, (dir ? dir->fs_path : fs_path),
+                 fs_dir, dir, (me ? me->fs->refs : -1)));
   free(fs_path);
   return (DIR *) dir;
 }
+
+DIR *mgos_vfs_opendir(const char *path) {
+  return mgos_vfs_opendir_filter(path, NULL);
+}
 #if MGOS_VFS_DEFINE_LIBC_DIR_API
 DIR *opendir(const char *path) {
   return mgos_vfs_opendir(path);
@@ -718,17 +1107,10 @@ struct dirent *mgos_vfs_readdir(DIR *pdir) {
     de = NULL;
     goto out;
   }
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_READDIR, start);
   mgos_vfs_lock();
-  while (true) {
-    de = dir->me->fs->ops->readdir(dir->me->fs, dir->fs_dir);
-    if (de != NULL) {
-      /* Currently we do not support multiple directory levels,
-       * hide special entries. */
-      if (strcmp(de->d_name, ".") == 0) continue;
-      if (strcmp(de->d_name, "..") == 0) continue;
-    }
-    break;
-  }
+  de = mgos_vfs_next_dirent(dir, NULL);
+  MGOS_VFS_OP_END(dir->me, MGOS_VFS_OP_READDIR, start, true, 0);
   mgos_vfs_unlock();
 out:
   return de;
@@ -745,6 +1127,173 @@ struct dirent *_readdir_r(struct _reent *r, DIR *pdir) {
 }
 #endif
 
+/* Must be called with VFS locked. */
+static struct dirent *mgos_vfs_next_dirent_plus(struct mgos_vfs_DIR *dir,
+                                                struct stat *st) {
+  struct dirent *de = NULL;
+  struct mgos_vfs_fs *fs = dir->me->fs;
+  if (fs->ops->readdirplus != NULL && dir->stash == NULL &&
+      dir->fs_dir != NULL) {
+    do {
+      de = fs->ops->readdirplus(fs, dir->fs_dir, st);
+      mgos_vfs_dcache_fill(dir, (de != NULL ? de->d_name : NULL));
+      if (de == NULL) break;
+      dir->pos++;
+    } while (skip_entry(dir, de->d_name));
+    return de;
+  }
+  de = mgos_vfs_next_dirent(dir, NULL);
+  if (de != NULL) {
+    /* Path is already resolved, go directly to the FS. */
+    char buf[MG_MAX_PATH], *path = buf;
+    if (dir->fs_path[0] != '\0') {
+      mg_asprintf(&path, sizeof(buf), "%s/%s", dir->fs_path, de->d_name);
+    } else {
+      path = de->d_name;
+    }
+    if (path == NULL || fs->ops->stat(fs, path, st) != 0) {
+      memset(st, 0, sizeof(*st));
+    }
+    if (path != buf && path != de->d_name) free(path);
+  }
+  return de;
+}
+
+struct dirent *mgos_vfs_readdirplus(DIR *pdir, struct stat *st) {
+  struct dirent *de;
+  struct mgos_vfs_DIR *dir = (struct mgos_vfs_DIR *) pdir;
+  if (dir == NULL) {
+    errno = EBADF;
+    return NULL;
+  }
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_READDIR, start);
+  mgos_vfs_lock();
+  de = mgos_vfs_next_dirent_plus(dir, st);
+  MGOS_VFS_OP_END(dir->me, MGOS_VFS_OP_READDIR, start, true, 0);
+  mgos_vfs_unlock();
+  return de;
+}
+
+#define DENT_ALIGN(x) (((x) + sizeof(long) - 1) & ~(sizeof(long) - 1))
+
+/* Remove skipped entries from the buffer filled by the FS, assign positions
+ * if the FS does not provide its own. Returns new length. */
+static int mgos_vfs_getdents_fixup(struct mgos_vfs_DIR *dir, uint8_t *buf,
+                                   int len) {
+  bool fs_pos = mgos_vfs_fs_has_dir_pos(dir->me->fs);
+  int i = 0, j = 0;
+  while (i < len) {
+    struct mgos_vfs_dent *d = (struct mgos_vfs_dent *) (buf + i);
+    int reclen = d->d_reclen;
+    mgos_vfs_dcache_fill(dir, d->d_name);
+    dir->pos++;
+    if (!fs_pos) d->d_off = dir->pos;
+    if (!skip_entry(dir, d->d_name)) {
+      if (j != i) memmove(buf + j, buf + i, reclen);
+      j += reclen;
+    }
+    i += reclen;
+  }
+  return j;
+}
+
+int mgos_vfs_getdents(DIR *pdir, void *buf, size_t len) {
+  int ret = 0;
+  struct mgos_vfs_DIR *dir = (struct mgos_vfs_DIR *) pdir;
+  struct mgos_vfs_dent *prev = NULL;
+  struct mgos_vfs_fs *fs;
+  if (dir == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  fs = dir->me->fs;
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_GETDENTS, start);
+  mgos_vfs_lock();
+  if (fs->ops->getdents != NULL && dir->stash == NULL &&
+      dir->fs_dir != NULL) {
+    do {
+      ret = fs->ops->getdents(fs, dir->fs_dir, buf, len);
+      if (ret == 0) mgos_vfs_dcache_fill(dir, NULL);
+      if (ret <= 0) break;
+      ret = mgos_vfs_getdents_fixup(dir, (uint8_t *) buf, ret);
+    } while (ret == 0);
+    goto out;
+  }
+  while (true) {
+    long off = 0;
+    struct dirent *de = mgos_vfs_next_dirent(dir, &off);
+    /* Position of this entry is where the previous one ends. */
+    if (prev != NULL) prev->d_off = off;
+    if (de == NULL) break;
+    size_t name_len = strlen(de->d_name);
+    size_t reclen =
+        DENT_ALIGN(offsetof(struct mgos_vfs_dent, d_name) + name_len + 1);
+    if (ret + reclen > len) {
+      /* Does not fit, keep it for the next call. */
+      dir->stash = de;
+      dir->stash_off = off;
+      if (ret == 0) {
+        errno = EINVAL;
+        ret = -1;
+      }
+      break;
+    }
+    prev = (struct mgos_vfs_dent *) (((uint8_t *) buf) + ret);
+    prev->d_reclen = reclen;
+    memcpy(prev->d_name, de->d_name, name_len + 1);
+    ret += reclen;
+  }
+out:
+  MGOS_VFS_OP_END(dir->me, MGOS_VFS_OP_GETDENTS, start, (ret >= 0),
+                     (ret > 0 ? ret : 0));
+  mgos_vfs_unlock();
+  LOG(LL_DEBUG, ("%s %p %u => %d", "getdents", dir, (unsigned int) len, ret));
+  return ret;
+}
+
+long mgos_vfs_telldir(DIR *pdir) {
+  long ret;
+  struct mgos_vfs_DIR *dir = (struct mgos_vfs_DIR *) pdir;
+  if (dir == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  mgos_vfs_lock();
+  ret = mgos_vfs_telldir_locked(dir);
+  mgos_vfs_unlock();
+  return ret;
+}
+#if MGOS_VFS_DEFINE_LIBC_DIR_API
+long telldir(DIR *pdir) {
+  return mgos_vfs_telldir(pdir);
+}
+#endif
+
+void mgos_vfs_seekdir(DIR *pdir, long loc) {
+  struct mgos_vfs_DIR *dir = (struct mgos_vfs_DIR *) pdir;
+  struct mgos_vfs_fs *fs;
+  if (dir == NULL) return;
+  fs = dir->me->fs;
+  mgos_vfs_lock();
+  dir->stash = NULL;
+  if (mgos_vfs_fs_has_dir_pos(fs)) {
+    fs->ops->seekdir(fs, dir->fs_dir, loc);
+    goto out;
+  }
+  if (loc < dir->pos && !mgos_vfs_rewinddir_locked(dir)) goto out;
+  while (dir->pos < loc) {
+    if (mgos_vfs_read_dirent(dir) == NULL) break;
+  }
+out:
+  mgos_vfs_unlock();
+  LOG(LL_DEBUG, ("%s %p %ld", "seekdir", dir, loc));
+}
+#if MGOS_VFS_DEFINE_LIBC_DIR_API
+void seekdir(DIR *pdir, long loc) {
+  mgos_vfs_seekdir(pdir, loc);
+}
+#endif
+
 int mgos_vfs_closedir(DIR *pdir) {
   int ret;
   DIR *fs_dir = NULL;
@@ -759,10 +1308,15 @@ int mgos_vfs_closedir(DIR *pdir) {
   me = dir->me;
   fs = me->fs;
   fs_dir = dir->fs_dir;
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_CLOSEDIR, start);
   mgos_vfs_lock();
-  ret = fs->ops->closedir(fs, fs_dir);
+  ret = (fs_dir != NULL ? fs->ops->closedir(fs, fs_dir) : 0);
+  mgos_vfs_dcache_close(dir);
+  MGOS_VFS_OP_END(me, MGOS_VFS_OP_CLOSEDIR, start, (ret == 0), 0);
   dir->me->fs->refs--;
   mgos_vfs_unlock();
+  free(dir->fs_path);
+  free(dir->pattern);
 out:
   LOG(LL_DEBUG, ("%s %p => %p:%p => %d (refs %d)", "closedir", dir, fs, fs_dir,
                  ret, (me ? me->fs->refs : -1)));
@@ -783,6 +1337,28 @@ int _closedir_r(struct _reent *r, DIR *pdir) {
 
 #endif /* MG_ENABLE_DIRECTORY_LISTING */
 
+bool mgos_vfs_fnmatch(const char *pattern, const char *name) {
+  const char *p = pattern, *n = name;
+  /* Where to resume after a mismatch: last '*' and the name position. */
+  const char *sp = NULL, *sn = NULL;
+  while (*n != '\0') {
+    if (*p == '*') {
+      sp = ++p;
+      sn = n;
+    } else if (*p != '\0' && (*p == '?' || *p == *n)) {
+      p++;
+      n++;
+    } else if (sp != NULL) {
+      p = sp;
+      n = ++sn;
+    } else {
+      return false;
+    }
+  }
+  while (*p == '*') p++;
+  return (*p == '\0');
+}
+
 #ifdef CS_MMAP
 #define MMAP_DESCS_ADD_SIZE 4
 
@@ -950,30 +1526,33 @@ int munmap(void *addr, size_t len) {
 #endif /* MGOS_VFS_DEFINE_LIBC_MMAP_API */
 #endif /* CS_MMAP */
 
-size_t mgos_vfs_get_space_total(const char *path) {
-  size_t res;
+bool mgos_vfs_statvfs(const char *path, struct mgos_vfs_statvfs *st) {
+  bool res;
   struct mgos_vfs_mount_entry *me = find_mount_by_path(path, NULL);
-  if (me == NULL) return 0;
+  if (me == NULL) return false;
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_STATVFS, start);
   mgos_vfs_lock();
-  res = me->fs->ops->get_space_total(me->fs);
+  res = mgos_vfs_statvfs_me(me, st);
+  MGOS_VFS_OP_END(me, MGOS_VFS_OP_STATVFS, start, res, 0);
   me->fs->refs--;
   mgos_vfs_unlock();
   return res;
 }
 
+size_t mgos_vfs_get_space_total(const char *path) {
+  struct mgos_vfs_statvfs st;
+  if (!mgos_vfs_statvfs(path, &st)) return 0;
+  return st.space_total;
+}
+
 size_t mgos_get_fs_size(void) {
   return mgos_vfs_get_space_total("/");
 }
 
 size_t mgos_vfs_get_space_free(const char *path) {
-  size_t res;
-  struct mgos_vfs_mount_entry *me = find_mount_by_path(path, NULL);
-  if (me == NULL) return 0;
-  mgos_vfs_lock();
-  res = me->fs->ops->get_space_free(me->fs);
-  me->fs->refs--;
-  mgos_vfs_unlock();
-  return res;
+  struct mgos_vfs_statvfs st;
+  if (!mgos_vfs_statvfs(path, &st)) return 0;
+  return st.space_free;
 }
 
 size_t mgos_get_free_fs_size(void) {
@@ -984,6 +1563,15 @@ void mgos_fs_gc(void) {
   mgos_vfs_gc("/");
 }
 
+static void mgos_vfs_umount_flush_dev(struct mgos_vfs_mount_entry *me) {
+  enum mgos_vfs_dev_err res;
+  if (me->fs->dev == NULL) return;
+  res = mgos_vfs_dev_flush(me->fs->dev);
+  if (res != MGOS_VFS_DEV_ERR_NONE) {
+    LOG(LL_ERROR, ("%s: device flush failed: %d", me->prefix, res));
+  }
+}
+
 static bool mgos_vfs_umount_entry(struct mgos_vfs_mount_entry *me, bool force) {
   bool ret = false;
   if (me->fs->refs > 0) {
@@ -996,8 +1584,19 @@ static bool mgos_vfs_umount_entry(struct mgos_vfs_mount_entry *me, bool force) {
     }
   }
   SLIST_REMOVE(&s_mounts, me, mgos_vfs_mount_entry, next);
+  /*
+   * Registered devices are not closed when unmounted (the registry holds a
+   * reference), so data buffered by the device must be written out here.
+   * Once more after umount, which may write as well.
+   */
+  mgos_vfs_umount_flush_dev(me);
   ret = me->fs->ops->umount(me->fs);
   if (ret) {
+    mgos_vfs_umount_flush_dev(me);
+    mgos_vfs_dcache_invalidate(me);
+#if MGOS_VFS_ENABLE_STATS
+    mgos_vfs_stats_free(me->stats);
+#endif
     mgos_vfs_dev_close(me->fs->dev);
     free(me->prefix);
     free(me->fs);
@@ -1038,10 +1637,13 @@ bool mgos_vfs_gc(const char *path) {
   struct mgos_vfs_fs *fs = NULL;
   struct mgos_vfs_mount_entry *me = find_mount_by_path(path, NULL);
   if (me == NULL) return false;
+  MGOS_VFS_OP_BEGIN(MGOS_VFS_OP_GC, start);
   mgos_vfs_lock();
   me->fs->refs--; /* Drop the ref taken by find */
   fs = me->fs;
   ret = fs->ops->gc(fs);
+  fs->gen++;
+  MGOS_VFS_OP_END(me, MGOS_VFS_OP_GC, start, ret, 0);
   mgos_vfs_unlock();
   return ret;
 }
@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_vfs_bench.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_dbg.h"
+
+#include "mgos_time.h"
+#include "mgos_vfs.h"
+#include "mgos_vfs_dev.h"
+
+#if MGOS_VFS_ENABLE_BENCH
+
+static const char *s_wl_names[MGOS_VFS_BENCH_WL_MAX] = {
+    "config", "log", "ota", "small", "list",
+};
+
+const char *mgos_vfs_bench_wl_name(enum mgos_vfs_bench_wl wl) {
+  if (wl < 0 || wl >= MGOS_VFS_BENCH_WL_MAX) return "";
+  return s_wl_names[wl];
+}
+
+void mgos_vfs_bench_cfg_init(struct mgos_vfs_bench_cfg *cfg) {
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->prefix = "/bench_";
+  cfg->dir = "/";
+  cfg->num_ops = 1000;
+  cfg->seed = 1;
+  cfg->weights[MGOS_VFS_BENCH_WL_CONFIG] = 10;
+  cfg->weights[MGOS_VFS_BENCH_WL_LOG] = 60;
+  cfg->weights[MGOS_VFS_BENCH_WL_OTA] = 1;
+  cfg->weights[MGOS_VFS_BENCH_WL_SMALL] = 24;
+  cfg->weights[MGOS_VFS_BENCH_WL_LIST] = 5;
+  cfg->config_size = 1024;
+  cfg->log_record_size = 64;
+  cfg->log_max_size = 4096;
+  cfg->log_num_files = 2;
+  cfg->ota_size = 32768;
+  cfg->ota_chunk_size = 1024;
+  cfg->small_num_files = 16;
+  cfg->small_size = 128;
+  cfg->cleanup = true;
+}
+
+uint32_t mgos_vfs_bench_percentile(const struct mgos_vfs_bench_wl_result *r,
+                                   int pct) {
+  uint64_t n = 0, target = ((uint64_t) r->ops * pct + 99) / 100;
+  int b;
+  if (r->ops == 0) return 0;
+  for (b = 0; b < MGOS_VFS_BENCH_NUM_BUCKETS - 1; b++) {
+    n += r->hist[b];
+    if (n >= target) break;
+  }
+  if (b == MGOS_VFS_BENCH_NUM_BUCKETS - 1) return r->max_us;
+  return (1U << b);
+}
+
+int mgos_vfs_bench_print_json(const struct mgos_vfs_bench_result *res,
+                              struct json_out *out) {
+  int wl, len = 0;
+  len += json_printf(out, "{total_us: %llu", (unsigned long long) res->total_us);
+  for (wl = 0; wl < MGOS_VFS_BENCH_WL_MAX; wl++) {
+    const struct mgos_vfs_bench_wl_result *r = &res->wl[wl];
+    if (r->ops == 0) continue;
+    len += json_printf(
+        out,
+        ", %Q: {ops: %u, errors: %u, bytes: %llu, kb_per_s: %.2f, avg_us: %u, "
+        "p50_us: %u, p99_us: %u, max_us: %u}",
+        mgos_vfs_bench_wl_name((enum mgos_vfs_bench_wl) wl),
+        (unsigned int) r->ops, (unsigned int) r->errors,
+        (unsigned long long) r->bytes,
+        (r->total_us > 0 ? (double) r->bytes * 1000000 / 1024 / r->total_us
+                         : 0),
+        (unsigned int) (r->total_us / r->ops),
+        (unsigned int) mgos_vfs_bench_percentile(r, 50),
+        (unsigned int) mgos_vfs_bench_percentile(r, 99),
+        (unsigned int) r->max_us);
+  }
+  len += json_printf(out,
+                     ", dev: {written: %llu, erased: %llu, erases: %u, "
+                     "max_unit_erases: %u}}",
+                     (unsigned long long) res->dev_written,
+                     (unsigned long long) res->dev_erased,
+                     (unsigned int) res->dev_erases,
+                     (unsigned int) res->max_unit_erases);
+  return len;
+}
+
+struct bench_ctx {
+  const struct mgos_vfs_bench_cfg *cfg;
+  uint32_t rnd;
+  char *buf;
+  size_t buf_size;
+  int log_size;
+  char path[64], path2[64];
+};
+
+/* xorshift32, good enough to pick workloads and sizes. */
+static uint32_t bench_rand(struct bench_ctx *ctx) {
+  uint32_t x = ctx->rnd;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return (ctx->rnd = x);
+}
+
+static const char *bench_path(struct bench_ctx *ctx, char *buf,
+                              const char *name, int i) {
+  snprintf(buf, sizeof(ctx->path), "%s%s%d", ctx->cfg->prefix, name, i);
+  return buf;
+}
+
+static void bench_fill(struct bench_ctx *ctx, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++) ctx->buf[i] = 'a' + (bench_rand(ctx) % 26);
+}
+
+/* Write len bytes from the buffer in chunks. Returns bytes written. */
+static ssize_t bench_write_file(struct bench_ctx *ctx, const char *path,
+                                int flags, size_t len, size_t chunk_size) {
+  ssize_t ret = -1;
+  size_t done = 0;
+  int fd = mgos_vfs_open(path, O_WRONLY | O_CREAT | flags, 0644);
+  if (fd < 0) goto out;
+  while (done < len) {
+    size_t n = len - done;
+    if (n > chunk_size) n = chunk_size;
+    if (n > ctx->buf_size) n = ctx->buf_size;
+    if (mgos_vfs_write(fd, ctx->buf, n) != (ssize_t) n) goto out;
+    done += n;
+  }
+  ret = done;
+out:
+  if (fd >= 0 && mgos_vfs_close(fd) != 0) ret = -1;
+  return ret;
+}
+
+static ssize_t bench_config(struct bench_ctx *ctx) {
+  const struct mgos_vfs_bench_cfg *cfg = ctx->cfg;
+  ssize_t ret = -1, n = 0;
+  const char *path = bench_path(ctx, ctx->path, "cfg", 0);
+  const char *tmp_path = bench_path(ctx, ctx->path2, "cfg_tmp", 0);
+  int fd = mgos_vfs_open(path, O_RDONLY, 0);
+  if (fd >= 0) {
+    n = mgos_vfs_read(fd, ctx->buf, cfg->config_size);
+    mgos_vfs_close(fd);
+    if (n < 0) goto out;
+  }
+  /* Change a few bytes, write the whole thing out and replace. */
+  if ((size_t) n < cfg->config_size) bench_fill(ctx, cfg->config_size);
+  ctx->buf[bench_rand(ctx) % cfg->config_size] = '0' + bench_rand(ctx) % 10;
+  if (bench_write_file(ctx, tmp_path, O_TRUNC, cfg->config_size,
+                       cfg->config_size) < 0) {
+    goto out;
+  }
+  if (mgos_vfs_rename(tmp_path, path) != 0) goto out;
+  ret = n + cfg->config_size;
+out:
+  return ret;
+}
+
+static ssize_t bench_log(struct bench_ctx *ctx) {
+  const struct mgos_vfs_bench_cfg *cfg = ctx->cfg;
+  int i;
+  if (ctx->log_size + cfg->log_record_size > cfg->log_max_size) {
+    /* Rotate: log0 -> log1 -> ... -> dropped. */
+    mgos_vfs_unlink(bench_path(ctx, ctx->path, "log", cfg->log_num_files - 1));
+    for (i = cfg->log_num_files - 1; i > 0; i--) {
+      mgos_vfs_rename(bench_path(ctx, ctx->path, "log", i - 1),
+                      bench_path(ctx, ctx->path2, "log", i));
+    }
+    ctx->log_size = 0;
+  }
+  bench_fill(ctx, cfg->log_record_size);
+  ssize_t ret = bench_write_file(ctx, bench_path(ctx, ctx->path, "log", 0),
+                                 O_APPEND, cfg->log_record_size,
+                                 cfg->log_record_size);
+  if (ret > 0) ctx->log_size += ret;
+  return ret;
+}
+
+static ssize_t bench_ota(struct bench_ctx *ctx) {
+  const struct mgos_vfs_bench_cfg *cfg = ctx->cfg;
+  const char *path = bench_path(ctx, ctx->path, "ota", 0);
+  bench_fill(ctx, ctx->buf_size);
+  ssize_t ret =
+      bench_write_file(ctx, path, O_TRUNC, cfg->ota_size, cfg->ota_chunk_size);
+  if (mgos_vfs_unlink(path) != 0) ret = -1;
+  return ret;
+}
+
+static ssize_t bench_small(struct bench_ctx *ctx) {
+  const struct mgos_vfs_bench_cfg *cfg = ctx->cfg;
+  const char *path = bench_path(ctx, ctx->path, "small",
+                                bench_rand(ctx) % cfg->small_num_files);
+  struct stat st;
+  /* Existing files are removed a third of the time, rewritten otherwise. */
+  if (mgos_vfs_stat(path, &st) == 0 && bench_rand(ctx) % 3 == 0) {
+    return (mgos_vfs_unlink(path) == 0 ? 0 : -1);
+  }
+  bench_fill(ctx, cfg->small_size);
+  return bench_write_file(ctx, path, O_TRUNC, cfg->small_size,
+                          cfg->small_size);
+}
+
+static ssize_t bench_list(struct bench_ctx *ctx) {
+#if MG_ENABLE_DIRECTORY_LISTING
+  ssize_t ret = 0;
+  DIR *dir = mgos_vfs_opendir(ctx->cfg->dir);
+  if (dir == NULL) return -1;
+  while (mgos_vfs_readdir(dir) != NULL) ret++;
+  mgos_vfs_closedir(dir);
+  return ret;
+#else
+  (void) ctx;
+  return -1;
+#endif
+}
+
+static void bench_cleanup(struct bench_ctx *ctx) {
+  const struct mgos_vfs_bench_cfg *cfg = ctx->cfg;
+  int i;
+  mgos_vfs_unlink(bench_path(ctx, ctx->path, "cfg", 0));
+  mgos_vfs_unlink(bench_path(ctx, ctx->path, "cfg_tmp", 0));
+  mgos_vfs_unlink(bench_path(ctx, ctx->path, "ota", 0));
+  for (i = 0; i < cfg->log_num_files; i++) {
+    mgos_vfs_unlink(bench_path(ctx, ctx->path, "log", i));
+  }
+  for (i = 0; i < cfg->small_num_files; i++) {
+    mgos_vfs_unlink(bench_path(ctx, ctx->path, "small", i));
+  }
+}
+
+struct bench_dev_snap {
+  struct mgos_vfs_dev_stats st;
+  bool have_st;
+  uint16_t *wear;
+  size_t num_units;
+};
+
+static void bench_dev_snap(struct mgos_vfs_dev *dev,
+                           struct bench_dev_snap *s) {
+  memset(s, 0, sizeof(*s));
+  if (dev == NULL) return;
+  s->have_st = mgos_vfs_dev_get_stats(dev, &s->st);
+  s->num_units = mgos_vfs_dev_get_wear_map(dev, NULL, 0, NULL);
+  if (s->num_units > 0) {
+    s->wear = (uint16_t *) calloc(s->num_units, sizeof(*s->wear));
+    if (s->wear == NULL) {
+      s->num_units = 0;
+      return;
+    }
+    mgos_vfs_dev_get_wear_map(dev, s->wear, s->num_units, NULL);
+  }
+}
+
+static void bench_dev_diff(const struct bench_dev_snap *s0,
+                           const struct bench_dev_snap *s1,
+                           struct mgos_vfs_bench_result *res) {
+  size_t i;
+  if (s0->have_st && s1->have_st) {
+    const struct mgos_vfs_dev_op_stats *w0 = &s0->st.op[MGOS_VFS_DEV_OP_WRITE];
+    const struct mgos_vfs_dev_op_stats *w1 = &s1->st.op[MGOS_VFS_DEV_OP_WRITE];
+    const struct mgos_vfs_dev_op_stats *e0 = &s0->st.op[MGOS_VFS_DEV_OP_ERASE];
+    const struct mgos_vfs_dev_op_stats *e1 = &s1->st.op[MGOS_VFS_DEV_OP_ERASE];
+    res->dev_written = w1->bytes - w0->bytes;
+    res->dev_erased = e1->bytes - e0->bytes;
+    res->dev_erases = e1->ops - e0->ops;
+  }
+  for (i = 0; i < s0->num_units && i < s1->num_units; i++) {
+    uint32_t n = s1->wear[i] - s0->wear[i];
+    if (n > res->max_unit_erases) res->max_unit_erases = n;
+  }
+}
+
+static void bench_record(struct mgos_vfs_bench_wl_result *r, int64_t start,
+                         ssize_t n) {
+  uint32_t us = (uint32_t) (mgos_uptime_micros() - start);
+  int b = 0;
+  while (b < MGOS_VFS_BENCH_NUM_BUCKETS - 1 && (us >> b) != 0) b++;
+  r->ops++;
+  if (n < 0) {
+    r->errors++;
+  } else {
+    r->bytes += n;
+  }
+  r->total_us += us;
+  if (us > r->max_us) r->max_us = us;
+  r->hist[b]++;
+}
+
+bool mgos_vfs_bench_run(const struct mgos_vfs_bench_cfg *cfg,
+                        struct mgos_vfs_bench_result *res) {
+  bool ret = false;
+  int i, wl, total_weight = 0;
+  int64_t start;
+  struct mgos_vfs_dev *dev = NULL;
+  struct bench_dev_snap s0, s1;
+  struct bench_ctx ctx;
+  memset(res, 0, sizeof(*res));
+  memset(&ctx, 0, sizeof(ctx));
+  memset(&s0, 0, sizeof(s0));
+  memset(&s1, 0, sizeof(s1));
+  ctx.cfg = cfg;
+  ctx.rnd = (cfg->seed != 0 ? cfg->seed : 1);
+  for (wl = 0; wl < MGOS_VFS_BENCH_WL_MAX; wl++) {
+    if (cfg->weights[wl] > 0) total_weight += cfg->weights[wl];
+  }
+  if (total_weight == 0 || cfg->log_num_files < 1 ||
+      cfg->small_num_files < 1 || cfg->config_size == 0 ||
+      cfg->ota_chunk_size == 0) {
+    LOG(LL_ERROR, ("Invalid benchmark config"));
+    goto out;
+  }
+  ctx.buf_size = cfg->config_size;
+  if (cfg->log_record_size > ctx.buf_size) ctx.buf_size = cfg->log_record_size;
+  if (cfg->ota_chunk_size > ctx.buf_size) ctx.buf_size = cfg->ota_chunk_size;
+  if (cfg->small_size > ctx.buf_size) ctx.buf_size = cfg->small_size;
+  ctx.buf = (char *) malloc(ctx.buf_size);
+  if (ctx.buf == NULL) goto out;
+  if (cfg->dev_name != NULL) {
+    dev = mgos_vfs_dev_open(cfg->dev_name);
+    if (dev == NULL) goto out;
+  }
+  bench_dev_snap(dev, &s0);
+  start = mgos_uptime_micros();
+  for (i = 0; i < cfg->num_ops; i++) {
+    int x = bench_rand(&ctx) % total_weight;
+    ssize_t n = -1;
+    int64_t op_start;
+    for (wl = 0; wl < MGOS_VFS_BENCH_WL_MAX - 1; wl++) {
+      if (cfg->weights[wl] <= 0) continue;
+      if (x < cfg->weights[wl]) break;
+      x -= cfg->weights[wl];
+    }
+    op_start = mgos_uptime_micros();
+    switch ((enum mgos_vfs_bench_wl) wl) {
+      case MGOS_VFS_BENCH_WL_CONFIG:
+        n = bench_config(&ctx);
+        break;
+      case MGOS_VFS_BENCH_WL_LOG:
+        n = bench_log(&ctx);
+        break;
+      case MGOS_VFS_BENCH_WL_OTA:
+        n = bench_ota(&ctx);
+        break;
+      case MGOS_VFS_BENCH_WL_SMALL:
+        n = bench_small(&ctx);
+        break;
+      case MGOS_VFS_BENCH_WL_LIST:
+        n = bench_list(&ctx);
+        /* Entries, not bytes. */
+        if (n > 0) n = 0;
+        break;
+      case MGOS_VFS_BENCH_WL_MAX:
+        break;
+    }
+    bench_record(&res->wl[wl], op_start, n);
+  }
+  res->total_us = mgos_uptime_micros() - start;
+  bench_dev_snap(dev, &s1);
+  bench_dev_diff(&s0, &s1, res);
+  if (cfg->cleanup) bench_cleanup(&ctx);
+  ret = true;
+out:
+  free(s0.wear);
+  free(s1.wear);
+  free(ctx.buf);
+  if (dev != NULL) mgos_vfs_dev_close(dev);
+  return ret;
+}
+
+#else /* MGOS_VFS_ENABLE_BENCH */
+
+const char *mgos_vfs_bench_wl_name(enum mgos_vfs_bench_wl wl) {
+  (void) wl;
+  return "";
+}
+
+void mgos_vfs_bench_cfg_init(struct mgos_vfs_bench_cfg *cfg) {
+  memset(cfg, 0, sizeof(*cfg));
+}
+
+bool mgos_vfs_bench_run(const struct mgos_vfs_bench_cfg *cfg,
+                        struct mgos_vfs_bench_result *res) {
+  (void) cfg;
+  memset(res, 0, sizeof(*res));
+  return false;
+}
+
+uint32_t mgos_vfs_bench_percentile(const struct mgos_vfs_bench_wl_result *r,
+                                   int pct) {
+  (void) r;
+  (void) pct;
+  return 0;
+}
+
+int mgos_vfs_bench_print_json(const struct mgos_vfs_bench_result *res,
+                              struct json_out *out) {
+  (void) res;
+  return json_printf(out, "{}");
+}
+
+#endif /* MGOS_VFS_ENABLE_BENCH */
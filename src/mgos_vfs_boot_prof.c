@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_vfs_boot_prof.h"
+
+#include <string.h>
+
+#include "common/cs_dbg.h"
+
+#include "mgos_system.h"
+#include "mgos_time.h"
+
+#if MGOS_VFS_ENABLE_BOOT_PROF
+
+/*
+ * Bring-up is single-threaded, but phases may also be entered later
+ * (e.g. mounting an SD card), so access is still serialized.
+ */
+static struct mgos_vfs_boot_phase s_phases[MGOS_VFS_BOOT_PROF_MAX_PHASES];
+static int s_num_phases = 0, s_num_dropped = 0;
+/* Open phases, innermost last. -1 if the phase was dropped. */
+static int s_stack[MGOS_VFS_BOOT_PROF_MAX_PHASES];
+static int s_depth = 0;
+/* Depth of the fs_init phase, -1 if not started. */
+static int s_fs_init_depth = -1;
+static bool s_done = false;
+
+void mgos_vfs_boot_prof_begin(const char *name, const char *arg) {
+  struct mgos_vfs_boot_phase *p;
+  int64_t now = mgos_uptime_micros();
+  mgos_lock();
+  if (s_done || s_depth == MGOS_VFS_BOOT_PROF_MAX_PHASES) goto out;
+  if (s_num_phases == MGOS_VFS_BOOT_PROF_MAX_PHASES) {
+    s_stack[s_depth++] = -1;
+    s_num_dropped++;
+    goto out;
+  }
+  p = &s_phases[s_num_phases];
+  p->name = name;
+  p->arg[0] = '\0';
+  if (arg != NULL) {
+    strncpy(p->arg, arg, sizeof(p->arg) - 1);
+    p->arg[sizeof(p->arg) - 1] = '\0';
+  }
+  p->depth = s_depth;
+  p->ok = false;
+  p->start_us = now;
+  p->dur_us = 0;
+  s_stack[s_depth++] = s_num_phases++;
+out:
+  mgos_unlock();
+}
+
+void mgos_vfs_boot_prof_begin_fs_init(void) {
+  mgos_lock();
+  if (!s_done && s_fs_init_depth < 0) s_fs_init_depth = s_depth;
+  mgos_unlock();
+  mgos_vfs_boot_prof_begin("fs_init", NULL);
+}
+
+void mgos_vfs_boot_prof_end(bool ok) {
+  int i;
+  bool report = false;
+  int64_t now = mgos_uptime_micros();
+  mgos_lock();
+  if (s_done || s_depth == 0) goto out;
+  i = s_stack[--s_depth];
+  if (i >= 0) {
+    s_phases[i].dur_us = (uint32_t) (now - s_phases[i].start_us);
+    s_phases[i].ok = ok;
+  }
+  if (s_depth == s_fs_init_depth) report = s_done = true;
+out:
+  mgos_unlock();
+  if (report) mgos_vfs_boot_prof_print();
+}
+
+int mgos_vfs_boot_prof_get(struct mgos_vfs_boot_phase *phases,
+                           int max_phases) {
+  int n;
+  mgos_lock();
+  n = s_num_phases;
+  if (phases != NULL) {
+    memcpy(phases, s_phases, (n < max_phases ? n : max_phases) * sizeof(*phases));
+  }
+  mgos_unlock();
+  return n;
+}
+
+int mgos_vfs_boot_prof_print_json(struct json_out *out) {
+  int i, len = 0;
+  mgos_lock();
+  len += json_printf(out, "[");
+  for (i = 0; i < s_num_phases; i++) {
+    const struct mgos_vfs_boot_phase *p = &s_phases[i];
+    len += json_printf(out,
+                       "%s{name: %Q, arg: %Q, depth: %d, start_us: %lld, "
+                       "dur_us: %u, ok: %B}",
+                       (i > 0 ? ", " : ""), p->name, p->arg, p->depth,
+                       (long long) p->start_us, (unsigned int) p->dur_us,
+                       p->ok);
+  }
+  len += json_printf(out, "]");
+  mgos_unlock();
+  return len;
+}
+
+void mgos_vfs_boot_prof_print(void) {
+  int i;
+  mgos_lock();
+  for (i = 0; i < s_num_phases; i++) {
+    const struct mgos_vfs_boot_phase *p = &s_phases[i];
+    LOG(LL_INFO, ("FS boot: %*s%s%s%s: %u us%s", p->depth * 2, "", p->name,
+                  (p->arg[0] != '\0' ? " " : ""), p->arg,
+                  (unsigned int) p->dur_us, (p->ok ? "" : " (failed)")));
+  }
+  if (s_num_dropped > 0) {
+    LOG(LL_INFO, ("FS boot: %d phases not recorded", s_num_dropped));
+  }
+  mgos_unlock();
+}
+
+#else /* MGOS_VFS_ENABLE_BOOT_PROF */
+
+int mgos_vfs_boot_prof_get(struct mgos_vfs_boot_phase *phases,
+                           int max_phases) {
+  (void) phases;
+  (void) max_phases;
+  return 0;
+}
+
+int mgos_vfs_boot_prof_print_json(struct json_out *out) {
+  return json_printf(out, "[]");
+}
+
+void mgos_vfs_boot_prof_print(void) {
+}
+
+#endif /* MGOS_VFS_ENABLE_BOOT_PROF */
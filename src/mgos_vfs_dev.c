@@ -23,10 +23,33 @@
 #include "common/mg_str.h"
 #include "common/queue.h"
 
+#include "frozen.h"
+#include "mgos_vfs_boot_prof.h"
+#include "mgos_vfs_dev_cache.h"
+#include "mgos_vfs_dev_compress.h"
+#include "mgos_vfs_dev_encrypt.h"
+#include "mgos_vfs_dev_multi.h"
+#include "mgos_vfs_trace.h"
+
 #ifdef MGOS_BOOT_BUILD
 #include "mgos_boot_dbg.h"
 #endif
 
+#if MGOS_VFS_DEV_ENABLE_ERASE_AHEAD || MGOS_VFS_DEV_ENABLE_WEAR_MAP || \
+    MGOS_VFS_DEV_ENABLE_QUEUE
+#include "mgos_timers.h"
+#endif
+
+#if MGOS_VFS_DEV_ENABLE_WEAR_MAP
+#include <fcntl.h>
+
+#include "mgos_vfs.h"
+#endif
+
+#if MGOS_VFS_DEV_ENABLE_STATS
+#include "mgos_time.h"
+#endif
+
 struct mgos_vfs_dev_type_entry {
   const char *type;
   const struct mgos_vfs_dev_ops *ops;
@@ -35,7 +58,70 @@ struct mgos_vfs_dev_type_entry {
 
 static SLIST_HEAD(s_dev_types, mgos_vfs_dev_type_entry)
     s_dev_types = SLIST_HEAD_INITIALIZER(s_dev_types);
-static SLIST_HEAD(s_devs, mgos_vfs_dev) s_devs = SLIST_HEAD_INITIALIZER(s_devs);
+
+/*
+ * Registered devices, hashed by name.
+ * Registry lock protects the buckets and names of registered devices,
+ * it is taken before device locks.
+ */
+#ifndef MGOS_VFS_DEV_HASH_SIZE
+#define MGOS_VFS_DEV_HASH_SIZE 16
+#endif
+SLIST_HEAD(mgos_vfs_dev_bucket, mgos_vfs_dev);
+static struct mgos_vfs_dev_bucket s_devs[MGOS_VFS_DEV_HASH_SIZE];
+static struct mgos_rlock_type *s_devs_lock = NULL;
+
+/* The lock is created by mgos_vfs_dev_init(). */
+static inline void devs_lock(void) {
+  mgos_rlock(s_devs_lock);
+}
+
+static inline void devs_unlock(void) {
+  mgos_runlock(s_devs_lock);
+}
+
+static struct mgos_vfs_dev_bucket *devs_bucket(const char *name) {
+  uint32_t h = 5381;
+  while (*name != '\0') h = h * 33 + (uint8_t) *name++;
+  return &s_devs[h % MGOS_VFS_DEV_HASH_SIZE];
+}
+
+/* Generic device types, stacked on top of other devices. */
+static bool s_builtin_types_registered = false;
+
+static bool register_builtin_types(void) {
+  bool res = true;
+  if (s_builtin_types_registered) return true;
+#if MGOS_VFS_DEV_ENABLE_CACHE
+  res = res && mgos_vfs_dev_cache_register_type();
+#endif
+#if MGOS_VFS_DEV_ENABLE_MULTI
+  res = res && mgos_vfs_dev_multi_register_types();
+#endif
+#if MGOS_VFS_DEV_ENABLE_COMPRESS
+  res = res && mgos_vfs_dev_compress_register_type();
+#endif
+#if MGOS_VFS_DEV_ENABLE_ENCRYPT
+  res = res && mgos_vfs_dev_encrypt_register_type();
+#endif
+  s_builtin_types_registered = res;
+  return res;
+}
+
+bool mgos_vfs_dev_init(void) {
+  if (s_devs_lock == NULL) {
+    s_devs_lock = mgos_rlock_create();
+    if (s_devs_lock == NULL) {
+      LOG(LL_ERROR, ("Failed to create device registry lock"));
+      return false;
+    }
+  }
+  if (!register_builtin_types()) {
+    LOG(LL_ERROR, ("Failed to register builtin device types"));
+    return false;
+  }
+  return true;
+}
 
 bool mgos_vfs_dev_register_type(const char *type,
                                 const struct mgos_vfs_dev_ops *ops) {
@@ -84,6 +170,20 @@ struct mgos_vfs_dev *mgos_vfs_dev_create(const char *type, const char *opts) {
   return mgos_vfs_dev_create_int(type, opts, NULL);
 }
 
+#if MGOS_VFS_ENABLE_LOCK_PROF
+#define dev_lock(dev) dev_lock_at(dev, __func__)
+
+static inline void dev_lock_at(struct mgos_vfs_dev *dev, const char *site) {
+  int64_t start = mgos_vfs_lock_prof_now();
+  mgos_rlock(dev->lock);
+  mgos_vfs_lock_prof_acquired(&dev->lock_prof, "dev", site, start);
+}
+
+static inline void dev_unlock(struct mgos_vfs_dev *dev) {
+  mgos_vfs_lock_prof_release(&dev->lock_prof);
+  mgos_runlock(dev->lock);
+}
+#else
 static inline void dev_lock(struct mgos_vfs_dev *dev) {
   mgos_rlock(dev->lock);
 }
@@ -91,22 +191,328 @@ static inline void dev_lock(struct mgos_vfs_dev *dev) {
 static inline void dev_unlock(struct mgos_vfs_dev *dev) {
   mgos_runlock(dev->lock);
 }
+#endif
+
+#if MGOS_VFS_DEV_ENABLE_STATS
+#define DEV_STATS_BEGIN(start) int64_t start = mgos_uptime_micros()
+
+/* Must be called with device locked. */
+static void dev_stats_add(struct mgos_vfs_dev *dev,
+                          enum mgos_vfs_dev_op_type type, uint32_t us,
+                          size_t len, enum mgos_vfs_dev_err res) {
+  struct mgos_vfs_dev_op_stats *st = &dev->stats.op[type];
+  st->ops++;
+  st->total_us += us;
+  if (us > st->max_us) st->max_us = us;
+  if (res == MGOS_VFS_DEV_ERR_NONE) {
+    st->bytes += len;
+  } else {
+    int i = -((int) res);
+    if (i <= 0 || i >= MGOS_VFS_DEV_NUM_ERRS) i = -MGOS_VFS_DEV_ERR_IO;
+    dev->stats.errors[i]++;
+  }
+}
+
+static void dev_stats_record(struct mgos_vfs_dev *dev,
+                             enum mgos_vfs_dev_op_type type, int64_t start,
+                             size_t len, enum mgos_vfs_dev_err res) {
+  dev_stats_add(dev, type, (uint32_t) (mgos_uptime_micros() - start), len,
+                res);
+}
+
+/*
+ * Batch executed by the driver: time is split evenly between the requests
+ * that succeeded, the failure (if any) is counted once.
+ */
+static void dev_stats_record_batch(struct mgos_vfs_dev *dev,
+                                   const struct mgos_vfs_dev_req *reqs, int n,
+                                   int64_t start, enum mgos_vfs_dev_err res) {
+  uint32_t us = (uint32_t) (mgos_uptime_micros() - start);
+  int i;
+  bool failed = false;
+  for (i = 0; i < n; i++) {
+    if (reqs[i].type >= MGOS_VFS_DEV_OP_MAX) continue;
+    if (reqs[i].res == MGOS_VFS_DEV_ERR_NONE) {
+      dev_stats_add(dev, reqs[i].type, us / n, reqs[i].len, reqs[i].res);
+    } else if (!failed && res != MGOS_VFS_DEV_ERR_NONE) {
+      dev_stats_add(dev, reqs[i].type, us / n, reqs[i].len, res);
+      failed = true;
+    }
+  }
+}
+
+#define DEV_STATS_END(dev, type, start, len, res) \
+  dev_stats_record(dev, type, start, len, res)
+#define DEV_STATS_BATCH_END(dev, reqs, n, start, res) \
+  dev_stats_record_batch(dev, reqs, n, start, res)
+#else
+#define DEV_STATS_BEGIN(start) (void) 0
+#define DEV_STATS_END(dev, type, start, len, res) (void) 0
+#define DEV_STATS_BATCH_END(dev, reqs, n, start, res) (void) 0
+#endif
+
+#if MGOS_VFS_ENABLE_TRACE
+static const char *s_dev_op_names[MGOS_VFS_DEV_OP_MAX] = {
+    "dev_read", "dev_write", "dev_erase",
+};
+#endif
+
+/* Hooks around driver calls: stats and tracing. */
+#define DEV_OP_BEGIN(dev, type, start, len)                              \
+  MGOS_VFS_TRACE_BEGIN(MGOS_VFS_TRACE_CAT_DEV, s_dev_op_names[type], len); \
+  DEV_STATS_BEGIN(start)
+#define DEV_OP_END(dev, type, start, len, res)                          \
+  do {                                                                  \
+    DEV_STATS_END(dev, type, start, len, res);                          \
+    MGOS_VFS_TRACE_END(MGOS_VFS_TRACE_CAT_DEV, s_dev_op_names[type], 0); \
+  } while (0)
+
+#if MGOS_VFS_DEV_ENABLE_WEAR_MAP
+struct mgos_vfs_dev_wear {
+  size_t unit;      /* Smallest erase size, 0 if the map is not available. */
+  size_t num_units; /* Number of counters. */
+  bool dirty;       /* Changed since last saved. */
+  char *path;       /* Where to persist the map, if set. */
+  mgos_timer_id timer_id;
+  uint16_t *counts;
+};
+
+struct mgos_vfs_dev_wear_file_hdr {
+  uint32_t magic;
+  uint32_t unit;
+  uint32_t num_units;
+};
+
+#define WEAR_FILE_MAGIC 0x52414557 /* "WEAR" */
+
+/* Must be called with dev locked. */
+static struct mgos_vfs_dev_wear *wear_get(struct mgos_vfs_dev *dev) {
+  if (dev->wear != NULL) return dev->wear;
+  struct mgos_vfs_dev_wear *w =
+      (struct mgos_vfs_dev_wear *) calloc(1, sizeof(*w));
+  if (w == NULL) return NULL;
+  size_t sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0};
+  size_t dev_size = dev->ops->get_size(dev);
+  if (dev->ops->get_erase_sizes != NULL &&
+      dev->ops->get_erase_sizes(dev, sizes) == MGOS_VFS_DEV_ERR_NONE &&
+      sizes[0] > 0 && dev_size >= sizes[0]) {
+    size_t num_units = dev_size / sizes[0];
+    w->counts = (uint16_t *) calloc(num_units, sizeof(*w->counts));
+    if (w->counts != NULL) {
+      w->unit = sizes[0];
+      w->num_units = num_units;
+    }
+  }
+  w->timer_id = MGOS_INVALID_TIMER_ID;
+  dev->wear = w;
+  return w;
+}
+
+static void wear_free(struct mgos_vfs_dev *dev) {
+  struct mgos_vfs_dev_wear *w = dev->wear;
+  if (w == NULL) return;
+  if (w->timer_id != MGOS_INVALID_TIMER_ID) mgos_clear_timer(w->timer_id);
+  free(w->counts);
+  free(w->path);
+  free(w);
+  dev->wear = NULL;
+}
+
+/* Must be called with dev locked. */
+static void wear_erased(struct mgos_vfs_dev *dev, size_t offset, size_t len) {
+  struct mgos_vfs_dev_wear *w = wear_get(dev);
+  size_t i, end;
+  if (w == NULL || w->unit == 0 || len == 0) return;
+  i = offset / w->unit;
+  end = (offset + len + w->unit - 1) / w->unit;
+  if (end > w->num_units) end = w->num_units;
+  for (; i < end; i++) {
+    if (w->counts[i] < 0xffff) w->counts[i]++;
+  }
+  w->dirty = true;
+}
+#else
+#define wear_erased(dev, offset, len) (void) 0
+#define wear_free(dev) (void) 0
+#endif /* MGOS_VFS_DEV_ENABLE_WEAR_MAP */
+
+#if MGOS_VFS_DEV_ENABLE_ERASE_AHEAD
+struct mgos_vfs_dev_erase_ahead {
+  size_t unit;      /* Erase block size, 0 if erase-ahead is not possible. */
+  size_t num_units; /* Number of blocks covered by the bitmaps. */
+  uint8_t *blank;   /* Erased and not written to since. */
+  uint8_t *pending; /* Discarded, waiting to be erased. */
+  size_t num_pending;
+  size_t next; /* Where to continue looking for pending blocks. */
+  mgos_timer_id timer_id;
+};
+
+#define EA_BIT_GET(bm, i) (((bm)[(i) / 8] & (1 << ((i) % 8))) != 0)
+#define EA_BIT_SET(bm, i) ((bm)[(i) / 8] |= (1 << ((i) % 8)))
+#define EA_BIT_CLR(bm, i) ((bm)[(i) / 8] &= ~(1 << ((i) % 8)))
+
+/* Must be called with dev locked. */
+static struct mgos_vfs_dev_erase_ahead *ea_get(struct mgos_vfs_dev *dev) {
+  if (dev->ea != NULL) return dev->ea;
+  struct mgos_vfs_dev_erase_ahead *ea =
+      (struct mgos_vfs_dev_erase_ahead *) calloc(1, sizeof(*ea));
+  if (ea == NULL) return NULL;
+  size_t sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0};
+  size_t dev_size = dev->ops->get_size(dev);
+  /* Only devices with uniform erase block size are supported. */
+  if (dev->ops->get_erase_sizes != NULL &&
+      dev->ops->get_erase_sizes(dev, sizes) == MGOS_VFS_DEV_ERR_NONE &&
+      sizes[0] > 0 && sizes[1] == 0 && dev_size >= sizes[0]) {
+    size_t bm_size = (dev_size / sizes[0] + 7) / 8;
+    ea->blank = (uint8_t *) calloc(2, bm_size);
+    if (ea->blank != NULL) {
+      ea->pending = ea->blank + bm_size;
+      ea->unit = sizes[0];
+      ea->num_units = dev_size / sizes[0];
+    }
+  }
+  if (ea->unit == 0) {
+    LOG(LL_DEBUG, ("%s: erase-ahead not supported",
+                   (dev->name ? dev->name : "")));
+  }
+  dev->ea = ea;
+  return ea;
+}
+
+static void ea_free(struct mgos_vfs_dev *dev) {
+  if (dev->ea == NULL) return;
+  free(dev->ea->blank);
+  free(dev->ea);
+  dev->ea = NULL;
+}
+
+/* Blocks touched by the range, including partial ones. */
+static void ea_range(const struct mgos_vfs_dev_erase_ahead *ea, size_t offset,
+                     size_t len, size_t *first, size_t *end) {
+  *first = offset / ea->unit;
+  *end = (len > 0 ? (offset + len + ea->unit - 1) / ea->unit : *first);
+  if (*end > ea->num_units) *end = ea->num_units;
+  if (*first > *end) *first = *end;
+}
+
+static void ea_clear_pending(struct mgos_vfs_dev_erase_ahead *ea, size_t i) {
+  if (!EA_BIT_GET(ea->pending, i)) return;
+  EA_BIT_CLR(ea->pending, i);
+  ea->num_pending--;
+}
+
+/* Data is about to be written: blocks are no longer blank and must not be
+ * erased behind the writer's back. */
+static void ea_write(struct mgos_vfs_dev *dev, size_t offset, size_t len) {
+  struct mgos_vfs_dev_erase_ahead *ea = dev->ea;
+  size_t i, end;
+  if (ea == NULL || ea->unit == 0) return;
+  for (ea_range(ea, offset, len, &i, &end); i < end; i++) {
+    EA_BIT_CLR(ea->blank, i);
+    ea_clear_pending(ea, i);
+  }
+}
+
+/* Returns true if all the blocks in the range are known to be blank. */
+static bool ea_is_blank(struct mgos_vfs_dev *dev, size_t offset, size_t len) {
+  struct mgos_vfs_dev_erase_ahead *ea = dev->ea;
+  size_t i, end;
+  if (ea == NULL || ea->unit == 0) return false;
+  if (offset % ea->unit != 0 || len % ea->unit != 0 || len == 0) return false;
+  ea_range(ea, offset, len, &i, &end);
+  if (end - i != len / ea->unit) return false;
+  for (; i < end; i++) {
+    if (!EA_BIT_GET(ea->blank, i)) return false;
+  }
+  return true;
+}
+
+static void ea_erased(struct mgos_vfs_dev *dev, size_t offset, size_t len) {
+  struct mgos_vfs_dev_erase_ahead *ea = dev->ea;
+  size_t i, end;
+  if (ea == NULL || ea->unit == 0) return;
+  if (offset % ea->unit != 0 || len % ea->unit != 0) return;
+  for (ea_range(ea, offset, len, &i, &end); i < end; i++) {
+    EA_BIT_SET(ea->blank, i);
+    ea_clear_pending(ea, i);
+  }
+}
+
+static void ea_timer_cb(void *arg) {
+  struct mgos_vfs_dev *dev = (struct mgos_vfs_dev *) arg;
+  bool done = false;
+  dev_lock(dev);
+  struct mgos_vfs_dev_erase_ahead *ea = dev->ea;
+  if (ea->num_pending > 0) {
+    size_t i = ea->next;
+    while (!EA_BIT_GET(ea->pending, i)) i = (i + 1) % ea->num_units;
+    ea_clear_pending(ea, i);
+    ea->next = (i + 1) % ea->num_units;
+    DEV_OP_BEGIN(dev, MGOS_VFS_DEV_OP_ERASE, start, ea->unit);
+    enum mgos_vfs_dev_err res = dev->ops->erase(dev, i * ea->unit, ea->unit);
+    DEV_OP_END(dev, MGOS_VFS_DEV_OP_ERASE, start, ea->unit, res);
+    if (res == MGOS_VFS_DEV_ERR_NONE) {
+      EA_BIT_SET(ea->blank, i);
+      wear_erased(dev, i * ea->unit, ea->unit);
+    } else {
+      LOG(LL_ERROR, ("%s: erase-ahead @ %u failed: %d",
+                     (dev->name ? dev->name : ""),
+                     (unsigned int) (i * ea->unit), res));
+    }
+  }
+  if (ea->num_pending == 0) {
+    mgos_clear_timer(ea->timer_id);
+    ea->timer_id = MGOS_INVALID_TIMER_ID;
+    done = true;
+  }
+  dev_unlock(dev);
+  /* Drop the reference held by the timer. */
+  if (done) mgos_vfs_dev_close(dev);
+}
+#else
+#define ea_write(dev, offset, len) (void) 0
+#define ea_is_blank(dev, offset, len) false
+#define ea_erased(dev, offset, len) (void) 0
+#define ea_free(dev) (void) 0
+#endif /* MGOS_VFS_DEV_ENABLE_ERASE_AHEAD */
+
+/* Must be called with registry lock held. */
+static struct mgos_vfs_dev *find_dev_locked(
+    struct mgos_vfs_dev_bucket *bucket, const char *name) {
+  struct mgos_vfs_dev *dev;
+  SLIST_FOREACH(dev, bucket, next) {
+    if (strcmp(dev->name, name) == 0) break;
+  }
+  return dev;
+}
 
 bool mgos_vfs_dev_register(struct mgos_vfs_dev *dev, const char *name) {
+  bool ret = false;
+  char *name_copy = NULL;
+  struct mgos_vfs_dev_bucket *bucket;
   if (dev == NULL || name == NULL || name[0] == '\0') return false;
-  struct mgos_vfs_dev *d;
-  SLIST_FOREACH(d, &s_devs, next) {
-    if (d == dev || strcmp(d->name, name) == 0) {
-      LOG(LL_ERROR, ("Dev %s already exists", name));
-      return false;
-    }
+  bucket = devs_bucket(name);
+  devs_lock();
+  /* A registered device has a name, only one is allowed. */
+  if (dev->name != NULL) {
+    LOG(LL_ERROR, ("Dev %s is already registered as %s", name, dev->name));
+    goto out;
+  }
+  if (find_dev_locked(bucket, name) != NULL) {
+    LOG(LL_ERROR, ("Dev %s already exists", name));
+    goto out;
   }
+  name_copy = strdup(name);
+  if (name_copy == NULL) goto out;
   dev_lock(dev);
-  dev->name = strdup(name);
+  dev->name = name_copy;
   dev->refs++;
   dev_unlock(dev);
-  SLIST_INSERT_HEAD(&s_devs, dev, next);
-  return true;
+  SLIST_INSERT_HEAD(bucket, dev, next);
+  ret = true;
+out:
+  devs_unlock();
+  return ret;
 }
 
 bool mgos_vfs_dev_create_and_register(const char *type, const char *opts,
@@ -115,25 +521,29 @@ bool mgos_vfs_dev_create_and_register(const char *type, const char *opts,
 #if defined(MGOS_BOOT_BUILD) && defined(MGOS_BOOT_DEBUG)
   mgos_boot_dbg_printf("%s %s %s\n", name, type, opts);
 #endif
+  MGOS_VFS_BOOT_PHASE_BEGIN("dev_register", name);
+  bool res = false;
   struct mgos_vfs_dev *dev = mgos_vfs_dev_create_int(type, opts, name);
-  if (dev == NULL) return false;
-  bool res = mgos_vfs_dev_register(dev, name);
-  mgos_vfs_dev_close(dev);
+  if (dev != NULL) {
+    res = mgos_vfs_dev_register(dev, name);
+    mgos_vfs_dev_close(dev);
+  }
+  MGOS_VFS_BOOT_PHASE_END(res);
   return res;
 }
 
 static struct mgos_vfs_dev *find_dev(const char *name) {
   struct mgos_vfs_dev *dev;
-  if (name == NULL) return false;
-  SLIST_FOREACH(dev, &s_devs, next) {
+  if (name == NULL) return NULL;
+  struct mgos_vfs_dev_bucket *bucket = devs_bucket(name);
+  devs_lock();
+  dev = find_dev_locked(bucket, name);
+  if (dev != NULL) {
     dev_lock(dev);
-    if (strcmp(dev->name, name) == 0) {
-      dev->refs++;
-      dev_unlock(dev);
-      break;
-    }
+    dev->refs++;
     dev_unlock(dev);
   }
+  devs_unlock();
   return dev;
 }
 
@@ -145,11 +555,322 @@ struct mgos_vfs_dev *mgos_vfs_dev_open(const char *name) {
   return dev;
 }
 
+/* Must be called with dev locked. */
+static enum mgos_vfs_dev_err dev_read_locked(struct mgos_vfs_dev *dev,
+                                             size_t offset, size_t len,
+                                             void *dst) {
+  DEV_OP_BEGIN(dev, MGOS_VFS_DEV_OP_READ, start, len);
+  enum mgos_vfs_dev_err res = dev->ops->read(dev, offset, len, dst);
+  DEV_OP_END(dev, MGOS_VFS_DEV_OP_READ, start, len, res);
+  return res;
+}
+
+/* Must be called with dev locked. */
+static enum mgos_vfs_dev_err dev_write_locked(struct mgos_vfs_dev *dev,
+                                              size_t offset, size_t len,
+                                              const void *src) {
+  ea_write(dev, offset, len);
+  DEV_OP_BEGIN(dev, MGOS_VFS_DEV_OP_WRITE, start, len);
+  enum mgos_vfs_dev_err res = dev->ops->write(dev, offset, len, src);
+  DEV_OP_END(dev, MGOS_VFS_DEV_OP_WRITE, start, len, res);
+  return res;
+}
+
+/* Must be called with dev locked. */
+static enum mgos_vfs_dev_err dev_erase_locked(struct mgos_vfs_dev *dev,
+                                              size_t offset, size_t len) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  if (!ea_is_blank(dev, offset, len)) {
+    DEV_OP_BEGIN(dev, MGOS_VFS_DEV_OP_ERASE, start, len);
+    res = dev->ops->erase(dev, offset, len);
+    DEV_OP_END(dev, MGOS_VFS_DEV_OP_ERASE, start, len, res);
+    if (res == MGOS_VFS_DEV_ERR_NONE) {
+      ea_erased(dev, offset, len);
+      wear_erased(dev, offset, len);
+    }
+  }
+  return res;
+}
+
+#if MGOS_VFS_DEV_ENABLE_QUEUE
+struct mgos_vfs_dev_q_entry {
+  enum mgos_vfs_dev_op_type type; /* Write or erase. */
+  size_t offset;
+  size_t len;
+  uint8_t *data; /* Write data. */
+  struct mgos_vfs_dev_q_entry *next;
+};
+
+struct mgos_vfs_dev_queue {
+  size_t max_bytes;
+  int flush_ms;
+  size_t bytes; /* Write data queued. */
+  int num_entries;
+  struct mgos_vfs_dev_q_entry *entries; /* Sorted by offset. */
+  mgos_timer_id timer_id;
+  /* First error of a background flush, returned by the next operation. */
+  enum mgos_vfs_dev_err err;
+};
+
+static enum mgos_vfs_dev_err q_take_err(struct mgos_vfs_dev_queue *q) {
+  enum mgos_vfs_dev_err res = q->err;
+  q->err = MGOS_VFS_DEV_ERR_NONE;
+  return res;
+}
+
+static bool q_overlaps(const struct mgos_vfs_dev_q_entry *e, size_t offset,
+                       size_t len) {
+  return (e->offset < offset + len && offset < e->offset + e->len);
+}
+
+/* Overlaps or is adjacent. */
+static bool q_touches(const struct mgos_vfs_dev_q_entry *e, size_t offset,
+                      size_t len) {
+  return (e->offset <= offset + len && offset <= e->offset + e->len);
+}
+
+static struct mgos_vfs_dev_q_entry *q_new_entry(struct mgos_vfs_dev_queue *q,
+                                                enum mgos_vfs_dev_op_type type,
+                                                size_t offset, size_t len) {
+  struct mgos_vfs_dev_q_entry *e =
+      (struct mgos_vfs_dev_q_entry *) calloc(1, sizeof(*e));
+  if (e == NULL) return NULL;
+  if (type == MGOS_VFS_DEV_OP_WRITE) {
+    e->data = (uint8_t *) malloc(len);
+    if (e->data == NULL) {
+      free(e);
+      return NULL;
+    }
+    q->bytes += len;
+  }
+  e->type = type;
+  e->offset = offset;
+  e->len = len;
+  q->num_entries++;
+  return e;
+}
+
+/* Unlink the entry *pe points to and free it. */
+static void q_del_entry(struct mgos_vfs_dev_queue *q,
+                        struct mgos_vfs_dev_q_entry **pe) {
+  struct mgos_vfs_dev_q_entry *e = *pe;
+  *pe = e->next;
+  if (e->type == MGOS_VFS_DEV_OP_WRITE) q->bytes -= e->len;
+  q->num_entries--;
+  free(e->data);
+  free(e);
+}
+
+static void q_insert(struct mgos_vfs_dev_queue *q,
+                     struct mgos_vfs_dev_q_entry *e) {
+  struct mgos_vfs_dev_q_entry **pe = &q->entries;
+  while (*pe != NULL && (*pe)->offset < e->offset) pe = &(*pe)->next;
+  e->next = *pe;
+  *pe = e;
+}
+
+/* Execute and empty the queue. Must be called with dev locked. */
+static enum mgos_vfs_dev_err q_flush(struct mgos_vfs_dev *dev) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE, r;
+  struct mgos_vfs_dev_queue *q = dev->queue;
+  struct mgos_vfs_dev_q_entry *e;
+  if (q == NULL) return MGOS_VFS_DEV_ERR_NONE;
+  res = q_take_err(q);
+  if (q->timer_id != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(q->timer_id);
+    q->timer_id = MGOS_INVALID_TIMER_ID;
+  }
+  /*
+   * Queued writes that overlap an erase were queued after it (data queued
+   * before is dropped), so all the erases go first.
+   */
+  for (e = q->entries; e != NULL; e = e->next) {
+    if (e->type != MGOS_VFS_DEV_OP_ERASE) continue;
+    r = dev_erase_locked(dev, e->offset, e->len);
+    if (r != MGOS_VFS_DEV_ERR_NONE && res == MGOS_VFS_DEV_ERR_NONE) res = r;
+  }
+  for (e = q->entries; e != NULL; e = e->next) {
+    if (e->type != MGOS_VFS_DEV_OP_WRITE) continue;
+    r = dev_write_locked(dev, e->offset, e->len, e->data);
+    if (r != MGOS_VFS_DEV_ERR_NONE && res == MGOS_VFS_DEV_ERR_NONE) res = r;
+  }
+  while (q->entries != NULL) q_del_entry(q, &q->entries);
+  if (res != MGOS_VFS_DEV_ERR_NONE) {
+    LOG(LL_ERROR, ("%s: queue flush failed: %d", (dev->name ? dev->name : ""),
+                   res));
+  }
+  return res;
+}
+
+static void q_timer_cb(void *arg) {
+  struct mgos_vfs_dev *dev = (struct mgos_vfs_dev *) arg;
+  dev_lock(dev);
+  dev->queue->timer_id = MGOS_INVALID_TIMER_ID;
+  /* Nobody to report it to now, keep it for the next operation. */
+  dev->queue->err = q_flush(dev);
+  dev_unlock(dev);
+}
+
+static void q_free(struct mgos_vfs_dev *dev) {
+  struct mgos_vfs_dev_queue *q = dev->queue;
+  if (q == NULL) return;
+  if (q->timer_id != MGOS_INVALID_TIMER_ID) mgos_clear_timer(q->timer_id);
+  while (q->entries != NULL) q_del_entry(q, &q->entries);
+  free(q);
+  dev->queue = NULL;
+}
+
+/*
+ * Flush if the range has queued requests, returns a pending error if any.
+ * Must be called with dev locked.
+ */
+static enum mgos_vfs_dev_err q_sync(struct mgos_vfs_dev *dev, size_t offset,
+                                    size_t len) {
+  struct mgos_vfs_dev_q_entry *e;
+  enum mgos_vfs_dev_err res;
+  if (dev->queue == NULL) return MGOS_VFS_DEV_ERR_NONE;
+  res = q_take_err(dev->queue);
+  if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  for (e = dev->queue->entries; e != NULL && e->offset < offset + len;
+       e = e->next) {
+    if (q_overlaps(e, offset, len)) return q_flush(dev);
+  }
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+/* Flush if full, otherwise make sure the timer is running. */
+static enum mgos_vfs_dev_err q_added(struct mgos_vfs_dev *dev) {
+  struct mgos_vfs_dev_queue *q = dev->queue;
+  if (q->bytes >= q->max_bytes ||
+      q->num_entries >= MGOS_VFS_DEV_QUEUE_MAX_ENTRIES) {
+    return q_flush(dev);
+  }
+  if (q->flush_ms > 0 && q->timer_id == MGOS_INVALID_TIMER_ID) {
+    q->timer_id = mgos_set_timer(q->flush_ms, 0, q_timer_cb, dev);
+  }
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static enum mgos_vfs_dev_err q_write(struct mgos_vfs_dev *dev, size_t offset,
+                                     size_t len, const void *src) {
+  struct mgos_vfs_dev_queue *q = dev->queue;
+  struct mgos_vfs_dev_q_entry *e, **pe;
+  size_t start = offset, end = offset + len, i;
+  enum mgos_vfs_dev_err res = q_take_err(q);
+  if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  if (len == 0) return MGOS_VFS_DEV_ERR_NONE;
+  if (end < offset || end > dev->ops->get_size(dev)) {
+    return MGOS_VFS_DEV_ERR_INVAL;
+  }
+  /* Merge with all the writes it touches. */
+  for (e = q->entries; e != NULL; e = e->next) {
+    if (e->type != MGOS_VFS_DEV_OP_WRITE || !q_touches(e, offset, len)) continue;
+    if (e->offset < start) start = e->offset;
+    if (e->offset + e->len > end) end = e->offset + e->len;
+  }
+  e = q_new_entry(q, MGOS_VFS_DEV_OP_WRITE, start, end - start);
+  if (e == NULL) return MGOS_VFS_DEV_ERR_NOMEM;
+  memset(e->data, 0xff, e->len);
+  for (pe = &q->entries; *pe != NULL;) {
+    struct mgos_vfs_dev_q_entry *oe = *pe;
+    if (oe->type == MGOS_VFS_DEV_OP_WRITE && q_touches(oe, offset, len)) {
+      memcpy(e->data + (oe->offset - start), oe->data, oe->len);
+      q_del_entry(q, pe);
+    } else {
+      pe = &oe->next;
+    }
+  }
+  for (i = 0; i < len; i++) {
+    e->data[offset - start + i] &= ((const uint8_t *) src)[i];
+  }
+  q_insert(q, e);
+  return q_added(dev);
+}
+
+static enum mgos_vfs_dev_err q_erase(struct mgos_vfs_dev *dev, size_t offset,
+                                     size_t len) {
+  struct mgos_vfs_dev_queue *q = dev->queue;
+  struct mgos_vfs_dev_q_entry *e, **pe, *oe, *tail = NULL;
+  size_t start = offset, end = offset + len;
+  enum mgos_vfs_dev_err res = q_take_err(q);
+  if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  if (len == 0) return MGOS_VFS_DEV_ERR_NONE;
+  if (end < offset || end > dev->ops->get_size(dev)) {
+    return MGOS_VFS_DEV_ERR_INVAL;
+  }
+  e = q_new_entry(q, MGOS_VFS_DEV_OP_ERASE, offset, len);
+  if (e == NULL) return MGOS_VFS_DEV_ERR_NOMEM;
+  /*
+   * Queued writes do not overlap each other, so at most one is split in
+   * two. Allocate the tail before anything is changed.
+   */
+  for (oe = q->entries; oe != NULL; oe = oe->next) {
+    size_t oe_end = oe->offset + oe->len;
+    if (oe->type != MGOS_VFS_DEV_OP_WRITE || oe->offset >= offset ||
+        oe_end <= offset + len) {
+      continue;
+    }
+    tail = q_new_entry(q, MGOS_VFS_DEV_OP_WRITE, offset + len,
+                       oe_end - (offset + len));
+    if (tail == NULL) {
+      q_del_entry(q, &e);
+      return MGOS_VFS_DEV_ERR_NOMEM;
+    }
+    memcpy(tail->data, oe->data + (tail->offset - oe->offset), tail->len);
+    break;
+  }
+  for (pe = &q->entries; *pe != NULL;) {
+    size_t oe_end;
+    oe = *pe;
+    oe_end = oe->offset + oe->len;
+    if (oe->type == MGOS_VFS_DEV_OP_ERASE) {
+      /* Coalesce with erases of the same or adjacent ranges. */
+      if (q_touches(oe, offset, len)) {
+        if (oe->offset < start) start = oe->offset;
+        if (oe_end > end) end = oe_end;
+        q_del_entry(q, pe);
+        continue;
+      }
+    } else if (q_overlaps(oe, offset, len)) {
+      /* Data written before the erase is gone, keep what is outside. */
+      if (oe->offset >= offset && oe_end <= offset + len) {
+        q_del_entry(q, pe);
+        continue;
+      }
+      if (oe->offset < offset) {
+        /* The part after the erase, if any, is already in tail. */
+        q->bytes -= oe_end - offset;
+        oe->len = offset - oe->offset;
+      } else {
+        size_t cut = offset + len - oe->offset;
+        memmove(oe->data, oe->data + cut, oe->len - cut);
+        q->bytes -= cut;
+        oe->offset += cut;
+        oe->len -= cut;
+      }
+    }
+    pe = &oe->next;
+  }
+  e->offset = start;
+  e->len = end - start;
+  q_insert(q, e);
+  if (tail != NULL) q_insert(q, tail);
+  return q_added(dev);
+}
+#else
+#define q_flush(dev) MGOS_VFS_DEV_ERR_NONE
+#define q_free(dev) (void) 0
+#define q_sync(dev, offset, len) MGOS_VFS_DEV_ERR_NONE
+#endif /* MGOS_VFS_DEV_ENABLE_QUEUE */
+
 enum mgos_vfs_dev_err mgos_vfs_dev_read(struct mgos_vfs_dev *dev, size_t offset,
                                         size_t len, void *dst) {
   if (dev == NULL) return MGOS_VFS_DEV_ERR_INVAL;
   dev_lock(dev);
-  enum mgos_vfs_dev_err res = dev->ops->read(dev, offset, len, dst);
+  enum mgos_vfs_dev_err res = q_sync(dev, offset, len);
+  if (res == MGOS_VFS_DEV_ERR_NONE) {
+    res = dev_read_locked(dev, offset, len, dst);
+  }
   dev_unlock(dev);
   return res;
 }
@@ -157,18 +878,338 @@ enum mgos_vfs_dev_err mgos_vfs_dev_read(struct mgos_vfs_dev *dev, size_t offset,
 enum mgos_vfs_dev_err mgos_vfs_dev_write(struct mgos_vfs_dev *dev,
                                          size_t offset, size_t len,
                                          const void *src) {
+  enum mgos_vfs_dev_err res;
   if (dev == NULL) return MGOS_VFS_DEV_ERR_INVAL;
   dev_lock(dev);
-  enum mgos_vfs_dev_err res = dev->ops->write(dev, offset, len, src);
+#if MGOS_VFS_DEV_ENABLE_QUEUE
+  if (dev->queue != NULL) {
+    res = q_write(dev, offset, len, src);
+  } else
+#endif
+  {
+    res = dev_write_locked(dev, offset, len, src);
+  }
   dev_unlock(dev);
   return res;
 }
 
 enum mgos_vfs_dev_err mgos_vfs_dev_erase(struct mgos_vfs_dev *dev,
                                          size_t offset, size_t len) {
+  enum mgos_vfs_dev_err res;
   if (dev == NULL) return MGOS_VFS_DEV_ERR_INVAL;
   dev_lock(dev);
-  enum mgos_vfs_dev_err res = dev->ops->erase(dev, offset, len);
+#if MGOS_VFS_DEV_ENABLE_QUEUE
+  if (dev->queue != NULL) {
+    res = q_erase(dev, offset, len);
+  } else
+#endif
+  {
+    res = dev_erase_locked(dev, offset, len);
+  }
+  dev_unlock(dev);
+  return res;
+}
+
+bool mgos_vfs_dev_set_queue(struct mgos_vfs_dev *dev, size_t max_bytes,
+                            int flush_ms) {
+#if MGOS_VFS_DEV_ENABLE_QUEUE
+  bool res = true;
+  if (dev == NULL) return false;
+  dev_lock(dev);
+  if (max_bytes == 0) {
+    res = (q_flush(dev) == MGOS_VFS_DEV_ERR_NONE);
+    q_free(dev);
+  } else {
+    if (dev->queue == NULL) {
+      dev->queue = (struct mgos_vfs_dev_queue *) calloc(1, sizeof(*dev->queue));
+      if (dev->queue != NULL) dev->queue->timer_id = MGOS_INVALID_TIMER_ID;
+    }
+    if (dev->queue != NULL) {
+      dev->queue->max_bytes = max_bytes;
+      dev->queue->flush_ms = flush_ms;
+    } else {
+      res = false;
+    }
+  }
+  dev_unlock(dev);
+  return res;
+#else
+  (void) dev;
+  (void) max_bytes;
+  (void) flush_ms;
+  return false;
+#endif
+}
+
+/* Must be called with dev locked. */
+static enum mgos_vfs_dev_err dev_exec_req(struct mgos_vfs_dev *dev,
+                                          struct mgos_vfs_dev_req *req) {
+  switch (req->type) {
+    case MGOS_VFS_DEV_OP_READ:
+      return dev_read_locked(dev, req->offset, req->len, req->buf);
+    case MGOS_VFS_DEV_OP_WRITE:
+      return dev_write_locked(dev, req->offset, req->len, req->buf);
+    case MGOS_VFS_DEV_OP_ERASE:
+      return dev_erase_locked(dev, req->offset, req->len);
+    default:
+      break;
+  }
+  return MGOS_VFS_DEV_ERR_INVAL;
+}
+
+/*
+ * Batch handled by the driver. Bookkeeping normally done per op is done
+ * around the whole batch; known-blank erases are not skipped.
+ * Must be called with dev locked.
+ */
+static enum mgos_vfs_dev_err dev_submit_driver(struct mgos_vfs_dev *dev,
+                                               struct mgos_vfs_dev_req *reqs,
+                                               int n) {
+  int i;
+  enum mgos_vfs_dev_err res;
+  for (i = 0; i < n; i++) {
+    if (reqs[i].type >= MGOS_VFS_DEV_OP_MAX) return MGOS_VFS_DEV_ERR_INVAL;
+    if (reqs[i].type == MGOS_VFS_DEV_OP_WRITE) {
+      ea_write(dev, reqs[i].offset, reqs[i].len);
+    }
+  }
+  MGOS_VFS_TRACE_BEGIN(MGOS_VFS_TRACE_CAT_DEV, "dev_submit", n);
+  DEV_STATS_BEGIN(start);
+  res = dev->ops->submit(dev, reqs, n);
+  DEV_STATS_BATCH_END(dev, reqs, n, start, res);
+  MGOS_VFS_TRACE_END(MGOS_VFS_TRACE_CAT_DEV, "dev_submit", 0);
+  for (i = 0; i < n; i++) {
+    if (reqs[i].type != MGOS_VFS_DEV_OP_ERASE ||
+        reqs[i].res != MGOS_VFS_DEV_ERR_NONE) {
+      continue;
+    }
+    ea_erased(dev, reqs[i].offset, reqs[i].len);
+    wear_erased(dev, reqs[i].offset, reqs[i].len);
+  }
+  return res;
+}
+
+enum mgos_vfs_dev_err mgos_vfs_dev_submit(struct mgos_vfs_dev *dev,
+                                          struct mgos_vfs_dev_req *reqs,
+                                          int n) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  int i;
+  if (dev == NULL || n < 0 || (n > 0 && reqs == NULL)) {
+    return MGOS_VFS_DEV_ERR_INVAL;
+  }
+  for (i = 0; i < n; i++) reqs[i].res = MGOS_VFS_DEV_ERR_IO;
+  dev_lock(dev);
+  /* Requests are executed right away, after what has been queued. */
+  res = q_flush(dev);
+  if (res != MGOS_VFS_DEV_ERR_NONE) {
+    /* Nothing executed. */
+  } else if (dev->ops->submit != NULL) {
+    res = dev_submit_driver(dev, reqs, n);
+  } else {
+    for (i = 0; i < n && res == MGOS_VFS_DEV_ERR_NONE; i++) {
+      res = reqs[i].res = dev_exec_req(dev, &reqs[i]);
+    }
+  }
+  dev_unlock(dev);
+  return res;
+}
+
+struct dev_async_op {
+  struct mgos_vfs_dev *dev;
+  struct mgos_vfs_dev_req req;
+  mgos_vfs_dev_cb_t cb;
+  void *cb_arg;
+#if MGOS_VFS_DEV_ENABLE_STATS
+  int64_t start;
+#endif
+};
+
+/* Invokes the user's callback and drops the reference taken at start. */
+static void dev_async_complete(struct dev_async_op *op,
+                               enum mgos_vfs_dev_err res) {
+  struct mgos_vfs_dev *dev = op->dev;
+  op->cb(dev, res, op->cb_arg);
+  free(op);
+  mgos_vfs_dev_close(dev);
+}
+
+/* Completion of an operation started by the driver. */
+static void dev_async_driver_cb(struct mgos_vfs_dev *dev,
+                                enum mgos_vfs_dev_err res, void *arg) {
+  struct dev_async_op *op = (struct dev_async_op *) arg;
+  const struct mgos_vfs_dev_req *req = &op->req;
+  dev_lock(dev);
+  DEV_STATS_END(dev, req->type, op->start, req->len, res);
+  if (req->type == MGOS_VFS_DEV_OP_ERASE && res == MGOS_VFS_DEV_ERR_NONE) {
+    ea_erased(dev, req->offset, req->len);
+    wear_erased(dev, req->offset, req->len);
+  }
+  dev_unlock(dev);
+  dev_async_complete(op, res);
+}
+
+/* Operation not supported by the driver, executed synchronously. */
+static void dev_async_exec(void *arg) {
+  struct dev_async_op *op = (struct dev_async_op *) arg;
+  struct mgos_vfs_dev *dev = op->dev;
+  struct mgos_vfs_dev_req *req = &op->req;
+  enum mgos_vfs_dev_err res;
+  dev_lock(dev);
+  if (req->type == MGOS_VFS_DEV_OP_READ) {
+    res = q_sync(dev, req->offset, req->len);
+  } else {
+    res = q_flush(dev);
+  }
+  if (res == MGOS_VFS_DEV_ERR_NONE) res = dev_exec_req(dev, req);
+  dev_unlock(dev);
+  dev_async_complete(op, res);
+}
+
+/* Must be called with dev locked. */
+static enum mgos_vfs_dev_err dev_async_start_driver(struct dev_async_op *op) {
+  struct mgos_vfs_dev *dev = op->dev;
+  const struct mgos_vfs_dev_ops *ops = dev->ops;
+  struct mgos_vfs_dev_req *req = &op->req;
+  enum mgos_vfs_dev_err res;
+  if (req->type == MGOS_VFS_DEV_OP_READ) {
+    res = q_sync(dev, req->offset, req->len);
+  } else {
+    res = q_flush(dev);
+  }
+  if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+#if MGOS_VFS_DEV_ENABLE_STATS
+  op->start = mgos_uptime_micros();
+#endif
+  switch (req->type) {
+    case MGOS_VFS_DEV_OP_READ:
+      res = ops->read_async(dev, req->offset, req->len, req->buf,
+                            dev_async_driver_cb, op);
+      break;
+    case MGOS_VFS_DEV_OP_WRITE:
+      ea_write(dev, req->offset, req->len);
+      res = ops->write_async(dev, req->offset, req->len, req->buf,
+                             dev_async_driver_cb, op);
+      break;
+    default:
+      res = ops->erase_async(dev, req->offset, req->len, dev_async_driver_cb,
+                             op);
+      break;
+  }
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_async(struct mgos_vfs_dev *dev,
+                                       enum mgos_vfs_dev_op_type type,
+                                       size_t offset, size_t len, void *buf,
+                                       mgos_vfs_dev_cb_t cb, void *cb_arg) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  struct dev_async_op *op = NULL;
+  bool by_driver;
+  if (dev == NULL || cb == NULL) return MGOS_VFS_DEV_ERR_INVAL;
+  op = (struct dev_async_op *) calloc(1, sizeof(*op));
+  if (op == NULL) return MGOS_VFS_DEV_ERR_NOMEM;
+  op->dev = dev;
+  op->req.type = type;
+  op->req.offset = offset;
+  op->req.len = len;
+  op->req.buf = buf;
+  op->cb = cb;
+  op->cb_arg = cb_arg;
+  dev_lock(dev);
+  switch (type) {
+    case MGOS_VFS_DEV_OP_READ:
+      by_driver = (dev->ops->read_async != NULL);
+      break;
+    case MGOS_VFS_DEV_OP_WRITE:
+      by_driver = (dev->ops->write_async != NULL);
+      break;
+    default:
+      by_driver = (dev->ops->erase_async != NULL);
+      break;
+  }
+  /* Released on completion. Taken first: the driver may complete the
+   * operation before returning. */
+  dev->refs++;
+  if (by_driver) {
+    res = dev_async_start_driver(op);
+  } else {
+#if MGOS_VFS_DEV_ENABLE_ASYNC
+    if (!mgos_invoke_cb(dev_async_exec, op, false /* from_isr */)) {
+      res = MGOS_VFS_DEV_ERR_NOMEM;
+    }
+#endif
+  }
+  if (res != MGOS_VFS_DEV_ERR_NONE) dev->refs--;
+  dev_unlock(dev);
+  if (res != MGOS_VFS_DEV_ERR_NONE) {
+    free(op);
+  } else if (!by_driver && !MGOS_VFS_DEV_ENABLE_ASYNC) {
+    dev_async_exec(op);
+  }
+  return res;
+}
+
+enum mgos_vfs_dev_err mgos_vfs_dev_read_async(struct mgos_vfs_dev *dev,
+                                              size_t offset, size_t len,
+                                              void *dst, mgos_vfs_dev_cb_t cb,
+                                              void *cb_arg) {
+  return dev_async(dev, MGOS_VFS_DEV_OP_READ, offset, len, dst, cb, cb_arg);
+}
+
+enum mgos_vfs_dev_err mgos_vfs_dev_write_async(struct mgos_vfs_dev *dev,
+                                               size_t offset, size_t len,
+                                               const void *src,
+                                               mgos_vfs_dev_cb_t cb,
+                                               void *cb_arg) {
+  return dev_async(dev, MGOS_VFS_DEV_OP_WRITE, offset, len, (void *) src, cb,
+                   cb_arg);
+}
+
+enum mgos_vfs_dev_err mgos_vfs_dev_erase_async(struct mgos_vfs_dev *dev,
+                                               size_t offset, size_t len,
+                                               mgos_vfs_dev_cb_t cb,
+                                               void *cb_arg) {
+  return dev_async(dev, MGOS_VFS_DEV_OP_ERASE, offset, len, NULL, cb, cb_arg);
+}
+
+enum mgos_vfs_dev_err mgos_vfs_dev_discard(struct mgos_vfs_dev *dev,
+                                           size_t offset, size_t len) {
+  if (dev == NULL) return MGOS_VFS_DEV_ERR_INVAL;
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  dev_lock(dev);
+  /* Background erase must not race with queued writes. */
+  res = q_sync(dev, offset, len);
+  if (res != MGOS_VFS_DEV_ERR_NONE) {
+    /* Flush failed. */
+  } else if (dev->ops->discard != NULL) {
+    res = dev->ops->discard(dev, offset, len);
+  } else {
+#if MGOS_VFS_DEV_ENABLE_ERASE_AHEAD
+    struct mgos_vfs_dev_erase_ahead *ea = ea_get(dev);
+    if (ea == NULL) {
+      res = MGOS_VFS_DEV_ERR_NOMEM;
+    } else if (ea->unit > 0) {
+      /* Only blocks that are entirely within the range. */
+      size_t i = (offset + ea->unit - 1) / ea->unit;
+      size_t end = (offset + len) / ea->unit;
+      if (end > ea->num_units) end = ea->num_units;
+      for (; i < end; i++) {
+        if (EA_BIT_GET(ea->blank, i) || EA_BIT_GET(ea->pending, i)) continue;
+        EA_BIT_SET(ea->pending, i);
+        ea->num_pending++;
+      }
+      if (ea->num_pending > 0 && ea->timer_id == MGOS_INVALID_TIMER_ID) {
+        ea->timer_id = mgos_set_timer(MGOS_VFS_DEV_ERASE_AHEAD_INTERVAL_MS,
+                                      MGOS_TIMER_REPEAT, ea_timer_cb, dev);
+        /* Timer holds a reference until all pending blocks are erased. */
+        if (ea->timer_id != MGOS_INVALID_TIMER_ID) dev->refs++;
+      }
+    }
+#else
+    (void) offset;
+    (void) len;
+#endif
+  }
   dev_unlock(dev);
   return res;
 }
@@ -181,6 +1222,238 @@ size_t mgos_vfs_dev_get_size(struct mgos_vfs_dev *dev) {
   return res;
 }
 
+enum mgos_vfs_dev_err mgos_vfs_dev_flush(struct mgos_vfs_dev *dev) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  if (dev == NULL) return MGOS_VFS_DEV_ERR_INVAL;
+  dev_lock(dev);
+  res = q_flush(dev);
+  if (res == MGOS_VFS_DEV_ERR_NONE && dev->ops->flush != NULL) {
+    res = dev->ops->flush(dev);
+  }
+  dev_unlock(dev);
+  return res;
+}
+
+bool mgos_vfs_dev_get_stats(struct mgos_vfs_dev *dev,
+                            struct mgos_vfs_dev_stats *st) {
+#if MGOS_VFS_DEV_ENABLE_STATS
+  if (dev == NULL) return false;
+  dev_lock(dev);
+  *st = dev->stats;
+  dev_unlock(dev);
+  return true;
+#else
+  (void) dev;
+  (void) st;
+  return false;
+#endif
+}
+
+size_t mgos_vfs_dev_get_wear_map(struct mgos_vfs_dev *dev, uint16_t *counts,
+                                 size_t max_units, size_t *unit_size) {
+  size_t ret = 0;
+#if MGOS_VFS_DEV_ENABLE_WEAR_MAP
+  struct mgos_vfs_dev_wear *w;
+  if (dev == NULL) return 0;
+  dev_lock(dev);
+  w = wear_get(dev);
+  if (w != NULL && w->unit > 0) {
+    if (counts != NULL) {
+      if (max_units > w->num_units) max_units = w->num_units;
+      memcpy(counts, w->counts, max_units * sizeof(*counts));
+    }
+    if (unit_size != NULL) *unit_size = w->unit;
+    ret = w->num_units;
+  }
+  dev_unlock(dev);
+#else
+  (void) dev;
+  (void) counts;
+  (void) max_units;
+  (void) unit_size;
+#endif
+  return ret;
+}
+
+#if MGOS_VFS_DEV_ENABLE_WEAR_MAP
+/* Returns a copy of the counters, to be used without holding the lock. */
+static uint16_t *wear_copy(struct mgos_vfs_dev *dev, size_t *num_units,
+                           size_t *unit_size) {
+  uint16_t *counts = NULL;
+  size_t n = mgos_vfs_dev_get_wear_map(dev, NULL, 0, unit_size);
+  if (n == 0) return NULL;
+  counts = (uint16_t *) calloc(n, sizeof(*counts));
+  if (counts == NULL) return NULL;
+  *num_units = mgos_vfs_dev_get_wear_map(dev, counts, n, unit_size);
+  return counts;
+}
+
+static int print_wear_counts(struct json_out *out, va_list *ap) {
+  const uint16_t *counts = va_arg(*ap, const uint16_t *);
+  size_t i, num_units = va_arg(*ap, size_t);
+  int len = 0;
+  for (i = 0; i < num_units; i++) {
+    len += json_printf(out, "%s%u", (i > 0 ? "," : ""),
+                       (unsigned int) counts[i]);
+  }
+  return len;
+}
+#endif
+
+int mgos_vfs_dev_print_wear_map_json(struct mgos_vfs_dev *dev,
+                                     struct json_out *out) {
+#if MGOS_VFS_DEV_ENABLE_WEAR_MAP
+  int ret;
+  size_t num_units = 0, unit_size = 0;
+  uint16_t *counts = wear_copy(dev, &num_units, &unit_size);
+  ret = json_printf(out, "{unit: %u, counts: [%M]}", (unsigned int) unit_size,
+                    print_wear_counts, counts, num_units);
+  free(counts);
+  return ret;
+#else
+  (void) dev;
+  return json_printf(out, "{unit: 0, counts: []}");
+#endif
+}
+
+bool mgos_vfs_dev_save_wear_map(struct mgos_vfs_dev *dev, const char *path) {
+  bool ret = false;
+#if MGOS_VFS_DEV_ENABLE_WEAR_MAP
+  int fd = -1;
+  size_t num_units = 0, unit_size = 0, size;
+  struct mgos_vfs_dev_wear_file_hdr hdr;
+  uint16_t *counts = wear_copy(dev, &num_units, &unit_size);
+  if (counts == NULL) goto out;
+  /* Snapshot is taken, later erases (including ours) will be saved next time.
+   */
+  dev_lock(dev);
+  dev->wear->dirty = false;
+  dev_unlock(dev);
+  hdr.magic = WEAR_FILE_MAGIC;
+  hdr.unit = unit_size;
+  hdr.num_units = num_units;
+  size = num_units * sizeof(*counts);
+  fd = mgos_vfs_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0);
+  if (fd < 0) goto out;
+  if (mgos_vfs_write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      mgos_vfs_write(fd, counts, size) != (ssize_t) size) {
+    goto out;
+  }
+  ret = true;
+out:
+  if (fd >= 0) mgos_vfs_close(fd);
+  if (!ret) {
+    LOG(LL_ERROR, ("%s: failed to save wear map to %s",
+                   (dev != NULL && dev->name ? dev->name : ""), path));
+  }
+  free(counts);
+#else
+  (void) dev;
+  (void) path;
+#endif
+  return ret;
+}
+
+#if MGOS_VFS_DEV_ENABLE_WEAR_MAP
+static void wear_timer_cb(void *arg) {
+  struct mgos_vfs_dev *dev = (struct mgos_vfs_dev *) arg;
+  char *path = NULL;
+  dev_lock(dev);
+  if (dev->wear->dirty) path = strdup(dev->wear->path);
+  dev_unlock(dev);
+  if (path == NULL) return;
+  mgos_vfs_dev_save_wear_map(dev, path);
+  free(path);
+}
+
+/* Add counts saved in the file to the current ones. */
+static bool wear_load(struct mgos_vfs_dev *dev, const char *path) {
+  bool ret = false;
+  size_t i, size;
+  uint16_t *counts = NULL;
+  struct mgos_vfs_dev_wear *w;
+  struct mgos_vfs_dev_wear_file_hdr hdr;
+  int fd = mgos_vfs_open(path, O_RDONLY, 0);
+  if (fd < 0) goto out;
+  if (mgos_vfs_read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      hdr.magic != WEAR_FILE_MAGIC) {
+    goto out;
+  }
+  dev_lock(dev);
+  w = wear_get(dev);
+  /* Geometry changed - the map is for a different device. Checked before
+   * allocating, num_units comes from the file. */
+  if (w == NULL || w->unit == 0 || w->unit != hdr.unit ||
+      w->num_units != hdr.num_units) {
+    dev_unlock(dev);
+    goto out;
+  }
+  dev_unlock(dev);
+  size = hdr.num_units * sizeof(*counts);
+  counts = (uint16_t *) malloc(size);
+  if (counts == NULL || mgos_vfs_read(fd, counts, size) != (ssize_t) size) {
+    goto out;
+  }
+  dev_lock(dev);
+  for (i = 0; i < w->num_units; i++) {
+    uint32_t c = (uint32_t) w->counts[i] + counts[i];
+    w->counts[i] = (c < 0xffff ? c : 0xffff);
+  }
+  ret = true;
+  dev_unlock(dev);
+out:
+  if (fd >= 0) mgos_vfs_close(fd);
+  free(counts);
+  return ret;
+}
+#endif
+
+bool mgos_vfs_dev_persist_wear_map(struct mgos_vfs_dev *dev, const char *path) {
+#if MGOS_VFS_DEV_ENABLE_WEAR_MAP
+  bool ret = false, persisted;
+  struct mgos_vfs_dev_wear *w;
+  if (dev == NULL || path == NULL) return false;
+  dev_lock(dev);
+  w = wear_get(dev);
+  persisted = (w != NULL && w->path != NULL);
+  dev_unlock(dev);
+  /* Saved counts are added to the current ones, only do it once. */
+  if (!persisted && !wear_load(dev, path)) {
+    LOG(LL_INFO, ("%s: no saved wear map in %s", (dev->name ? dev->name : ""),
+                  path));
+  }
+  dev_lock(dev);
+  w = wear_get(dev);
+  if (w != NULL && w->unit > 0) {
+    free(w->path);
+    w->path = strdup(path);
+    if (w->timer_id == MGOS_INVALID_TIMER_ID &&
+        MGOS_VFS_DEV_WEAR_SAVE_INTERVAL_MS > 0) {
+      w->timer_id = mgos_set_timer(MGOS_VFS_DEV_WEAR_SAVE_INTERVAL_MS,
+                                   MGOS_TIMER_REPEAT, wear_timer_cb, dev);
+    }
+    ret = (w->path != NULL);
+  }
+  dev_unlock(dev);
+  return ret;
+#else
+  (void) dev;
+  (void) path;
+  return false;
+#endif
+}
+
+void mgos_vfs_dev_reset_stats(struct mgos_vfs_dev *dev) {
+#if MGOS_VFS_DEV_ENABLE_STATS
+  if (dev == NULL) return;
+  dev_lock(dev);
+  memset(&dev->stats, 0, sizeof(dev->stats));
+  dev_unlock(dev);
+#else
+  (void) dev;
+#endif
+}
+
 enum mgos_vfs_dev_err mgos_vfs_dev_get_erase_sizes(
     struct mgos_vfs_dev *dev,
     size_t erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES]) {
@@ -201,7 +1474,11 @@ bool mgos_vfs_dev_close(struct mgos_vfs_dev *dev) {
   dev->refs--;
   LOG(LL_DEBUG, ("%s refs %d", (dev->name ? dev->name : ""), dev->refs));
   if (dev->refs == 0) {
+    (void) q_flush(dev);
+    q_free(dev);
     ret = (dev->ops->close(dev) == MGOS_VFS_DEV_ERR_NONE);
+    ea_free(dev);
+    wear_free(dev);
     dev_unlock(dev);
     mgos_rlock_destroy(dev->lock);
     memset(dev, 0, sizeof(*dev));
@@ -214,33 +1491,49 @@ out:
   return ret;
 }
 
-bool mgos_vfs_dev_unregister(const char *name) {
-  struct mgos_vfs_dev *dev = find_dev(name);
-  if (dev == NULL) return false;
+/* Must be called with registry lock held, drops the registration ref. */
+static void unregister_locked(struct mgos_vfs_dev_bucket *bucket,
+                              struct mgos_vfs_dev *dev) {
+  char *name;
+  SLIST_REMOVE(bucket, dev, mgos_vfs_dev, next);
+  /*
+   * It cannot be found anymore, so nobody can take a new reference.
+   * The name is removed before closing: the device may be still in use.
+   */
   dev_lock(dev);
-  bool alive = true;
-  dev->refs--; /* Drop the ref acquired by find_dev. */
-  if (dev->name != NULL) {
-    SLIST_REMOVE(&s_devs, dev, mgos_vfs_dev, next);
-    char *name = dev->name;
-    /* Drop the ref acquired by dev_register() and potentially destroy. */
-    alive = (dev->refs > 1);
-    mgos_vfs_dev_close(dev);
-    if (alive) {
-      /* This dev is still alive, just remove the name. */
-      dev->name = NULL;
-    }
-    free(name);
+  name = dev->name;
+  dev->name = NULL;
+  dev_unlock(dev);
+  mgos_vfs_dev_close(dev);
+  free(name);
+}
+
+bool mgos_vfs_dev_unregister(const char *name) {
+  bool ret = false;
+  struct mgos_vfs_dev *dev;
+  struct mgos_vfs_dev_bucket *bucket;
+  if (name == NULL) return false;
+  bucket = devs_bucket(name);
+  devs_lock();
+  dev = find_dev_locked(bucket, name);
+  if (dev != NULL) {
+    unregister_locked(bucket, dev);
+    ret = true;
   }
-  if (alive) dev_unlock(dev);
-  return true;
+  devs_unlock();
+  return ret;
 }
 
 bool mgos_vfs_dev_unregister_all(void) {
-  struct mgos_vfs_dev *dev, *devt;
-  SLIST_FOREACH_SAFE(dev, &s_devs, next, devt) {
-    mgos_vfs_dev_unregister(dev->name);
+  int i;
+  devs_lock();
+  for (i = 0; i < MGOS_VFS_DEV_HASH_SIZE; i++) {
+    struct mgos_vfs_dev *dev;
+    while ((dev = SLIST_FIRST(&s_devs[i])) != NULL) {
+      unregister_locked(&s_devs[i], dev);
+    }
   }
+  devs_unlock();
   return true;
 }
 
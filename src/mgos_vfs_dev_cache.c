@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_vfs_dev_cache.h"
+
+#if MGOS_VFS_DEV_ENABLE_CACHE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_dbg.h"
+
+#include "frozen.h"
+
+#include "mgos_timers.h"
+
+struct dev_cache_line {
+  size_t offset;
+  uint8_t *data;
+  uint32_t last_use;
+  /* Bitmap of written units, only these are programmed on write-back. */
+  uint8_t *dirty_map;
+  bool valid;
+  bool dirty;
+  /* The sector has been erased, it will be erased and rewritten fully. */
+  bool erased;
+};
+
+struct dev_cache_data {
+  struct mgos_vfs_dev *dev;
+  size_t sector_size;
+  size_t unit_size;
+  int num_lines;
+  struct dev_cache_line *lines;
+  uint32_t use_cnt;
+  mgos_timer_id flush_timer_id;
+  uint32_t hits, misses, write_backs;
+};
+
+static enum mgos_vfs_dev_err dev_cache_write_back(struct dev_cache_data *dd,
+                                                  struct dev_cache_line *l) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  size_t i, j, num_units = dd->sector_size / dd->unit_size;
+  if (!l->valid || !l->dirty) goto out;
+  if (l->erased) {
+    res = mgos_vfs_dev_erase(dd->dev, l->offset, dd->sector_size);
+    if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+    l->erased = false;
+    /* Only the bytes that were written need programming. */
+  }
+  /* Runs of written units, units in between are not reprogrammed. */
+  for (i = 0; i < num_units; i = j) {
+    if (!(l->dirty_map[i / 8] & (1 << (i % 8)))) {
+      j = i + 1;
+      continue;
+    }
+    for (j = i + 1; j < num_units && (l->dirty_map[j / 8] & (1 << (j % 8)));
+         j++) {
+    }
+    res = mgos_vfs_dev_write(dd->dev, l->offset + i * dd->unit_size,
+                             (j - i) * dd->unit_size,
+                             l->data + i * dd->unit_size);
+    if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+  }
+  memset(l->dirty_map, 0, (num_units + 7) / 8);
+  l->dirty = false;
+  dd->write_backs++;
+out:
+  if (res != MGOS_VFS_DEV_ERR_NONE) {
+    LOG(LL_ERROR, ("Write back @ %u failed: %d", (unsigned int) l->offset, res));
+  }
+  return res;
+}
+
+static struct dev_cache_line *dev_cache_find(struct dev_cache_data *dd,
+                                             size_t offset) {
+  int i;
+  for (i = 0; i < dd->num_lines; i++) {
+    struct dev_cache_line *l = &dd->lines[i];
+    if (l->valid && l->offset == offset) {
+      l->last_use = ++dd->use_cnt;
+      return l;
+    }
+  }
+  return NULL;
+}
+
+/* Get a line for the sector, evicting the least recently used one. */
+static struct dev_cache_line *dev_cache_alloc(struct dev_cache_data *dd,
+                                              size_t offset) {
+  int i;
+  struct dev_cache_line *l = NULL;
+  for (i = 0; i < dd->num_lines; i++) {
+    struct dev_cache_line *li = &dd->lines[i];
+    if (!li->valid) {
+      l = li;
+      break;
+    }
+    if (l == NULL || li->last_use < l->last_use) l = li;
+  }
+  if (dev_cache_write_back(dd, l) != MGOS_VFS_DEV_ERR_NONE) return NULL;
+  l->valid = l->dirty = l->erased = false;
+  l->offset = offset;
+  l->last_use = ++dd->use_cnt;
+  return l;
+}
+
+static struct dev_cache_line *dev_cache_load(struct dev_cache_data *dd,
+                                             size_t offset) {
+  struct dev_cache_line *l = dev_cache_find(dd, offset);
+  if (l != NULL) {
+    dd->hits++;
+    return l;
+  }
+  dd->misses++;
+  l = dev_cache_alloc(dd, offset);
+  if (l == NULL) return NULL;
+  if (mgos_vfs_dev_read(dd->dev, offset, dd->sector_size, l->data) !=
+      MGOS_VFS_DEV_ERR_NONE) {
+    return NULL;
+  }
+  l->valid = true;
+  return l;
+}
+
+static enum mgos_vfs_dev_err dev_cache_flush_all(struct dev_cache_data *dd) {
+  int i;
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  for (i = 0; i < dd->num_lines; i++) {
+    enum mgos_vfs_dev_err r = dev_cache_write_back(dd, &dd->lines[i]);
+    if (r != MGOS_VFS_DEV_ERR_NONE) res = r;
+  }
+  return res;
+}
+
+static void dev_cache_flush_timer_cb(void *arg) {
+  mgos_vfs_dev_flush((struct mgos_vfs_dev *) arg);
+}
+
+static enum mgos_vfs_dev_err dev_cache_open(struct mgos_vfs_dev *dev,
+                                            const char *opts) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_INVAL;
+  char *dev_name = NULL;
+  int i, lines = 8, flush_ms = 1000;
+  unsigned int sector = 0, unit = 16;
+  struct dev_cache_data *dd = NULL;
+  json_scanf(opts, strlen(opts),
+             "{dev: %Q, lines: %d, sector: %u, unit: %u, flush_ms: %d}",
+             &dev_name, &lines, &sector, &unit, &flush_ms);
+  if (dev_name == NULL || lines <= 0) {
+    LOG(LL_ERROR, ("Invalid options"));
+    goto out;
+  }
+  dd = (struct dev_cache_data *) calloc(1, sizeof(*dd));
+  if (dd == NULL) {
+    res = MGOS_VFS_DEV_ERR_NOMEM;
+    goto out;
+  }
+  dd->flush_timer_id = MGOS_INVALID_TIMER_ID;
+  dd->dev = mgos_vfs_dev_open(dev_name);
+  if (dd->dev == NULL) goto out;
+  {
+    size_t erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0};
+    mgos_vfs_dev_get_erase_sizes(dd->dev, erase_sizes);
+    if (sector == 0) sector = erase_sizes[0];
+    /* Sectors are erased as a whole. */
+    if (sector == 0 || erase_sizes[0] == 0 || sector % erase_sizes[0] != 0 ||
+        mgos_vfs_dev_get_size(dd->dev) % sector != 0) {
+      LOG(LL_ERROR, ("Invalid sector size %u", sector));
+      goto out;
+    }
+    if (unit == 0 || sector % unit != 0) {
+      LOG(LL_ERROR, ("Invalid unit size %u", unit));
+      goto out;
+    }
+  }
+  dd->sector_size = sector;
+  dd->unit_size = unit;
+  dd->num_lines = lines;
+  dd->lines = (struct dev_cache_line *) calloc(lines, sizeof(*dd->lines));
+  if (dd->lines == NULL) {
+    res = MGOS_VFS_DEV_ERR_NOMEM;
+    goto out;
+  }
+  for (i = 0; i < lines; i++) {
+    dd->lines[i].data = (uint8_t *) malloc(sector);
+    dd->lines[i].dirty_map = (uint8_t *) calloc((sector / unit + 7) / 8, 1);
+    if (dd->lines[i].data == NULL || dd->lines[i].dirty_map == NULL) {
+      res = MGOS_VFS_DEV_ERR_NOMEM;
+      goto out;
+    }
+  }
+  if (flush_ms > 0) {
+    dd->flush_timer_id = mgos_set_timer(flush_ms, MGOS_TIMER_REPEAT,
+                                        dev_cache_flush_timer_cb, dev);
+  }
+  dev->dev_data = dd;
+  res = MGOS_VFS_DEV_ERR_NONE;
+out:
+  if (res != MGOS_VFS_DEV_ERR_NONE && dd != NULL) {
+    if (dd->lines != NULL) {
+      for (i = 0; i < dd->num_lines; i++) {
+        free(dd->lines[i].data);
+        free(dd->lines[i].dirty_map);
+      }
+      free(dd->lines);
+    }
+    mgos_vfs_dev_close(dd->dev);
+    free(dd);
+  }
+  free(dev_name);
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_cache_read(struct mgos_vfs_dev *dev,
+                                            size_t offset, size_t len,
+                                            void *dst) {
+  struct dev_cache_data *dd = (struct dev_cache_data *) dev->dev_data;
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  uint8_t *p = (uint8_t *) dst;
+  while (len > 0) {
+    size_t sector_offset = offset - offset % dd->sector_size;
+    size_t off = offset - sector_offset;
+    size_t n = dd->sector_size - off;
+    struct dev_cache_line *l;
+    if (n > len) n = len;
+    l = dev_cache_find(dd, sector_offset);
+    if (l != NULL) {
+      dd->hits++;
+      memcpy(p, l->data + off, n);
+    } else if (n == dd->sector_size) {
+      /* Do not pollute the cache with bulk reads. */
+      res = mgos_vfs_dev_read(dd->dev, offset, n, p);
+    } else {
+      l = dev_cache_load(dd, sector_offset);
+      if (l == NULL) {
+        res = MGOS_VFS_DEV_ERR_IO;
+      } else {
+        memcpy(p, l->data + off, n);
+      }
+    }
+    if (res != MGOS_VFS_DEV_ERR_NONE) break;
+    offset += n;
+    len -= n;
+    p += n;
+  }
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_cache_write(struct mgos_vfs_dev *dev,
+                                             size_t offset, size_t len,
+                                             const void *src) {
+  struct dev_cache_data *dd = (struct dev_cache_data *) dev->dev_data;
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  const uint8_t *p = (const uint8_t *) src;
+  while (len > 0) {
+    size_t sector_offset = offset - offset % dd->sector_size;
+    size_t off = offset - sector_offset;
+    size_t n = dd->sector_size - off;
+    struct dev_cache_line *l;
+    if (n > len) n = len;
+    l = dev_cache_find(dd, sector_offset);
+    if (l == NULL && n == dd->sector_size) {
+      res = mgos_vfs_dev_write(dd->dev, offset, n, p);
+    } else {
+      if (l == NULL) l = dev_cache_load(dd, sector_offset);
+      if (l == NULL) {
+        res = MGOS_VFS_DEV_ERR_IO;
+      } else {
+        size_t u;
+        memcpy(l->data + off, p, n);
+        for (u = off / dd->unit_size; u * dd->unit_size < off + n; u++) {
+          l->dirty_map[u / 8] |= (1 << (u % 8));
+        }
+        l->dirty = true;
+      }
+    }
+    if (res != MGOS_VFS_DEV_ERR_NONE) break;
+    offset += n;
+    len -= n;
+    p += n;
+  }
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_cache_erase(struct mgos_vfs_dev *dev,
+                                             size_t offset, size_t len) {
+  struct dev_cache_data *dd = (struct dev_cache_data *) dev->dev_data;
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  size_t run_start = offset, end = offset + len;
+  if (offset % dd->sector_size != 0 || len % dd->sector_size != 0) {
+    return MGOS_VFS_DEV_ERR_INVAL;
+  }
+  /*
+   * Erases of cached sectors are deferred, runs of the ones that are not
+   * cached are passed through as they are.
+   */
+  for (; offset < end; offset += dd->sector_size) {
+    struct dev_cache_line *l = dev_cache_find(dd, offset);
+    if (l == NULL) continue;
+    if (offset > run_start) {
+      res = mgos_vfs_dev_erase(dd->dev, run_start, offset - run_start);
+      if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+    }
+    run_start = offset + dd->sector_size;
+    memset(l->data, 0xff, dd->sector_size);
+    l->erased = l->dirty = true;
+    memset(l->dirty_map, 0, (dd->sector_size / dd->unit_size + 7) / 8);
+  }
+  if (end > run_start) {
+    res = mgos_vfs_dev_erase(dd->dev, run_start, end - run_start);
+  }
+out:
+  return res;
+}
+
+static size_t dev_cache_get_size(struct mgos_vfs_dev *dev) {
+  struct dev_cache_data *dd = (struct dev_cache_data *) dev->dev_data;
+  return mgos_vfs_dev_get_size(dd->dev);
+}
+
+static enum mgos_vfs_dev_err dev_cache_flush(struct mgos_vfs_dev *dev) {
+  struct dev_cache_data *dd = (struct dev_cache_data *) dev->dev_data;
+  enum mgos_vfs_dev_err res = dev_cache_flush_all(dd);
+  if (res == MGOS_VFS_DEV_ERR_NONE) res = mgos_vfs_dev_flush(dd->dev);
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_cache_close(struct mgos_vfs_dev *dev) {
+  int i;
+  struct dev_cache_data *dd = (struct dev_cache_data *) dev->dev_data;
+  enum mgos_vfs_dev_err res = dev_cache_flush_all(dd);
+  LOG(LL_DEBUG, ("hits %u misses %u write backs %u", (unsigned int) dd->hits,
+                 (unsigned int) dd->misses, (unsigned int) dd->write_backs));
+  mgos_clear_timer(dd->flush_timer_id);
+  for (i = 0; i < dd->num_lines; i++) {
+    free(dd->lines[i].data);
+    free(dd->lines[i].dirty_map);
+  }
+  free(dd->lines);
+  if (!mgos_vfs_dev_close(dd->dev) && res == MGOS_VFS_DEV_ERR_NONE) {
+    res = MGOS_VFS_DEV_ERR_IO;
+  }
+  free(dd);
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_cache_get_erase_sizes(
+    struct mgos_vfs_dev *dev, size_t sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES]) {
+  struct dev_cache_data *dd = (struct dev_cache_data *) dev->dev_data;
+  int i, j = 0;
+  size_t dev_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0};
+  enum mgos_vfs_dev_err res =
+      mgos_vfs_dev_get_erase_sizes(dd->dev, dev_sizes);
+  if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  /* Erases smaller than a sector cannot be cached. */
+  sizes[j++] = dd->sector_size;
+  for (i = 0; i < MGOS_VFS_DEV_NUM_ERASE_SIZES; i++) {
+    if (dev_sizes[i] > dd->sector_size &&
+        dev_sizes[i] % dd->sector_size == 0) {
+      sizes[j++] = dev_sizes[i];
+    }
+  }
+  while (j < MGOS_VFS_DEV_NUM_ERASE_SIZES) sizes[j++] = 0;
+  return res;
+}
+
+static const struct mgos_vfs_dev_ops mgos_vfs_dev_cache_ops = {
+    .open = dev_cache_open,
+    .read = dev_cache_read,
+    .write = dev_cache_write,
+    .erase = dev_cache_erase,
+    .get_size = dev_cache_get_size,
+    .close = dev_cache_close,
+    .get_erase_sizes = dev_cache_get_erase_sizes,
+    .flush = dev_cache_flush,
+};
+
+bool mgos_vfs_dev_cache_register_type(void) {
+  return mgos_vfs_dev_register_type(MGOS_VFS_DEV_TYPE_CACHE,
+                                    &mgos_vfs_dev_cache_ops);
+}
+
+#endif /* MGOS_VFS_DEV_ENABLE_CACHE */
@@ -0,0 +1,761 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_vfs_dev_compress.h"
+
+#if MGOS_VFS_DEV_ENABLE_COMPRESS
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_dbg.h"
+
+#include "frozen.h"
+
+#include "mgos_system.h"
+#include "mgos_timers.h"
+
+/*
+ * On-flash layout: each segment (smallest erase unit of the underlying
+ * device) starts with a header, followed by records appended one after
+ * another, 4-byte aligned. Unwritten space is 0xff.
+ * The latest record of a block (highest segment seq, last in segment) wins.
+ */
+#define CMP_SEG_MAGIC 0x504d4356 /* "VCMP" */
+
+struct cmp_seg_hdr {
+  uint32_t magic;
+  uint32_t seq;
+};
+
+#define CMP_REC_LBA_MASK 0x00ffffff
+#define CMP_REC_RAW 0x01000000    /* Stored uncompressed. */
+#define CMP_REC_ERASED 0x02000000 /* Block was erased, no data. */
+
+struct cmp_rec_hdr {
+  uint32_t lba_flags;
+  uint16_t len;  /* Length of the data that follows. */
+  uint16_t csum; /* Fletcher-16 of lba_flags, len and data. */
+};
+
+#define CMP_REC_SIZE(len) ((sizeof(struct cmp_rec_hdr) + (len) + 3) & ~3U)
+
+/* Map entries: offset of the latest record on the underlying device. */
+#define CMP_MAP_NONE 0xffffffff
+#define CMP_MAP_ERASED 0x80000000 /* Points to an erase record. */
+#define CMP_MAP_OFF(e) ((e) & ~CMP_MAP_ERASED)
+
+#define CMP_HTAB_BITS 10
+#define CMP_NO_BLOCK ((size_t) -1)
+
+struct dev_cmp_data {
+  struct mgos_vfs_dev *dev;
+  size_t size;
+  size_t block_size;
+  size_t num_blocks;
+  size_t seg_size;
+  size_t num_segs;
+  uint32_t *map;
+  uint32_t *seg_seq; /* 0 for free (erased) segments. */
+  uint32_t *seg_live;
+  uint32_t next_seq;
+  int head; /* Segment being appended to, -1 if none. */
+  size_t head_off;
+  size_t num_free;
+  /* Current block, written back when another block is accessed. */
+  uint8_t *buf;
+  size_t buf_lba;
+  bool buf_dirty;
+  /* Record being written or read: header followed by data. */
+  uint8_t *rec;
+  uint16_t *htab;
+  unsigned int num_gcs;
+  mgos_timer_id flush_timer_id;
+};
+
+static const struct mgos_vfs_dev_ops mgos_vfs_dev_compress_ops;
+
+/*
+ * LZF: literal runs of up to 32 bytes and back references of 3 to 264
+ * bytes within the last 8K. Compression needs a 2K hash table, no extra
+ * RAM for decompression.
+ */
+static size_t lzf_compress(const uint8_t *in, size_t in_len, uint8_t *out,
+                           size_t out_len, uint16_t *htab) {
+  size_t ip = 0, op = 1 /* Control byte of the first literal run. */, lit = 0;
+  memset(htab, 0, sizeof(*htab) << CMP_HTAB_BITS);
+  while (ip < in_len) {
+    size_t ref = ip, off = 0;
+    uint32_t h = 0;
+    if (ip + 2 < in_len) {
+      h = ((uint32_t) in[ip] << 16) | ((uint32_t) in[ip + 1] << 8) | in[ip + 2];
+      h = (h * 2654435761U) >> (32 - CMP_HTAB_BITS);
+      ref = htab[h];
+      htab[h] = ip;
+      off = ip - ref - 1;
+    }
+    if (ref < ip && off < 8192 && in[ref] == in[ip] &&
+        in[ref + 1] == in[ip + 1] && in[ref + 2] == in[ip + 2]) {
+      size_t len = 3, max_len = in_len - ip;
+      if (max_len > 264) max_len = 264;
+      while (len < max_len && in[ref + len] == in[ip + len]) len++;
+      if (op + 4 > out_len) return 0;
+      /* Terminate the literal run, or reuse its control byte. */
+      if (lit == 0) {
+        op--;
+      } else {
+        out[op - lit - 1] = lit - 1;
+      }
+      if (len - 2 < 7) {
+        out[op++] = (off >> 8) + ((len - 2) << 5);
+      } else {
+        out[op++] = (off >> 8) + (7 << 5);
+        out[op++] = len - 2 - 7;
+      }
+      out[op++] = off & 0xff;
+      op++;
+      lit = 0;
+      /* Index the positions covered by the match. */
+      for (ip++, len--; len > 0; ip++, len--) {
+        if (ip + 2 >= in_len) continue;
+        h = ((uint32_t) in[ip] << 16) | ((uint32_t) in[ip + 1] << 8) |
+            in[ip + 2];
+        htab[(h * 2654435761U) >> (32 - CMP_HTAB_BITS)] = ip;
+      }
+    } else {
+      if (op + 2 > out_len) return 0;
+      out[op++] = in[ip++];
+      if (++lit == 32) {
+        out[op - lit - 1] = lit - 1;
+        lit = 0;
+        op++;
+      }
+    }
+  }
+  if (lit == 0) {
+    op--;
+  } else {
+    out[op - lit - 1] = lit - 1;
+  }
+  return op;
+}
+
+static size_t lzf_decompress(const uint8_t *in, size_t in_len, uint8_t *out,
+                             size_t out_len) {
+  size_t ip = 0, op = 0;
+  while (ip < in_len) {
+    size_t ctrl = in[ip++];
+    if (ctrl < 32) {
+      ctrl++;
+      if (ip + ctrl > in_len || op + ctrl > out_len) return 0;
+      memcpy(out + op, in + ip, ctrl);
+      ip += ctrl;
+      op += ctrl;
+    } else {
+      size_t len = ctrl >> 5, back, ref;
+      if (len == 7) {
+        if (ip >= in_len) return 0;
+        len += in[ip++];
+      }
+      if (ip >= in_len) return 0;
+      back = ((ctrl & 0x1f) << 8) + in[ip++] + 1;
+      len += 2;
+      if (back > op || op + len > out_len) return 0;
+      for (ref = op - back; len > 0; len--) out[op++] = out[ref++];
+    }
+  }
+  return op;
+}
+
+static uint16_t cmp_csum(const struct cmp_rec_hdr *h, const uint8_t *data) {
+  uint32_t s1 = 0, s2 = 0;
+  size_t i;
+  const uint8_t *p = (const uint8_t *) h;
+  /* Header fields that precede csum. */
+  for (i = 0; i < offsetof(struct cmp_rec_hdr, csum); i++) {
+    s1 = (s1 + p[i]) % 255;
+    s2 = (s2 + s1) % 255;
+  }
+  for (i = 0; i < h->len; i++) {
+    s1 = (s1 + data[i]) % 255;
+    s2 = (s2 + s1) % 255;
+  }
+  return (uint16_t) ((s2 << 8) | s1);
+}
+
+static size_t cmp_seg_cap(const struct dev_cmp_data *dd) {
+  return dd->seg_size - sizeof(struct cmp_seg_hdr);
+}
+
+static enum mgos_vfs_dev_err cmp_read_hdr(struct dev_cmp_data *dd,
+                                          size_t off,
+                                          struct cmp_rec_hdr *h) {
+  return mgos_vfs_dev_read(dd->dev, off, sizeof(*h), h);
+}
+
+/* Point the block to a new record, accounting for the old one. */
+static enum mgos_vfs_dev_err cmp_set_map(struct dev_cmp_data *dd, size_t lba,
+                                         uint32_t e) {
+  uint32_t old = dd->map[lba];
+  if (old != CMP_MAP_NONE) {
+    struct cmp_rec_hdr h;
+    enum mgos_vfs_dev_err res = cmp_read_hdr(dd, CMP_MAP_OFF(old), &h);
+    if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+    dd->seg_live[CMP_MAP_OFF(old) / dd->seg_size] -= CMP_REC_SIZE(h.len);
+  }
+  dd->map[lba] = e;
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static enum mgos_vfs_dev_err cmp_open_seg(struct dev_cmp_data *dd) {
+  size_t i;
+  struct cmp_seg_hdr sh;
+  enum mgos_vfs_dev_err res;
+  for (i = 0; i < dd->num_segs; i++) {
+    if (dd->seg_seq[i] == 0) break;
+  }
+  if (i == dd->num_segs) return MGOS_VFS_DEV_ERR_NOSPC;
+  sh.magic = CMP_SEG_MAGIC;
+  sh.seq = dd->next_seq++;
+  res = mgos_vfs_dev_write(dd->dev, i * dd->seg_size, sizeof(sh), &sh);
+  if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  dd->seg_seq[i] = sh.seq;
+  dd->num_free--;
+  dd->head = i;
+  dd->head_off = sizeof(sh);
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+/* Append the record in dd->rec, returns its offset in *off. */
+static enum mgos_vfs_dev_err cmp_append(struct dev_cmp_data *dd,
+                                        uint32_t *off) {
+  const struct cmp_rec_hdr *h = (const struct cmp_rec_hdr *) dd->rec;
+  size_t rec_size = CMP_REC_SIZE(h->len);
+  enum mgos_vfs_dev_err res;
+  if (dd->head < 0 || dd->head_off + rec_size > dd->seg_size) {
+    res = cmp_open_seg(dd);
+    if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  }
+  *off = dd->head * dd->seg_size + dd->head_off;
+  res = mgos_vfs_dev_write(dd->dev, *off, sizeof(*h) + h->len, dd->rec);
+  /* Even if the write failed, the space is gone. */
+  dd->head_off += rec_size;
+  if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  dd->seg_live[dd->head] += rec_size;
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+/* Move live records out of the segment and erase it. */
+static enum mgos_vfs_dev_err cmp_gc_seg(struct dev_cmp_data *dd, size_t seg) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  size_t off = sizeof(struct cmp_seg_hdr);
+  struct cmp_rec_hdr *h = (struct cmp_rec_hdr *) dd->rec;
+  while (off + sizeof(*h) <= dd->seg_size && dd->seg_live[seg] > 0) {
+    uint32_t phys = seg * dd->seg_size + off, new_off;
+    size_t lba;
+    res = cmp_read_hdr(dd, phys, h);
+    if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+    if (h->lba_flags == 0xffffffff) break;
+    if (h->len > dd->block_size) break; /* Torn write, nothing live after. */
+    lba = h->lba_flags & CMP_REC_LBA_MASK;
+    off += CMP_REC_SIZE(h->len);
+    if (lba >= dd->num_blocks || CMP_MAP_OFF(dd->map[lba]) != phys) continue;
+    res = mgos_vfs_dev_read(dd->dev, phys + sizeof(*h), h->len, h + 1);
+    if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+    res = cmp_append(dd, &new_off);
+    if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+    dd->seg_live[seg] -= CMP_REC_SIZE(h->len);
+    dd->map[lba] = new_off | (dd->map[lba] & CMP_MAP_ERASED);
+  }
+  res = mgos_vfs_dev_erase(dd->dev, seg * dd->seg_size, dd->seg_size);
+  if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+  dd->seg_seq[seg] = 0;
+  dd->seg_live[seg] = 0;
+  dd->num_free++;
+  dd->num_gcs++;
+out:
+  return res;
+}
+
+/*
+ * Make sure a record of up to rec_size can be appended.
+ * One free segment is kept in reserve for GC.
+ */
+static enum mgos_vfs_dev_err cmp_reserve(struct dev_cmp_data *dd,
+                                         size_t rec_size) {
+  size_t i, tries;
+  if (dd->head >= 0 && dd->head_off + rec_size <= dd->seg_size) {
+    return MGOS_VFS_DEV_ERR_NONE;
+  }
+  /* Each round reclaims some space, eventually freeing a segment. */
+  for (tries = 0; dd->num_free < 2 && tries < 2 * dd->num_segs; tries++) {
+    int victim = -1;
+    enum mgos_vfs_dev_err res;
+    for (i = 0; i < dd->num_segs; i++) {
+      if (dd->seg_seq[i] == 0 || (int) i == dd->head) continue;
+      if (victim < 0 || dd->seg_live[i] < dd->seg_live[victim]) victim = i;
+    }
+    if (victim < 0 || dd->seg_live[victim] >= cmp_seg_cap(dd)) break;
+    res = cmp_gc_seg(dd, victim);
+    if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  }
+  return (dd->num_free >= 2 ? MGOS_VFS_DEV_ERR_NONE : MGOS_VFS_DEV_ERR_NOSPC);
+}
+
+static enum mgos_vfs_dev_err cmp_write_block(struct dev_cmp_data *dd,
+                                             size_t lba, const uint8_t *data) {
+  struct cmp_rec_hdr *h = (struct cmp_rec_hdr *) dd->rec;
+  uint8_t *p = (uint8_t *) (h + 1);
+  uint32_t off, flags = 0;
+  size_t i, len = 0;
+  enum mgos_vfs_dev_err res = cmp_reserve(dd, CMP_REC_SIZE(dd->block_size));
+  if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  for (i = 0; i < dd->block_size && data[i] == 0xff; i++) {
+  }
+  if (i == dd->block_size) {
+    if (dd->map[lba] == CMP_MAP_NONE || (dd->map[lba] & CMP_MAP_ERASED)) {
+      return MGOS_VFS_DEV_ERR_NONE;
+    }
+    flags = CMP_REC_ERASED;
+  } else {
+    len = lzf_compress(data, dd->block_size, p, dd->block_size - 1, dd->htab);
+    if (len == 0) {
+      memcpy(p, data, dd->block_size);
+      len = dd->block_size;
+      flags = CMP_REC_RAW;
+    }
+  }
+  h->lba_flags = lba | flags;
+  h->len = len;
+  h->csum = cmp_csum(h, p);
+  res = cmp_append(dd, &off);
+  if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  return cmp_set_map(dd, lba, off | (flags & CMP_REC_ERASED ? CMP_MAP_ERASED : 0));
+}
+
+static enum mgos_vfs_dev_err cmp_write_back(struct dev_cmp_data *dd) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  if (dd->buf_dirty) {
+    res = cmp_write_block(dd, dd->buf_lba, dd->buf);
+    if (res == MGOS_VFS_DEV_ERR_NONE) dd->buf_dirty = false;
+  }
+  return res;
+}
+
+/* Read and verify the record the map entry points to. */
+static enum mgos_vfs_dev_err cmp_read_rec(struct dev_cmp_data *dd,
+                                          uint32_t off) {
+  struct cmp_rec_hdr *h = (struct cmp_rec_hdr *) dd->rec;
+  enum mgos_vfs_dev_err res = cmp_read_hdr(dd, off, h);
+  if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  if (h->len > dd->block_size) return MGOS_VFS_DEV_ERR_CORRUPT;
+  res = mgos_vfs_dev_read(dd->dev, off + sizeof(*h), h->len, h + 1);
+  if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  if (cmp_csum(h, (const uint8_t *) (h + 1)) != h->csum) {
+    return MGOS_VFS_DEV_ERR_CORRUPT;
+  }
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+/* Make lba the current block. If whole is set, contents are not loaded. */
+static enum mgos_vfs_dev_err cmp_load_block(struct dev_cmp_data *dd,
+                                            size_t lba, bool whole) {
+  struct cmp_rec_hdr *h = (struct cmp_rec_hdr *) dd->rec;
+  uint32_t e;
+  enum mgos_vfs_dev_err res;
+  if (dd->buf_lba == lba) return MGOS_VFS_DEV_ERR_NONE;
+  /* Write-back may GC and move records around. */
+  res = cmp_write_back(dd);
+  if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  e = dd->map[lba];
+  dd->buf_lba = CMP_NO_BLOCK;
+  if (whole) {
+    /* Caller will overwrite all of it. */
+  } else if (e == CMP_MAP_NONE || (e & CMP_MAP_ERASED)) {
+    memset(dd->buf, 0xff, dd->block_size);
+  } else {
+    res = cmp_read_rec(dd, e);
+    if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+    if (h->lba_flags & CMP_REC_RAW) {
+      if (h->len != dd->block_size) res = MGOS_VFS_DEV_ERR_CORRUPT;
+      memcpy(dd->buf, h + 1, h->len);
+    } else if (lzf_decompress((const uint8_t *) (h + 1), h->len, dd->buf,
+                              dd->block_size) != dd->block_size) {
+      res = MGOS_VFS_DEV_ERR_CORRUPT;
+    }
+    if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+  }
+  dd->buf_lba = lba;
+out:
+  if (res != MGOS_VFS_DEV_ERR_NONE) {
+    LOG(LL_ERROR, ("Block %u load failed: %d", (unsigned int) lba, res));
+  }
+  return res;
+}
+
+static void cmp_free(struct dev_cmp_data *dd) {
+  mgos_clear_timer(dd->flush_timer_id);
+  mgos_vfs_dev_close(dd->dev);
+  free(dd->map);
+  free(dd->seg_seq);
+  free(dd->seg_live);
+  free(dd->buf);
+  free(dd->rec);
+  free(dd->htab);
+  free(dd);
+}
+
+/* Replay records of the segment. Returns true if it ended cleanly. */
+static bool cmp_replay_seg(struct dev_cmp_data *dd, size_t seg,
+                           size_t *end_off) {
+  struct cmp_rec_hdr *h = (struct cmp_rec_hdr *) dd->rec;
+  size_t off = sizeof(struct cmp_seg_hdr);
+  bool clean = false;
+  while (off + sizeof(*h) <= dd->seg_size) {
+    uint32_t phys = seg * dd->seg_size + off;
+    size_t lba;
+    if (cmp_read_hdr(dd, phys, h) != MGOS_VFS_DEV_ERR_NONE) break;
+    if (h->lba_flags == 0xffffffff && h->len == 0xffff) {
+      clean = true;
+      break;
+    }
+    lba = h->lba_flags & CMP_REC_LBA_MASK;
+    if (lba >= dd->num_blocks || off + CMP_REC_SIZE(h->len) > dd->seg_size ||
+        cmp_read_rec(dd, phys) != MGOS_VFS_DEV_ERR_NONE) {
+      LOG(LL_WARN, ("Bad record @ %u", (unsigned int) phys));
+      break;
+    }
+    if (cmp_set_map(dd, lba, phys | (h->lba_flags & CMP_REC_ERASED
+                                         ? CMP_MAP_ERASED
+                                         : 0)) != MGOS_VFS_DEV_ERR_NONE) {
+      break;
+    }
+    dd->seg_live[seg] += CMP_REC_SIZE(h->len);
+    off += CMP_REC_SIZE(h->len);
+  }
+  *end_off = off;
+  return clean;
+}
+
+/*
+ * A segment with a blank header may still have data in it if an erase was
+ * interrupted, it is only free if it is blank all the way.
+ */
+static enum mgos_vfs_dev_err cmp_seg_is_blank(struct dev_cmp_data *dd,
+                                              size_t seg, bool *blank) {
+  size_t off, chunk = CMP_REC_SIZE(dd->block_size), i;
+  const uint32_t *p = (const uint32_t *) dd->rec;
+  *blank = false;
+  for (off = 0; off < dd->seg_size; off += chunk) {
+    size_t n = dd->seg_size - off;
+    enum mgos_vfs_dev_err res;
+    if (n > chunk) n = chunk;
+    res = mgos_vfs_dev_read(dd->dev, seg * dd->seg_size + off, n, dd->rec);
+    if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+    for (i = 0; i < n / 4; i++) {
+      if (p[i] != 0xffffffff) return MGOS_VFS_DEV_ERR_NONE;
+    }
+    for (i = n & ~3U; i < n; i++) {
+      if (dd->rec[i] != 0xff) return MGOS_VFS_DEV_ERR_NONE;
+    }
+  }
+  *blank = true;
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static enum mgos_vfs_dev_err cmp_mount(struct dev_cmp_data *dd) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  size_t i, num_used = 0;
+  uint32_t prev_seq = 0;
+  for (i = 0; i < dd->num_segs; i++) {
+    struct cmp_seg_hdr sh;
+    bool blank = false;
+    res = mgos_vfs_dev_read(dd->dev, i * dd->seg_size, sizeof(sh), &sh);
+    if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+    if (sh.magic == CMP_SEG_MAGIC && sh.seq != 0 && sh.seq != 0xffffffff) {
+      dd->seg_seq[i] = sh.seq;
+      if (sh.seq >= dd->next_seq) dd->next_seq = sh.seq + 1;
+      num_used++;
+      continue;
+    }
+    if (sh.magic == 0xffffffff && sh.seq == 0xffffffff) {
+      res = cmp_seg_is_blank(dd, i, &blank);
+      if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+    }
+    if (!blank) {
+      /* Not ours or interrupted, start over. */
+      res = mgos_vfs_dev_erase(dd->dev, i * dd->seg_size, dd->seg_size);
+      if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+    }
+  }
+  dd->num_free = dd->num_segs - num_used;
+  /* Replay in order of seq, the newest one becomes the head. */
+  while (num_used-- > 0) {
+    size_t seg = dd->num_segs, end_off;
+    for (i = 0; i < dd->num_segs; i++) {
+      if (dd->seg_seq[i] <= prev_seq) continue;
+      if (seg == dd->num_segs || dd->seg_seq[i] < dd->seg_seq[seg]) seg = i;
+    }
+    /* Only if duplicates were dropped below. */
+    if (seg == dd->num_segs) break;
+    prev_seq = dd->seg_seq[seg];
+    /* Same seq twice (corrupt or cloned flash): cannot tell which one is
+     * newer, keep the first one. */
+    for (i = seg + 1; i < dd->num_segs; i++) {
+      if (dd->seg_seq[i] != prev_seq) continue;
+      LOG(LL_ERROR, ("Duplicate segment seq %lu @ %lu, dropped",
+                     (unsigned long) prev_seq, (unsigned long) i));
+      res = mgos_vfs_dev_erase(dd->dev, i * dd->seg_size, dd->seg_size);
+      if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+      dd->seg_seq[i] = 0;
+      dd->num_free++;
+      num_used--;
+    }
+    if (cmp_replay_seg(dd, seg, &end_off)) {
+      dd->head = seg;
+      dd->head_off = end_off;
+    } else {
+      /* Do not append after a torn record. */
+      dd->head = -1;
+    }
+  }
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static void cmp_flush_timer_cb(void *arg) {
+  mgos_vfs_dev_flush((struct mgos_vfs_dev *) arg);
+}
+
+static enum mgos_vfs_dev_err dev_cmp_open(struct mgos_vfs_dev *dev,
+                                          const char *opts) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_INVAL;
+  char *dev_name = NULL;
+  unsigned long size = 0;
+  unsigned int block = 1024;
+  int flush_ms = 1000;
+  size_t phys_size, erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0};
+  struct dev_cmp_data *dd = (struct dev_cmp_data *) calloc(1, sizeof(*dd));
+  if (dd == NULL) return MGOS_VFS_DEV_ERR_NOMEM;
+  dd->flush_timer_id = MGOS_INVALID_TIMER_ID;
+  json_scanf(opts, strlen(opts), "{dev: %Q, size: %lu, block: %u, flush_ms: %d}",
+             &dev_name, &size, &block, &flush_ms);
+  if (dev_name == NULL) {
+    LOG(LL_ERROR, ("Device not specified"));
+    goto out;
+  }
+  dd->dev = mgos_vfs_dev_open(dev_name);
+  if (dd->dev == NULL) goto out;
+  phys_size = mgos_vfs_dev_get_size(dd->dev);
+  mgos_vfs_dev_get_erase_sizes(dd->dev, erase_sizes);
+  dd->seg_size = erase_sizes[0];
+  if (size == 0) size = phys_size * 2;
+  if (dd->seg_size == 0 || block == 0 || size % block != 0 ||
+      size / block > CMP_REC_LBA_MASK || phys_size >= CMP_MAP_ERASED ||
+      CMP_REC_SIZE(block) > dd->seg_size - sizeof(struct cmp_seg_hdr) ||
+      block > 0xffff) {
+    LOG(LL_ERROR, ("Invalid block size %u", block));
+    goto out;
+  }
+  dd->num_segs = phys_size / dd->seg_size;
+  if (dd->num_segs < 3) {
+    LOG(LL_ERROR, ("Device is too small"));
+    goto out;
+  }
+  dd->size = size;
+  dd->block_size = block;
+  dd->num_blocks = size / block;
+  dd->head = -1;
+  dd->next_seq = 1;
+  dd->buf_lba = CMP_NO_BLOCK;
+  dd->map = (uint32_t *) malloc(dd->num_blocks * sizeof(*dd->map));
+  dd->seg_seq = (uint32_t *) calloc(dd->num_segs, sizeof(*dd->seg_seq));
+  dd->seg_live = (uint32_t *) calloc(dd->num_segs, sizeof(*dd->seg_live));
+  dd->buf = (uint8_t *) malloc(block);
+  dd->rec = (uint8_t *) malloc(CMP_REC_SIZE(block));
+  dd->htab = (uint16_t *) malloc(sizeof(*dd->htab) << CMP_HTAB_BITS);
+  if (dd->map == NULL || dd->seg_seq == NULL || dd->seg_live == NULL ||
+      dd->buf == NULL || dd->rec == NULL || dd->htab == NULL) {
+    res = MGOS_VFS_DEV_ERR_NOMEM;
+    goto out;
+  }
+  memset(dd->map, 0xff, dd->num_blocks * sizeof(*dd->map));
+  res = cmp_mount(dd);
+  if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+  if (flush_ms > 0) {
+    dd->flush_timer_id = mgos_set_timer(flush_ms, MGOS_TIMER_REPEAT,
+                                        cmp_flush_timer_cb, dev);
+  }
+  dev->dev_data = dd;
+out:
+  if (res != MGOS_VFS_DEV_ERR_NONE) cmp_free(dd);
+  free(dev_name);
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_cmp_read(struct mgos_vfs_dev *dev,
+                                          size_t offset, size_t len,
+                                          void *dst) {
+  struct dev_cmp_data *dd = (struct dev_cmp_data *) dev->dev_data;
+  uint8_t *p = (uint8_t *) dst;
+  if (offset + len > dd->size || offset + len < offset) {
+    return MGOS_VFS_DEV_ERR_INVAL;
+  }
+  while (len > 0) {
+    size_t lba = offset / dd->block_size, off = offset % dd->block_size;
+    size_t n = dd->block_size - off;
+    enum mgos_vfs_dev_err res = cmp_load_block(dd, lba, false /* whole */);
+    if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+    if (n > len) n = len;
+    memcpy(p, dd->buf + off, n);
+    offset += n;
+    len -= n;
+    p += n;
+  }
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static enum mgos_vfs_dev_err dev_cmp_write(struct mgos_vfs_dev *dev,
+                                           size_t offset, size_t len,
+                                           const void *src) {
+  struct dev_cmp_data *dd = (struct dev_cmp_data *) dev->dev_data;
+  const uint8_t *p = (const uint8_t *) src;
+  if (offset + len > dd->size || offset + len < offset) {
+    return MGOS_VFS_DEV_ERR_INVAL;
+  }
+  while (len > 0) {
+    size_t lba = offset / dd->block_size, off = offset % dd->block_size;
+    size_t n = dd->block_size - off;
+    enum mgos_vfs_dev_err res;
+    if (n > len) n = len;
+    res = cmp_load_block(dd, lba, (n == dd->block_size));
+    if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+    memcpy(dd->buf + off, p, n);
+    dd->buf_dirty = true;
+    offset += n;
+    len -= n;
+    p += n;
+  }
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static enum mgos_vfs_dev_err dev_cmp_erase(struct mgos_vfs_dev *dev,
+                                           size_t offset, size_t len) {
+  struct dev_cmp_data *dd = (struct dev_cmp_data *) dev->dev_data;
+  enum mgos_vfs_dev_err res;
+  if (offset % dd->block_size != 0 || len % dd->block_size != 0 ||
+      offset + len > dd->size || offset + len < offset) {
+    return MGOS_VFS_DEV_ERR_INVAL;
+  }
+  /* The current block is either erased too or written back. */
+  if (dd->buf_lba != CMP_NO_BLOCK &&
+      (dd->buf_lba < offset / dd->block_size ||
+       dd->buf_lba >= (offset + len) / dd->block_size)) {
+    res = cmp_write_back(dd);
+    if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  }
+  dd->buf_lba = CMP_NO_BLOCK;
+  dd->buf_dirty = false;
+  /* An all-0xff block is stored as an erase record. */
+  memset(dd->buf, 0xff, dd->block_size);
+  for (; len > 0; offset += dd->block_size, len -= dd->block_size) {
+    size_t lba = offset / dd->block_size;
+    if (dd->map[lba] == CMP_MAP_NONE || (dd->map[lba] & CMP_MAP_ERASED)) {
+      continue;
+    }
+    res = cmp_write_block(dd, lba, dd->buf);
+    if (res != MGOS_VFS_DEV_ERR_NONE) return res;
+  }
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static size_t dev_cmp_get_size(struct mgos_vfs_dev *dev) {
+  struct dev_cmp_data *dd = (struct dev_cmp_data *) dev->dev_data;
+  return dd->size;
+}
+
+static enum mgos_vfs_dev_err dev_cmp_flush(struct mgos_vfs_dev *dev) {
+  struct dev_cmp_data *dd = (struct dev_cmp_data *) dev->dev_data;
+  enum mgos_vfs_dev_err res = cmp_write_back(dd);
+  if (res == MGOS_VFS_DEV_ERR_NONE) res = mgos_vfs_dev_flush(dd->dev);
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_cmp_close(struct mgos_vfs_dev *dev) {
+  struct dev_cmp_data *dd = (struct dev_cmp_data *) dev->dev_data;
+  enum mgos_vfs_dev_err res = cmp_write_back(dd);
+  cmp_free(dd);
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_cmp_get_erase_sizes(
+    struct mgos_vfs_dev *dev, size_t sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES]) {
+  struct dev_cmp_data *dd = (struct dev_cmp_data *) dev->dev_data;
+  memset(sizes, 0, MGOS_VFS_DEV_NUM_ERASE_SIZES * sizeof(sizes[0]));
+  sizes[0] = dd->block_size;
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static const struct mgos_vfs_dev_ops mgos_vfs_dev_compress_ops = {
+    .open = dev_cmp_open,
+    .read = dev_cmp_read,
+    .write = dev_cmp_write,
+    .erase = dev_cmp_erase,
+    .get_size = dev_cmp_get_size,
+    .close = dev_cmp_close,
+    .get_erase_sizes = dev_cmp_get_erase_sizes,
+    .flush = dev_cmp_flush,
+};
+
+bool mgos_vfs_dev_compress_register_type(void) {
+  return mgos_vfs_dev_register_type(MGOS_VFS_DEV_TYPE_COMPRESS,
+                                    &mgos_vfs_dev_compress_ops);
+}
+
+bool mgos_vfs_dev_compress_get_info(struct mgos_vfs_dev *dev,
+                                    struct mgos_vfs_dev_compress_info *info) {
+  size_t i;
+  struct dev_cmp_data *dd;
+  if (dev == NULL || dev->ops != &mgos_vfs_dev_compress_ops) return false;
+  memset(info, 0, sizeof(*info));
+  mgos_rlock(dev->lock);
+  dd = (struct dev_cmp_data *) dev->dev_data;
+  info->size = dd->size;
+  info->phys_size = dd->num_segs * dd->seg_size;
+  for (i = 0; i < dd->num_blocks; i++) {
+    if (dd->map[i] != CMP_MAP_NONE && !(dd->map[i] & CMP_MAP_ERASED)) {
+      info->used += dd->block_size;
+    }
+  }
+  for (i = 0; i < dd->num_segs; i++) info->phys_used += dd->seg_live[i];
+  info->phys_free = dd->num_free * cmp_seg_cap(dd);
+  if (dd->head >= 0) info->phys_free += dd->seg_size - dd->head_off;
+  info->num_gcs = dd->num_gcs;
+  mgos_runlock(dev->lock);
+  return true;
+}
+
+#else /* MGOS_VFS_DEV_ENABLE_COMPRESS */
+
+bool mgos_vfs_dev_compress_get_info(struct mgos_vfs_dev *dev,
+                                    struct mgos_vfs_dev_compress_info *info) {
+  (void) dev;
+  (void) info;
+  return false;
+}
+
+#endif /* MGOS_VFS_DEV_ENABLE_COMPRESS */
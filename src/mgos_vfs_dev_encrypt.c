@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_vfs_dev_encrypt.h"
+
+#if MGOS_VFS_DEV_ENABLE_ENCRYPT
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbedtls/aes.h"
+
+#include "common/cs_dbg.h"
+
+#include "frozen.h"
+
+enum dev_enc_mode {
+  DEV_ENC_MODE_XTS = 0,
+  DEV_ENC_MODE_CTR = 1,
+};
+
+struct dev_enc_data {
+  struct mgos_vfs_dev *dev;
+  enum dev_enc_mode mode;
+  size_t unit;
+#ifdef MBEDTLS_CIPHER_MODE_XTS
+  mbedtls_aes_xts_context xts_enc, xts_dec;
+#endif
+  mbedtls_aes_context ctr; /* CTR only uses the encryption key. */
+  uint8_t *buf;            /* One unit, for partial unit reads and writes. */
+  uint8_t *wbuf;           /* Whole units being written. */
+  size_t wbuf_size;
+};
+
+static bool is_blank(const uint8_t *p, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    if (p[i] != 0xff) return false;
+  }
+  return true;
+}
+
+/* Encrypt or decrypt one unit in place, ctr mode is symmetric. */
+static enum mgos_vfs_dev_err dev_enc_crypt_unit(struct dev_enc_data *dd,
+                                                size_t unit_no, bool encrypt,
+                                                uint8_t *data) {
+  uint8_t iv[16] = {0};
+  int i, ret = -1;
+  switch (dd->mode) {
+    case DEV_ENC_MODE_XTS:
+#ifdef MBEDTLS_CIPHER_MODE_XTS
+      /* Tweak is the unit number, little-endian as in IEEE P1619. */
+      for (i = 0; i < (int) sizeof(unit_no); i++) iv[i] = unit_no >> (i * 8);
+      ret = mbedtls_aes_crypt_xts(
+          (encrypt ? &dd->xts_enc : &dd->xts_dec),
+          (encrypt ? MBEDTLS_AES_ENCRYPT : MBEDTLS_AES_DECRYPT), dd->unit, iv,
+          data, data);
+#endif
+      break;
+    case DEV_ENC_MODE_CTR: {
+      /* Nonce is the unit number, counter (low 64 bits) counts blocks. */
+      size_t nc_off = 0;
+      uint8_t stream_block[16];
+      for (i = 0; i < (int) sizeof(unit_no); i++) {
+        iv[7 - i] = unit_no >> (i * 8);
+      }
+      ret = mbedtls_aes_crypt_ctr(&dd->ctr, dd->unit, &nc_off, iv,
+                                  stream_block, data, data);
+      break;
+    }
+  }
+  return (ret == 0 ? MGOS_VFS_DEV_ERR_NONE : MGOS_VFS_DEV_ERR_IO);
+}
+
+/* Decrypt a unit read from the device. Blank units are returned as is. */
+static enum mgos_vfs_dev_err dev_enc_decrypt(struct dev_enc_data *dd,
+                                             size_t unit_no, uint8_t *data) {
+  if (is_blank(data, dd->unit)) return MGOS_VFS_DEV_ERR_NONE;
+  return dev_enc_crypt_unit(dd, unit_no, false /* encrypt */, data);
+}
+
+/*
+ * Encrypt whole units in place and write them, blank units are skipped.
+ * Each run of non-blank units is written with one call.
+ */
+static enum mgos_vfs_dev_err dev_enc_write_units(struct dev_enc_data *dd,
+                                                 size_t unit_no, size_t n,
+                                                 uint8_t *data) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  size_t i, run_start = 0, run_len = 0;
+  for (i = 0; i <= n; i++) {
+    uint8_t *p = data + i * dd->unit;
+    if (i < n && !is_blank(p, dd->unit)) {
+      res = dev_enc_crypt_unit(dd, unit_no + i, true /* encrypt */, p);
+      if (res != MGOS_VFS_DEV_ERR_NONE) break;
+      if (run_len++ == 0) run_start = i;
+      continue;
+    }
+    if (run_len > 0) {
+      res = mgos_vfs_dev_write(dd->dev, (unit_no + run_start) * dd->unit,
+                               run_len * dd->unit,
+                               data + run_start * dd->unit);
+      if (res != MGOS_VFS_DEV_ERR_NONE) break;
+      run_len = 0;
+    }
+  }
+  return res;
+}
+
+static bool parse_key(const char *hex, uint8_t *key, size_t *key_len) {
+  size_t i, len = strlen(hex);
+  if (len % 2 != 0 || len / 2 > *key_len) return false;
+  for (i = 0; i < len; i++) {
+    char c = hex[i];
+    int v;
+    if (c >= '0' && c <= '9') {
+      v = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      v = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      v = c - 'A' + 10;
+    } else {
+      return false;
+    }
+    if (i % 2 == 0) {
+      key[i / 2] = v << 4;
+    } else {
+      key[i / 2] |= v;
+    }
+  }
+  *key_len = len / 2;
+  return true;
+}
+
+static void dev_enc_free(struct dev_enc_data *dd) {
+  if (dd == NULL) return;
+#ifdef MBEDTLS_CIPHER_MODE_XTS
+  mbedtls_aes_xts_free(&dd->xts_enc);
+  mbedtls_aes_xts_free(&dd->xts_dec);
+#endif
+  mbedtls_aes_free(&dd->ctr);
+  mgos_vfs_dev_close(dd->dev);
+  free(dd->buf);
+  free(dd->wbuf);
+  free(dd);
+}
+
+static enum mgos_vfs_dev_err dev_enc_open(struct mgos_vfs_dev *dev,
+                                          const char *opts) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_INVAL;
+  char *dev_name = NULL, *key_hex = NULL, *mode = NULL;
+  unsigned int unit = 256;
+  uint8_t key[64];
+  size_t key_len = sizeof(key);
+  size_t erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0};
+  int ret = -1;
+  struct dev_enc_data *dd = NULL;
+  json_scanf(opts, strlen(opts), "{dev: %Q, key: %Q, mode: %Q, unit: %u}",
+             &dev_name, &key_hex, &mode, &unit);
+  if (dev_name == NULL || key_hex == NULL ||
+      !parse_key(key_hex, key, &key_len)) {
+    LOG(LL_ERROR, ("Invalid options"));
+    goto out;
+  }
+  dd = (struct dev_enc_data *) calloc(1, sizeof(*dd));
+  if (dd == NULL) {
+    res = MGOS_VFS_DEV_ERR_NOMEM;
+    goto out;
+  }
+#ifdef MBEDTLS_CIPHER_MODE_XTS
+  mbedtls_aes_xts_init(&dd->xts_enc);
+  mbedtls_aes_xts_init(&dd->xts_dec);
+#endif
+  mbedtls_aes_init(&dd->ctr);
+  dd->dev = mgos_vfs_dev_open(dev_name);
+  if (dd->dev == NULL) goto out;
+  mgos_vfs_dev_get_erase_sizes(dd->dev, erase_sizes);
+  if (unit == 0 || unit % 16 != 0 || erase_sizes[0] == 0 ||
+      erase_sizes[0] % unit != 0) {
+    LOG(LL_ERROR, ("Invalid unit size %u", unit));
+    goto out;
+  }
+  dd->unit = unit;
+  if (mode == NULL || strcmp(mode, "xts") == 0) {
+    dd->mode = DEV_ENC_MODE_XTS;
+#ifdef MBEDTLS_CIPHER_MODE_XTS
+    if (key_len == 32 || key_len == 64) {
+      ret = mbedtls_aes_xts_setkey_enc(&dd->xts_enc, key, key_len * 8);
+      if (ret == 0) {
+        ret = mbedtls_aes_xts_setkey_dec(&dd->xts_dec, key, key_len * 8);
+      }
+    }
+#else
+    LOG(LL_ERROR, ("XTS is not supported by mbedTLS config"));
+#endif
+  } else if (strcmp(mode, "ctr") == 0) {
+    dd->mode = DEV_ENC_MODE_CTR;
+    if (key_len == 16 || key_len == 32) {
+      ret = mbedtls_aes_setkey_enc(&dd->ctr, key, key_len * 8);
+    }
+  }
+  if (ret != 0) {
+    LOG(LL_ERROR, ("Invalid mode or key"));
+    goto out;
+  }
+  dd->wbuf_size = MGOS_VFS_DEV_ENCRYPT_WRITE_BUF_SIZE;
+  dd->wbuf_size -= dd->wbuf_size % unit;
+  if (dd->wbuf_size == 0) dd->wbuf_size = unit;
+  dd->buf = (uint8_t *) malloc(unit);
+  dd->wbuf = (uint8_t *) malloc(dd->wbuf_size);
+  if (dd->buf == NULL || dd->wbuf == NULL) {
+    res = MGOS_VFS_DEV_ERR_NOMEM;
+    goto out;
+  }
+  dev->dev_data = dd;
+  res = MGOS_VFS_DEV_ERR_NONE;
+out:
+  if (res != MGOS_VFS_DEV_ERR_NONE) dev_enc_free(dd);
+  memset(key, 0, sizeof(key));
+  if (key_hex != NULL) memset(key_hex, 0, strlen(key_hex));
+  free(key_hex);
+  free(dev_name);
+  free(mode);
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_enc_read(struct mgos_vfs_dev *dev,
+                                          size_t offset, size_t len,
+                                          void *dst) {
+  struct dev_enc_data *dd = (struct dev_enc_data *) dev->dev_data;
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  uint8_t *p = (uint8_t *) dst;
+  while (len > 0) {
+    size_t unit_no = offset / dd->unit, off = offset % dd->unit;
+    size_t n = dd->unit - off;
+    if (off == 0 && len >= dd->unit) {
+      /* Read all the whole units at once, decrypt in place. */
+      size_t i;
+      n = len - len % dd->unit;
+      res = mgos_vfs_dev_read(dd->dev, offset, n, p);
+      if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+      for (i = 0; i < n / dd->unit; i++) {
+        res = dev_enc_decrypt(dd, unit_no + i, p + i * dd->unit);
+        if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+      }
+    } else {
+      if (n > len) n = len;
+      res = mgos_vfs_dev_read(dd->dev, unit_no * dd->unit, dd->unit, dd->buf);
+      if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+      res = dev_enc_decrypt(dd, unit_no, dd->buf);
+      if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+      memcpy(p, dd->buf + off, n);
+    }
+    offset += n;
+    len -= n;
+    p += n;
+  }
+out:
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_enc_write(struct mgos_vfs_dev *dev,
+                                           size_t offset, size_t len,
+                                           const void *src) {
+  struct dev_enc_data *dd = (struct dev_enc_data *) dev->dev_data;
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  const uint8_t *p = (const uint8_t *) src;
+  while (len > 0) {
+    size_t unit_no = offset / dd->unit, off = offset % dd->unit;
+    size_t n = dd->unit - off;
+    if (off == 0 && len >= dd->unit) {
+      /* Whole units, as many as fit in the buffer. */
+      n = len - len % dd->unit;
+      if (n > dd->wbuf_size) n = dd->wbuf_size;
+      memcpy(dd->wbuf, p, n);
+      res = dev_enc_write_units(dd, unit_no, n / dd->unit, dd->wbuf);
+    } else {
+      /* Partial unit, merge with the current contents. */
+      if (n > len) n = len;
+      res = mgos_vfs_dev_read(dd->dev, unit_no * dd->unit, dd->unit, dd->buf);
+      if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+      res = dev_enc_decrypt(dd, unit_no, dd->buf);
+      if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+      memcpy(dd->buf + off, p, n);
+      res = dev_enc_write_units(dd, unit_no, 1, dd->buf);
+    }
+    if (res != MGOS_VFS_DEV_ERR_NONE) goto out;
+    offset += n;
+    len -= n;
+    p += n;
+  }
+out:
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_enc_erase(struct mgos_vfs_dev *dev,
+                                           size_t offset, size_t len) {
+  struct dev_enc_data *dd = (struct dev_enc_data *) dev->dev_data;
+  return mgos_vfs_dev_erase(dd->dev, offset, len);
+}
+
+static size_t dev_enc_get_size(struct mgos_vfs_dev *dev) {
+  struct dev_enc_data *dd = (struct dev_enc_data *) dev->dev_data;
+  return mgos_vfs_dev_get_size(dd->dev);
+}
+
+static enum mgos_vfs_dev_err dev_enc_flush(struct mgos_vfs_dev *dev) {
+  struct dev_enc_data *dd = (struct dev_enc_data *) dev->dev_data;
+  return mgos_vfs_dev_flush(dd->dev);
+}
+
+static enum mgos_vfs_dev_err dev_enc_close(struct mgos_vfs_dev *dev) {
+  struct dev_enc_data *dd = (struct dev_enc_data *) dev->dev_data;
+  dev_enc_free(dd);
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static enum mgos_vfs_dev_err dev_enc_get_erase_sizes(
+    struct mgos_vfs_dev *dev, size_t sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES]) {
+  struct dev_enc_data *dd = (struct dev_enc_data *) dev->dev_data;
+  return mgos_vfs_dev_get_erase_sizes(dd->dev, sizes);
+}
+
+static const struct mgos_vfs_dev_ops mgos_vfs_dev_encrypt_ops = {
+    .open = dev_enc_open,
+    .read = dev_enc_read,
+    .write = dev_enc_write,
+    .erase = dev_enc_erase,
+    .get_size = dev_enc_get_size,
+    .close = dev_enc_close,
+    .get_erase_sizes = dev_enc_get_erase_sizes,
+    .flush = dev_enc_flush,
+};
+
+bool mgos_vfs_dev_encrypt_register_type(void) {
+  return mgos_vfs_dev_register_type(MGOS_VFS_DEV_TYPE_ENCRYPT,
+                                    &mgos_vfs_dev_encrypt_ops);
+}
+
+#endif /* MGOS_VFS_DEV_ENABLE_ENCRYPT */
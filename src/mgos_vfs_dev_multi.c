@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_vfs_dev_multi.h"
+
+#if MGOS_VFS_DEV_ENABLE_MULTI
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_dbg.h"
+
+#include "frozen.h"
+#include "mgos_system.h"
+
+struct dev_multi_data {
+  int num_devs;
+  struct mgos_vfs_dev **devs;
+  size_t *dev_sizes;
+  size_t size;
+  size_t erase_size;
+  /* Stripe chunk size, 0 for concat. */
+  size_t chunk;
+};
+
+enum dev_multi_op {
+  DEV_MULTI_READ,
+  DEV_MULTI_WRITE,
+  DEV_MULTI_ERASE,
+};
+
+static void dev_multi_free(struct dev_multi_data *dd) {
+  int i;
+  for (i = 0; i < dd->num_devs; i++) mgos_vfs_dev_close(dd->devs[i]);
+  free(dd->devs);
+  free(dd->dev_sizes);
+  free(dd);
+}
+
+static enum mgos_vfs_dev_err dev_multi_open(struct mgos_vfs_dev *dev,
+                                            const char *opts, bool stripe) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_INVAL;
+  struct json_token t;
+  unsigned int chunk = 0;
+  size_t min_size = 0;
+  int i, n = 0;
+  struct dev_multi_data *dd =
+      (struct dev_multi_data *) calloc(1, sizeof(*dd));
+  if (dd == NULL) return MGOS_VFS_DEV_ERR_NOMEM;
+  json_scanf(opts, strlen(opts), "{chunk: %u}", &chunk);
+  while (json_scanf_array_elem(opts, strlen(opts), ".devs", n, &t) > 0) n++;
+  if (n == 0) {
+    LOG(LL_ERROR, ("No devices"));
+    goto out;
+  }
+  dd->devs = (struct mgos_vfs_dev **) calloc(n, sizeof(*dd->devs));
+  dd->dev_sizes = (size_t *) calloc(n, sizeof(*dd->dev_sizes));
+  if (dd->devs == NULL || dd->dev_sizes == NULL) {
+    res = MGOS_VFS_DEV_ERR_NOMEM;
+    goto out;
+  }
+  for (i = 0; i < n; i++) {
+    char name[32];
+    size_t erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0};
+    json_scanf_array_elem(opts, strlen(opts), ".devs", i, &t);
+    if (t.len <= 0 || t.len >= (int) sizeof(name)) goto out;
+    memcpy(name, t.ptr, t.len);
+    name[t.len] = '\0';
+    dd->devs[i] = mgos_vfs_dev_open(name);
+    if (dd->devs[i] == NULL) goto out;
+    dd->num_devs++;
+    dd->dev_sizes[i] = mgos_vfs_dev_get_size(dd->devs[i]);
+    if (mgos_vfs_dev_get_erase_sizes(dd->devs[i], erase_sizes) !=
+            MGOS_VFS_DEV_ERR_NONE ||
+        erase_sizes[0] == 0) {
+      LOG(LL_ERROR, ("%s: no erase size", name));
+      goto out;
+    }
+    if (erase_sizes[0] > dd->erase_size) dd->erase_size = erase_sizes[0];
+    if (i == 0 || dd->dev_sizes[i] < min_size) min_size = dd->dev_sizes[i];
+  }
+  if (stripe && chunk != 0) dd->erase_size = chunk;
+  /* All the devices must be able to erase a unit of ours in one go. */
+  for (i = 0; i < n; i++) {
+    size_t erase_sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES] = {0};
+    mgos_vfs_dev_get_erase_sizes(dd->devs[i], erase_sizes);
+    if (dd->erase_size % erase_sizes[0] != 0 ||
+        (!stripe && dd->dev_sizes[i] % dd->erase_size != 0)) {
+      LOG(LL_ERROR,
+          ("Incompatible erase size %u", (unsigned int) dd->erase_size));
+      goto out;
+    }
+  }
+  if (stripe) {
+    dd->chunk = dd->erase_size;
+    dd->size = (min_size - min_size % dd->chunk) * n;
+  } else {
+    for (i = 0; i < n; i++) dd->size += dd->dev_sizes[i];
+  }
+  dev->dev_data = dd;
+  res = MGOS_VFS_DEV_ERR_NONE;
+out:
+  if (res != MGOS_VFS_DEV_ERR_NONE) dev_multi_free(dd);
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_concat_open(struct mgos_vfs_dev *dev,
+                                             const char *opts) {
+  return dev_multi_open(dev, opts, false /* stripe */);
+}
+
+static enum mgos_vfs_dev_err dev_stripe_open(struct mgos_vfs_dev *dev,
+                                             const char *opts) {
+  return dev_multi_open(dev, opts, true /* stripe */);
+}
+
+/*
+ * Map offset to a device and offset on it. Returns the length of the
+ * contiguous piece, up to len.
+ */
+static size_t dev_multi_map(const struct dev_multi_data *dd, size_t offset,
+                            size_t len, int *idx, size_t *dev_offset) {
+  size_t n;
+  if (dd->chunk > 0) {
+    size_t chunk_idx = offset / dd->chunk, chunk_off = offset % dd->chunk;
+    *idx = chunk_idx % dd->num_devs;
+    *dev_offset = (chunk_idx / dd->num_devs) * dd->chunk + chunk_off;
+    n = dd->chunk - chunk_off;
+  } else {
+    int i = 0;
+    while (offset >= dd->dev_sizes[i]) offset -= dd->dev_sizes[i++];
+    *idx = i;
+    *dev_offset = offset;
+    n = dd->dev_sizes[i] - offset;
+  }
+  return (n < len ? n : len);
+}
+
+static enum mgos_vfs_dev_err dev_multi_io(struct mgos_vfs_dev *dev,
+                                          enum dev_multi_op op, size_t offset,
+                                          size_t len, uint8_t *buf) {
+  struct dev_multi_data *dd = (struct dev_multi_data *) dev->dev_data;
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  if (offset + len > dd->size || offset + len < offset) {
+    return MGOS_VFS_DEV_ERR_INVAL;
+  }
+  while (len > 0) {
+    int idx;
+    size_t dev_offset;
+    size_t n = dev_multi_map(dd, offset, len, &idx, &dev_offset);
+    struct mgos_vfs_dev *d = dd->devs[idx];
+    switch (op) {
+      case DEV_MULTI_READ:
+        res = mgos_vfs_dev_read(d, dev_offset, n, buf);
+        break;
+      case DEV_MULTI_WRITE:
+        res = mgos_vfs_dev_write(d, dev_offset, n, buf);
+        break;
+      case DEV_MULTI_ERASE:
+        res = mgos_vfs_dev_erase(d, dev_offset, n);
+        break;
+    }
+    if (res != MGOS_VFS_DEV_ERR_NONE) break;
+    offset += n;
+    len -= n;
+    if (buf != NULL) buf += n;
+  }
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_multi_read(struct mgos_vfs_dev *dev,
+                                            size_t offset, size_t len,
+                                            void *dst) {
+  return dev_multi_io(dev, DEV_MULTI_READ, offset, len, (uint8_t *) dst);
+}
+
+static enum mgos_vfs_dev_err dev_multi_write(struct mgos_vfs_dev *dev,
+                                             size_t offset, size_t len,
+                                             const void *src) {
+  return dev_multi_io(dev, DEV_MULTI_WRITE, offset, len, (uint8_t *) src);
+}
+
+static enum mgos_vfs_dev_err dev_multi_erase(struct mgos_vfs_dev *dev,
+                                             size_t offset, size_t len) {
+  struct dev_multi_data *dd = (struct dev_multi_data *) dev->dev_data;
+  if (offset % dd->erase_size != 0 || len % dd->erase_size != 0) {
+    return MGOS_VFS_DEV_ERR_INVAL;
+  }
+  return dev_multi_io(dev, DEV_MULTI_ERASE, offset, len, NULL);
+}
+
+/*
+ * Asynchronous operation. Pieces are started on all the devices at once, so
+ * they overlap if the drivers implement asynchronous operations.
+ * Completes when the last piece does.
+ */
+struct dev_multi_async_op {
+  struct mgos_vfs_dev *dev;
+  mgos_vfs_dev_cb_t cb;
+  void *cb_arg;
+  int pending;
+  enum mgos_vfs_dev_err res;
+};
+
+/* Pieces may complete on different tasks. */
+static void dev_multi_async_ref(struct dev_multi_async_op *op) {
+  mgos_ints_disable();
+  op->pending++;
+  mgos_ints_enable();
+}
+
+static void dev_multi_async_unref(struct dev_multi_async_op *op,
+                                  enum mgos_vfs_dev_err res) {
+  bool done;
+  mgos_ints_disable();
+  if (op->res == MGOS_VFS_DEV_ERR_NONE) op->res = res;
+  done = (--op->pending == 0);
+  mgos_ints_enable();
+  if (!done) return;
+  op->cb(op->dev, op->res, op->cb_arg);
+  free(op);
+}
+
+static void dev_multi_async_cb(struct mgos_vfs_dev *d,
+                               enum mgos_vfs_dev_err res, void *arg) {
+  dev_multi_async_unref((struct dev_multi_async_op *) arg, res);
+  (void) d;
+}
+
+static enum mgos_vfs_dev_err dev_multi_io_async(
+    struct mgos_vfs_dev *dev, enum dev_multi_op type, size_t offset,
+    size_t len, uint8_t *buf, mgos_vfs_dev_cb_t cb, void *cb_arg) {
+  struct dev_multi_data *dd = (struct dev_multi_data *) dev->dev_data;
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  struct dev_multi_async_op *op;
+  bool started = false;
+  if (offset + len > dd->size || offset + len < offset) {
+    return MGOS_VFS_DEV_ERR_INVAL;
+  }
+  op = (struct dev_multi_async_op *) calloc(1, sizeof(*op));
+  if (op == NULL) return MGOS_VFS_DEV_ERR_NOMEM;
+  op->dev = dev;
+  op->cb = cb;
+  op->cb_arg = cb_arg;
+  /* Held while pieces are being started: they may complete right away. */
+  op->pending = 1;
+  while (len > 0) {
+    int idx;
+    size_t dev_offset;
+    size_t n = dev_multi_map(dd, offset, len, &idx, &dev_offset);
+    struct mgos_vfs_dev *d = dd->devs[idx];
+    dev_multi_async_ref(op);
+    switch (type) {
+      case DEV_MULTI_READ:
+        res = mgos_vfs_dev_read_async(d, dev_offset, n, buf,
+                                      dev_multi_async_cb, op);
+        break;
+      case DEV_MULTI_WRITE:
+        res = mgos_vfs_dev_write_async(d, dev_offset, n, buf,
+                                       dev_multi_async_cb, op);
+        break;
+      case DEV_MULTI_ERASE:
+        res = mgos_vfs_dev_erase_async(d, dev_offset, n, dev_multi_async_cb,
+                                       op);
+        break;
+    }
+    if (res != MGOS_VFS_DEV_ERR_NONE) {
+      dev_multi_async_unref(op, MGOS_VFS_DEV_ERR_NONE);
+      break;
+    }
+    started = true;
+    offset += n;
+    len -= n;
+    if (buf != NULL) buf += n;
+  }
+  /* Nothing is in flight, fail without invoking cb. */
+  if (!started && res != MGOS_VFS_DEV_ERR_NONE) {
+    free(op);
+    return res;
+  }
+  /* Otherwise the error is reported to cb once the started pieces are done. */
+  dev_multi_async_unref(op, res);
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static enum mgos_vfs_dev_err dev_multi_read_async(struct mgos_vfs_dev *dev,
+                                                  size_t offset, size_t len,
+                                                  void *dst,
+                                                  mgos_vfs_dev_cb_t cb,
+                                                  void *cb_arg) {
+  return dev_multi_io_async(dev, DEV_MULTI_READ, offset, len, (uint8_t *) dst,
+                            cb, cb_arg);
+}
+
+static enum mgos_vfs_dev_err dev_multi_write_async(struct mgos_vfs_dev *dev,
+                                                   size_t offset, size_t len,
+                                                   const void *src,
+                                                   mgos_vfs_dev_cb_t cb,
+                                                   void *cb_arg) {
+  return dev_multi_io_async(dev, DEV_MULTI_WRITE, offset, len,
+                            (uint8_t *) src, cb, cb_arg);
+}
+
+static enum mgos_vfs_dev_err dev_multi_erase_async(struct mgos_vfs_dev *dev,
+                                                   size_t offset, size_t len,
+                                                   mgos_vfs_dev_cb_t cb,
+                                                   void *cb_arg) {
+  struct dev_multi_data *dd = (struct dev_multi_data *) dev->dev_data;
+  if (offset % dd->erase_size != 0 || len % dd->erase_size != 0) {
+    return MGOS_VFS_DEV_ERR_INVAL;
+  }
+  return dev_multi_io_async(dev, DEV_MULTI_ERASE, offset, len, NULL, cb,
+                            cb_arg);
+}
+
+static size_t dev_multi_get_size(struct mgos_vfs_dev *dev) {
+  struct dev_multi_data *dd = (struct dev_multi_data *) dev->dev_data;
+  return dd->size;
+}
+
+static enum mgos_vfs_dev_err dev_multi_flush(struct mgos_vfs_dev *dev) {
+  struct dev_multi_data *dd = (struct dev_multi_data *) dev->dev_data;
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  int i;
+  for (i = 0; i < dd->num_devs; i++) {
+    enum mgos_vfs_dev_err r = mgos_vfs_dev_flush(dd->devs[i]);
+    if (r != MGOS_VFS_DEV_ERR_NONE) res = r;
+  }
+  return res;
+}
+
+static enum mgos_vfs_dev_err dev_multi_close(struct mgos_vfs_dev *dev) {
+  dev_multi_free((struct dev_multi_data *) dev->dev_data);
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static enum mgos_vfs_dev_err dev_multi_get_erase_sizes(
+    struct mgos_vfs_dev *dev, size_t sizes[MGOS_VFS_DEV_NUM_ERASE_SIZES]) {
+  struct dev_multi_data *dd = (struct dev_multi_data *) dev->dev_data;
+  memset(sizes, 0, MGOS_VFS_DEV_NUM_ERASE_SIZES * sizeof(sizes[0]));
+  sizes[0] = dd->erase_size;
+  return MGOS_VFS_DEV_ERR_NONE;
+}
+
+static const struct mgos_vfs_dev_ops mgos_vfs_dev_concat_ops = {
+    .open = dev_concat_open,
+    .read = dev_multi_read,
+    .write = dev_multi_write,
+    .erase = dev_multi_erase,
+    .get_size = dev_multi_get_size,
+    .close = dev_multi_close,
+    .get_erase_sizes = dev_multi_get_erase_sizes,
+    .flush = dev_multi_flush,
+    .read_async = dev_multi_read_async,
+    .write_async = dev_multi_write_async,
+    .erase_async = dev_multi_erase_async,
+};
+
+static const struct mgos_vfs_dev_ops mgos_vfs_dev_stripe_ops = {
+    .open = dev_stripe_open,
+    .read = dev_multi_read,
+    .write = dev_multi_write,
+    .erase = dev_multi_erase,
+    .get_size = dev_multi_get_size,
+    .close = dev_multi_close,
+    .get_erase_sizes = dev_multi_get_erase_sizes,
+    .flush = dev_multi_flush,
+    .read_async = dev_multi_read_async,
+    .write_async = dev_multi_write_async,
+    .erase_async = dev_multi_erase_async,
+};
+
+bool mgos_vfs_dev_multi_register_types(void) {
+  return (mgos_vfs_dev_register_type(MGOS_VFS_DEV_TYPE_CONCAT,
+                                     &mgos_vfs_dev_concat_ops) &&
+          mgos_vfs_dev_register_type(MGOS_VFS_DEV_TYPE_STRIPE,
+                                     &mgos_vfs_dev_stripe_ops));
+}
+
+#endif /* MGOS_VFS_DEV_ENABLE_MULTI */
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_vfs_lock_prof.h"
+
+#include <string.h>
+
+#include "mgos_system.h"
+#include "mgos_time.h"
+
+#if MGOS_VFS_ENABLE_LOCK_PROF
+
+/*
+ * The table is updated by holders of different locks, so it cannot be
+ * protected by any of them. Updates are short, so interrupts are disabled
+ * instead of using yet another lock.
+ */
+static struct mgos_vfs_lock_site s_sites[MGOS_VFS_LOCK_PROF_MAX_SITES];
+static int s_num_sites = 0;
+
+int64_t mgos_vfs_lock_prof_now(void) {
+  return mgos_uptime_micros();
+}
+
+/* Must be called with interrupts disabled. */
+static int find_site(const char *lock, const char *site) {
+  int i;
+  /* Site is __func__, comparing pointers is enough. */
+  for (i = 0; i < s_num_sites; i++) {
+    if (s_sites[i].site == site && strcmp(s_sites[i].lock, lock) == 0) {
+      return i;
+    }
+  }
+  if (s_num_sites == MGOS_VFS_LOCK_PROF_MAX_SITES) return -1;
+  s_sites[i].lock = lock;
+  s_sites[i].site = site;
+  s_num_sites++;
+  return i;
+}
+
+void mgos_vfs_lock_prof_acquired(struct mgos_vfs_lock_prof_state *st,
+                                 const char *lock, const char *site,
+                                 int64_t wait_start) {
+  int64_t now = mgos_vfs_lock_prof_now();
+  uint32_t wait_us = (uint32_t) (now - wait_start);
+  struct mgos_vfs_lock_site *s;
+  mgos_ints_disable();
+  int i = find_site(lock, site);
+  if (i >= 0) {
+    s = &s_sites[i];
+    if (st->depth == 0) {
+      s->count++;
+      s->wait_us += wait_us;
+      if (wait_us > s->max_wait_us) s->max_wait_us = wait_us;
+    } else {
+      s->nested++;
+    }
+  }
+  mgos_ints_enable();
+  if (st->depth++ == 0) {
+    st->site = i;
+    st->acquired = now;
+  }
+}
+
+void mgos_vfs_lock_prof_release(struct mgos_vfs_lock_prof_state *st) {
+  uint32_t hold_us;
+  struct mgos_vfs_lock_site *s;
+  if (--st->depth > 0 || st->site < 0) return;
+  hold_us = (uint32_t) (mgos_vfs_lock_prof_now() - st->acquired);
+  mgos_ints_disable();
+  s = &s_sites[st->site];
+  s->hold_us += hold_us;
+  if (hold_us > s->max_hold_us) s->max_hold_us = hold_us;
+  mgos_ints_enable();
+}
+
+int mgos_vfs_lock_prof_get(struct mgos_vfs_lock_site *sites, int max_sites) {
+  int n;
+  mgos_ints_disable();
+  n = s_num_sites;
+  if (sites != NULL) {
+    memcpy(sites, s_sites, (n < max_sites ? n : max_sites) * sizeof(*sites));
+  }
+  mgos_ints_enable();
+  return n;
+}
+
+void mgos_vfs_lock_prof_reset(void) {
+  int i;
+  mgos_ints_disable();
+  /* Keep the sites, holders may refer to them. */
+  for (i = 0; i < s_num_sites; i++) {
+    struct mgos_vfs_lock_site *s = &s_sites[i];
+    s->count = s->nested = 0;
+    s->wait_us = s->hold_us = 0;
+    s->max_wait_us = s->max_hold_us = 0;
+  }
+  mgos_ints_enable();
+}
+
+int mgos_vfs_lock_prof_print_json(struct json_out *out) {
+  int i, n = mgos_vfs_lock_prof_get(NULL, 0), len = 0;
+  len += json_printf(out, "[");
+  for (i = 0; i < n; i++) {
+    struct mgos_vfs_lock_site s;
+    mgos_ints_disable();
+    s = s_sites[i];
+    mgos_ints_enable();
+    len += json_printf(
+        out,
+        "%s{lock: %Q, site: %Q, count: %u, nested: %u, wait_us: %llu, "
+        "max_wait_us: %u, hold_us: %llu, max_hold_us: %u}",
+        (i > 0 ? ", " : ""), s.lock, s.site, (unsigned int) s.count,
+        (unsigned int) s.nested, (unsigned long long) s.wait_us,
+        (unsigned int) s.max_wait_us, (unsigned long long) s.hold_us,
+        (unsigned int) s.max_hold_us);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+#else /* MGOS_VFS_ENABLE_LOCK_PROF */
+
+int mgos_vfs_lock_prof_get(struct mgos_vfs_lock_site *sites, int max_sites) {
+  (void) sites;
+  (void) max_sites;
+  return 0;
+}
+
+void mgos_vfs_lock_prof_reset(void) {
+}
+
+int mgos_vfs_lock_prof_print_json(struct json_out *out) {
+  return json_printf(out, "[]");
+}
+
+#endif /* MGOS_VFS_ENABLE_LOCK_PROF */
@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_vfs_stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/queue.h"
+
+#include "mgos_system.h"
+#include "mgos_time.h"
+#include "mgos_vfs_dev.h"
+
+#if MGOS_VFS_ENABLE_STATS && MGOS_VFS_DEV_ENABLE_STATS
+#define MGOS_VFS_ENABLE_WAF 1
+#include "mgos_timers.h"
+#else
+#define MGOS_VFS_ENABLE_WAF 0
+#endif
+
+static const char *s_op_names[MGOS_VFS_OP_MAX] = {
+    "open",     "close",   "read",     "write",    "stat",
+    "fstat",    "lseek",   "unlink",   "rename",   "opendir",
+    "readdir",  "getdents", "closedir", "statvfs", "gc",
+};
+
+const char *mgos_vfs_op_name(enum mgos_vfs_op op) {
+  if (op < 0 || op >= MGOS_VFS_OP_MAX) return "";
+  return s_op_names[op];
+}
+
+#if MGOS_VFS_ENABLE_STATS
+
+#if MGOS_VFS_ENABLE_WAF
+struct mgos_vfs_waf_sample {
+  uint64_t app_bytes;
+  uint64_t dev_written;
+  uint64_t dev_erased;
+};
+#endif
+
+struct mgos_vfs_stats {
+  char *prefix;
+  struct mgos_vfs_op_stats ops[MGOS_VFS_OP_MAX];
+#if MGOS_VFS_ENABLE_WAF
+  struct mgos_vfs_dev *dev;
+  /* Ring of the most recent samples. */
+  struct mgos_vfs_waf_sample samples[MGOS_VFS_WAF_WINDOW_SAMPLES];
+  int num_samples, next_sample;
+#endif
+  SLIST_ENTRY(mgos_vfs_stats) next;
+};
+
+static SLIST_HEAD(s_stats, mgos_vfs_stats) s_stats =
+    SLIST_HEAD_INITIALIZER(s_stats);
+
+#if MGOS_VFS_ENABLE_WAF
+static mgos_timer_id s_waf_timer_id = MGOS_INVALID_TIMER_ID;
+
+/* Must be called with lock held. */
+static void waf_sample(const struct mgos_vfs_stats *s,
+                       struct mgos_vfs_waf_sample *ws) {
+  struct mgos_vfs_dev_stats ds;
+  memset(ws, 0, sizeof(*ws));
+  ws->app_bytes = s->ops[MGOS_VFS_OP_WRITE].bytes;
+  if (mgos_vfs_dev_get_stats(s->dev, &ds)) {
+    ws->dev_written = ds.op[MGOS_VFS_DEV_OP_WRITE].bytes;
+    ws->dev_erased = ds.op[MGOS_VFS_DEV_OP_ERASE].bytes;
+  }
+}
+
+static void waf_timer_cb(void *arg) {
+  struct mgos_vfs_stats *s;
+  mgos_lock();
+  SLIST_FOREACH(s, &s_stats, next) {
+    if (s->dev == NULL) continue;
+    waf_sample(s, &s->samples[s->next_sample]);
+    s->next_sample = (s->next_sample + 1) % MGOS_VFS_WAF_WINDOW_SAMPLES;
+    if (s->num_samples < MGOS_VFS_WAF_WINDOW_SAMPLES) s->num_samples++;
+  }
+  mgos_unlock();
+  (void) arg;
+}
+
+static float waf_ratio(uint64_t a, uint64_t b) {
+  return (b > 0 ? (float) a / (float) b : 0);
+}
+
+/* Must be called with lock held. */
+static bool waf_get(const struct mgos_vfs_stats *s, struct mgos_vfs_waf *waf) {
+  struct mgos_vfs_waf_sample cur, old;
+  if (s->dev == NULL) return false;
+  waf_sample(s, &cur);
+  memset(&old, 0, sizeof(old));
+  if (s->num_samples > 0) {
+    int i = (s->next_sample + MGOS_VFS_WAF_WINDOW_SAMPLES - s->num_samples) %
+            MGOS_VFS_WAF_WINDOW_SAMPLES;
+    old = s->samples[i];
+  }
+  /* Counters may have been reset since the sample was taken. */
+  if (old.app_bytes > cur.app_bytes || old.dev_written > cur.dev_written ||
+      old.dev_erased > cur.dev_erased) {
+    memset(&old, 0, sizeof(old));
+  }
+  waf->app_bytes = cur.app_bytes;
+  waf->dev_written = cur.dev_written;
+  waf->dev_erased = cur.dev_erased;
+  waf->waf = waf_ratio(cur.dev_written, cur.app_bytes);
+  waf->erase_factor = waf_ratio(cur.dev_erased, cur.app_bytes);
+  waf->waf_window = waf_ratio(cur.dev_written - old.dev_written,
+                              cur.app_bytes - old.app_bytes);
+  waf->erase_factor_window = waf_ratio(cur.dev_erased - old.dev_erased,
+                                       cur.app_bytes - old.app_bytes);
+  return true;
+}
+#endif /* MGOS_VFS_ENABLE_WAF */
+
+struct mgos_vfs_stats *mgos_vfs_stats_create(const char *prefix,
+                                             struct mgos_vfs_dev *dev) {
+  struct mgos_vfs_stats *s = (struct mgos_vfs_stats *) calloc(1, sizeof(*s));
+  if (s == NULL) return NULL;
+  s->prefix = strdup(prefix);
+  if (s->prefix == NULL) {
+    free(s);
+    return NULL;
+  }
+#if MGOS_VFS_ENABLE_WAF
+  s->dev = dev;
+#else
+  (void) dev;
+#endif
+  mgos_lock();
+  SLIST_INSERT_HEAD(&s_stats, s, next);
+#if MGOS_VFS_ENABLE_WAF
+  if (s_waf_timer_id == MGOS_INVALID_TIMER_ID &&
+      MGOS_VFS_WAF_SAMPLE_INTERVAL_MS > 0) {
+    s_waf_timer_id = mgos_set_timer(MGOS_VFS_WAF_SAMPLE_INTERVAL_MS,
+                                    MGOS_TIMER_REPEAT, waf_timer_cb, NULL);
+  }
+#endif
+  mgos_unlock();
+  return s;
+}
+
+void mgos_vfs_stats_free(struct mgos_vfs_stats *s) {
+  if (s == NULL) return;
+  mgos_lock();
+  SLIST_REMOVE(&s_stats, s, mgos_vfs_stats, next);
+  mgos_unlock();
+  free(s->prefix);
+  free(s);
+}
+
+int64_t mgos_vfs_stats_now(void) {
+  return mgos_uptime_micros();
+}
+
+void mgos_vfs_stats_begin(struct mgos_vfs_stats_start *start) {
+#if MGOS_VFS_ENABLE_HEAP_STATS
+  start->free_heap = mgos_get_free_heap_size();
+  start->min_free_heap = mgos_get_min_free_heap_size();
+#endif
+  start->ts = mgos_vfs_stats_now();
+}
+
+#if MGOS_VFS_ENABLE_HEAP_STATS
+/* Must be called with lock held. */
+static void record_heap(struct mgos_vfs_op_stats *st,
+                        const struct mgos_vfs_stats_start *start) {
+  size_t free_heap = mgos_get_free_heap_size();
+  size_t min_free_heap = mgos_get_min_free_heap_size();
+  int32_t delta = (int32_t) start->free_heap - (int32_t) free_heap;
+  uint32_t peak = (delta > 0 ? (uint32_t) delta : 0);
+  /*
+   * We only know the peak if the call has lowered the low watermark,
+   * otherwise what remains allocated after the call is the best guess.
+   */
+  if (min_free_heap < start->min_free_heap) {
+    st->heap_low_marks++;
+    if (start->free_heap > min_free_heap) {
+      peak = (uint32_t) (start->free_heap - min_free_heap);
+    }
+  }
+  st->heap_delta += delta;
+  if (delta > st->max_heap_delta) st->max_heap_delta = delta;
+  if (peak > st->max_heap_peak) st->max_heap_peak = peak;
+}
+#endif
+
+void mgos_vfs_stats_record(struct mgos_vfs_stats *s, enum mgos_vfs_op op,
+                           const struct mgos_vfs_stats_start *start, bool ok,
+                           size_t bytes) {
+  uint32_t us = (uint32_t) (mgos_vfs_stats_now() - start->ts);
+  int b = 0;
+  if (s == NULL) return;
+  /* Bucket index is the number of significant bits. */
+  while (b < MGOS_VFS_STATS_NUM_BUCKETS - 1 && (us >> b) != 0) b++;
+  mgos_lock();
+  struct mgos_vfs_op_stats *st = &s->ops[op];
+  st->calls++;
+  if (!ok) st->errors++;
+  st->bytes += bytes;
+  st->total_us += us;
+  if (us > st->max_us) st->max_us = us;
+  st->hist[b]++;
+#if MGOS_VFS_ENABLE_HEAP_STATS
+  record_heap(st, start);
+#endif
+  mgos_unlock();
+}
+
+static struct mgos_vfs_stats *find_stats(const char *prefix) {
+  struct mgos_vfs_stats *s;
+  SLIST_FOREACH(s, &s_stats, next) {
+    if (strcmp(s->prefix, prefix) == 0) return s;
+  }
+  return NULL;
+}
+
+bool mgos_vfs_get_op_stats(const char *path, enum mgos_vfs_op op,
+                           struct mgos_vfs_op_stats *st) {
+  bool ret = false;
+  struct mgos_vfs_stats *s;
+  if (op < 0 || op >= MGOS_VFS_OP_MAX) return false;
+  mgos_lock();
+  s = find_stats(path);
+  if (s != NULL) {
+    *st = s->ops[op];
+    ret = true;
+  }
+  mgos_unlock();
+  return ret;
+}
+
+bool mgos_vfs_get_waf(const char *path, struct mgos_vfs_waf *waf) {
+  bool ret = false;
+#if MGOS_VFS_ENABLE_WAF
+  struct mgos_vfs_stats *s;
+  mgos_lock();
+  s = find_stats(path);
+  if (s != NULL) ret = waf_get(s, waf);
+  mgos_unlock();
+#else
+  (void) path;
+  (void) waf;
+#endif
+  return ret;
+}
+
+void mgos_vfs_reset_stats(void) {
+  struct mgos_vfs_stats *s;
+  mgos_lock();
+  SLIST_FOREACH(s, &s_stats, next) {
+    memset(s->ops, 0, sizeof(s->ops));
+#if MGOS_VFS_ENABLE_WAF
+    s->num_samples = 0;
+#endif
+  }
+  mgos_unlock();
+}
+
+static int print_op_stats(struct json_out *out,
+                          const struct mgos_vfs_op_stats *st) {
+  int i, len = 0;
+  len += json_printf(out,
+                     "{calls: %u, errors: %u, bytes: %llu, total_us: %llu, "
+                     "max_us: %u, hist: [",
+                     (unsigned int) st->calls, (unsigned int) st->errors,
+                     (unsigned long long) st->bytes,
+                     (unsigned long long) st->total_us,
+                     (unsigned int) st->max_us);
+  for (i = 0; i < MGOS_VFS_STATS_NUM_BUCKETS; i++) {
+    len += json_printf(out, "%s%u", (i > 0 ? ", " : ""),
+                       (unsigned int) st->hist[i]);
+  }
+  len += json_printf(out, "]");
+#if MGOS_VFS_ENABLE_HEAP_STATS
+  len += json_printf(
+      out, ", heap: {delta: %lld, max_delta: %d, max_peak: %u, low_marks: %u}",
+      (long long) st->heap_delta, (int) st->max_heap_delta,
+      (unsigned int) st->max_heap_peak, (unsigned int) st->heap_low_marks);
+#endif
+  len += json_printf(out, "}");
+  return len;
+}
+
+int mgos_vfs_stats_print_json(struct json_out *out) {
+  int len = 0;
+  bool first = true;
+  struct mgos_vfs_stats *s;
+  mgos_lock();
+  len += json_printf(out, "{");
+  SLIST_FOREACH(s, &s_stats, next) {
+    int op;
+    bool first_op = true;
+    len += json_printf(out, "%s%Q: {", (first ? "" : ", "), s->prefix);
+    for (op = 0; op < MGOS_VFS_OP_MAX; op++) {
+      if (s->ops[op].calls == 0) continue;
+      len += json_printf(out, "%s%Q: ", (first_op ? "" : ", "),
+                         mgos_vfs_op_name((enum mgos_vfs_op) op));
+      len += print_op_stats(out, &s->ops[op]);
+      first_op = false;
+    }
+#if MGOS_VFS_ENABLE_WAF
+    struct mgos_vfs_waf waf;
+    if (waf_get(s, &waf)) {
+      len += json_printf(
+          out,
+          "%swaf: {app_bytes: %llu, dev_written: %llu, dev_erased: %llu, "
+          "waf: %.2f, waf_window: %.2f, erase_factor: %.2f, "
+          "erase_factor_window: %.2f}",
+          (first_op ? "" : ", "), (unsigned long long) waf.app_bytes,
+          (unsigned long long) waf.dev_written,
+          (unsigned long long) waf.dev_erased, waf.waf, waf.waf_window,
+          waf.erase_factor, waf.erase_factor_window);
+    }
+#endif
+    len += json_printf(out, "}");
+    first = false;
+  }
+  len += json_printf(out, "}");
+  mgos_unlock();
+  return len;
+}
+
+#else /* MGOS_VFS_ENABLE_STATS */
+
+bool mgos_vfs_get_waf(const char *path, struct mgos_vfs_waf *waf) {
+  (void) path;
+  (void) waf;
+  return false;
+}
+
+bool mgos_vfs_get_op_stats(const char *path, enum mgos_vfs_op op,
+                           struct mgos_vfs_op_stats *st) {
+  (void) path;
+  (void) op;
+  (void) st;
+  return false;
+}
+
+void mgos_vfs_reset_stats(void) {
+}
+
+int mgos_vfs_stats_print_json(struct json_out *out) {
+  return json_printf(out, "{}");
+}
+
+#endif /* MGOS_VFS_ENABLE_STATS */
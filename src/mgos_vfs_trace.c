@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_vfs_trace.h"
+
+#include <stdlib.h>
+
+#include "mgos_system.h"
+#include "mgos_time.h"
+
+#if MGOS_VFS_ENABLE_TRACE
+
+#if MGOS_VFS_TRACE_FREERTOS
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include "FreeRTOS.h"
+#include "task.h"
+#endif
+#define TRACE_CUR_TASK() ((uintptr_t) xTaskGetCurrentTaskHandle())
+#else
+#define TRACE_CUR_TASK() ((uintptr_t) 0)
+#endif
+
+struct mgos_vfs_trace_ev {
+  int64_t ts;
+  const char *name;
+  uint32_t arg;
+  uint8_t cat;
+  uint8_t tid;
+  char ph;
+};
+
+static struct mgos_vfs_trace_ev *s_events = NULL;
+static int s_num_events = 0, s_next_event = 0;
+static bool s_enabled = false;
+/* Tasks seen so far, tid is the index + 1. */
+static uintptr_t s_tasks[MGOS_VFS_TRACE_MAX_TASKS];
+static int s_num_tasks = 0;
+
+/*
+ * The ring and the task table are protected by disabling interrupts, like
+ * the lock profiler: events are recorded under device locks, so taking
+ * mgos_lock() here would invert the VFS lock -> device lock order.
+ * Must be called with interrupts disabled.
+ */
+static uint8_t trace_get_tid(uintptr_t task) {
+  int i;
+  for (i = 0; i < s_num_tasks; i++) {
+    if (s_tasks[i] == task) return i + 1;
+  }
+  if (s_num_tasks < MGOS_VFS_TRACE_MAX_TASKS) {
+    s_tasks[s_num_tasks++] = task;
+  }
+  return s_num_tasks;
+}
+
+bool mgos_vfs_trace_enable(bool enable) {
+  struct mgos_vfs_trace_ev *events = NULL;
+  bool ret = true;
+  if (enable && s_events == NULL) {
+    events = (struct mgos_vfs_trace_ev *) calloc(MGOS_VFS_TRACE_NUM_EVENTS,
+                                                 sizeof(*events));
+    if (events == NULL) ret = false;
+  }
+  mgos_ints_disable();
+  if (events != NULL && s_events == NULL) {
+    s_events = events;
+    events = NULL;
+  }
+  s_enabled = (enable && s_events != NULL);
+  mgos_ints_enable();
+  /* Lost a race with another enable. */
+  free(events);
+  return ret;
+}
+
+void mgos_vfs_trace_clear(void) {
+  mgos_ints_disable();
+  s_num_events = s_next_event = 0;
+  mgos_ints_enable();
+}
+
+void mgos_vfs_trace_event(enum mgos_vfs_trace_cat cat, const char *name,
+                          char ph, uint32_t arg) {
+  struct mgos_vfs_trace_ev *ev;
+  uintptr_t task = TRACE_CUR_TASK();
+  int64_t ts;
+  if (!s_enabled) return;
+  ts = mgos_uptime_micros();
+  mgos_ints_disable();
+  ev = &s_events[s_next_event];
+  ev->tid = trace_get_tid(task);
+  ev->ts = ts;
+  ev->name = name;
+  ev->arg = arg;
+  ev->cat = cat;
+  ev->ph = ph;
+  s_next_event = (s_next_event + 1) % MGOS_VFS_TRACE_NUM_EVENTS;
+  if (s_num_events < MGOS_VFS_TRACE_NUM_EVENTS) s_num_events++;
+  mgos_ints_enable();
+}
+
+/*
+ * Events are copied one at a time, output is not done with interrupts
+ * disabled. Events recorded while printing may replace the oldest ones.
+ */
+int mgos_vfs_trace_print_json(struct json_out *out) {
+  int i, n, first, len = 0;
+  mgos_ints_disable();
+  n = s_num_events;
+  first = s_next_event + MGOS_VFS_TRACE_NUM_EVENTS - s_num_events;
+  mgos_ints_enable();
+  len += json_printf(out, "{traceEvents: [");
+  for (i = 0; i < n; i++) {
+    struct mgos_vfs_trace_ev e;
+    const struct mgos_vfs_trace_ev *ev = &e;
+    mgos_ints_disable();
+    e = s_events[(first + i) % MGOS_VFS_TRACE_NUM_EVENTS];
+    mgos_ints_enable();
+    len += json_printf(
+        out, "%s{name: %Q, cat: %Q, ph: %Q, ts: %lld, pid: 0, tid: %d",
+        (i > 0 ? ", " : ""), ev->name,
+        (ev->cat == MGOS_VFS_TRACE_CAT_DEV ? "dev" : "vfs"),
+        (ev->ph == 'B' ? "B" : "E"), (long long) ev->ts, (int) ev->tid);
+    if (ev->arg != 0) {
+      len += json_printf(out, ", args: {len: %u}", (unsigned int) ev->arg);
+    }
+    len += json_printf(out, "}");
+  }
+  len += json_printf(out, "]}");
+  return len;
+}
+
+#else /* MGOS_VFS_ENABLE_TRACE */
+
+bool mgos_vfs_trace_enable(bool enable) {
+  (void) enable;
+  return false;
+}
+
+void mgos_vfs_trace_clear(void) {
+}
+
+int mgos_vfs_trace_print_json(struct json_out *out) {
+  return json_printf(out, "{traceEvents: []}");
+}
+
+#endif /* MGOS_VFS_ENABLE_TRACE */
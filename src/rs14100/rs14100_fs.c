@@ -16,6 +16,8 @@
  */
 
 #include "mgos.h"
+#include "mgos_vfs_boot_prof.h"
+#include "mgos_vfs_dev.h"
 
 #ifdef MGOS_HAVE_BOOTLOADER
 #include "mgos_boot_cfg.h"
@@ -33,9 +35,12 @@ bool mgos_core_fs_init(void) {
     dev_name = bcfg->slots[bcfg->active_slot].cfg.fs_dev;
   }
 #endif
-  return mgos_vfs_mount_dev_name("/", dev_name, fs_type, fs_opts);
+  MGOS_VFS_BOOT_FS_INIT_BEGIN();
+  bool res = mgos_vfs_mount_dev_name("/", dev_name, fs_type, fs_opts);
+  MGOS_VFS_BOOT_PHASE_END(res);
+  return res;
 }
 
 bool mgos_vfs_common_init(void) {
-  return rs14100_vfs_dev_qspi_flash_register_type();
+  return (mgos_vfs_dev_init() && rs14100_vfs_dev_qspi_flash_register_type());
 }
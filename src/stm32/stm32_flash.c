@@ -32,6 +32,21 @@
   mgos_boot_dbg_putc('\n')
 #endif
 
+/* Unlocks nest and may come from different tasks. */
+static int s_unlock_count = 0;
+
+void stm32_flash_unlock(void) {
+  mgos_ints_disable();
+  if (s_unlock_count++ == 0) HAL_FLASH_Unlock();
+  mgos_ints_enable();
+}
+
+void stm32_flash_lock(void) {
+  mgos_ints_disable();
+  if (--s_unlock_count == 0) HAL_FLASH_Lock();
+  mgos_ints_enable();
+}
+
 IRAM void stm32_flash_do_erase(void) {
   mgos_ints_disable();
   stm32_flush_caches();
@@ -47,7 +62,7 @@ bool stm32_flash_erase_sector(int sector) {
   bool res = false;
   int offset = stm32_flash_get_sector_offset(sector);
   if (offset < 0) goto out;
-  HAL_FLASH_Unlock();
+  stm32_flash_unlock();
 #ifdef STM32L4
   uint32_t pnb = (sector & 0xff);
   FLASH->CR = (FLASH_CR_PER | (sector > 0xff ? FLASH_CR_BKER : 0) |
@@ -57,7 +72,7 @@ bool stm32_flash_erase_sector(int sector) {
 #endif
   __HAL_FLASH_CLEAR_FLAG(FLASH_ERR_FLAGS);
   stm32_flash_do_erase();
-  HAL_FLASH_Lock();
+  stm32_flash_lock();
   if ((FLASH->SR & FLASH_ERR_FLAGS) != 0) {
     LOG(LL_ERROR, ("Flash %s error, flags: 0x%lx", "erase", FLASH->SR));
   }
@@ -153,10 +153,15 @@ bool mgos_core_fs_init(void) {
   if (bcfg != NULL) {
     dev_name = bcfg->slots[bcfg->active_slot].cfg.fs_dev;
   }
-  return (stm32_fs_create_if_needed(dev_name, fs_type, fs_opts) &&
-          mgos_vfs_mount_dev_name("/", dev_name, fs_type, fs_opts));
+  MGOS_VFS_BOOT_FS_INIT_BEGIN();
+  MGOS_VFS_BOOT_PHASE_BEGIN("create_fs", dev_name);
+  bool res = stm32_fs_create_if_needed(dev_name, fs_type, fs_opts);
+  MGOS_VFS_BOOT_PHASE_END(res);
+  res = res && mgos_vfs_mount_dev_name("/", dev_name, fs_type, fs_opts);
+  MGOS_VFS_BOOT_PHASE_END(res);
+  return res;
 }
 
 bool mgos_vfs_common_init(void) {
-  return stm32_vfs_dev_flash_register_type();
+  return (mgos_vfs_dev_init() && stm32_vfs_dev_flash_register_type());
 }
@@ -193,6 +193,58 @@ out:
   return res;
 }
 
+static enum mgos_vfs_dev_err stm32_vfs_dev_flash_exec(
+    struct mgos_vfs_dev *dev, const struct mgos_vfs_dev_req *r) {
+  switch (r->type) {
+    case MGOS_VFS_DEV_OP_READ:
+      return stm32_vfs_dev_flash_read(dev, r->offset, r->len, r->buf);
+    case MGOS_VFS_DEV_OP_WRITE:
+      return stm32_vfs_dev_flash_write(dev, r->offset, r->len, r->buf);
+    case MGOS_VFS_DEV_OP_ERASE:
+      return stm32_vfs_dev_flash_erase(dev, r->offset, r->len);
+    default:
+      return MGOS_VFS_DEV_ERR_INVAL;
+  }
+}
+
+/*
+ * Flash control is unlocked once for the whole batch. Adjacent reads with
+ * contiguous buffers are merged. Writes and erases are not: a failed one
+ * would not tell which of the requests has been executed.
+ */
+static enum mgos_vfs_dev_err stm32_vfs_dev_flash_submit(
+    struct mgos_vfs_dev *dev, struct mgos_vfs_dev_req *reqs, int n) {
+  enum mgos_vfs_dev_err res = MGOS_VFS_DEV_ERR_NONE;
+  int i, j;
+  stm32_flash_unlock();
+  for (i = 0; i < n && res == MGOS_VFS_DEV_ERR_NONE; i = j) {
+    const struct mgos_vfs_dev_req *r = &reqs[i];
+    size_t len = r->len;
+    for (j = i + 1; j < n && r->type == MGOS_VFS_DEV_OP_READ; j++) {
+      const struct mgos_vfs_dev_req *rj = &reqs[j];
+      if (rj->type != r->type || rj->offset != r->offset + len ||
+          (uint8_t *) rj->buf != (uint8_t *) r->buf + len) {
+        break;
+      }
+      len += rj->len;
+    }
+    if (j - i > 1) {
+      res = stm32_vfs_dev_flash_read(dev, r->offset, len, r->buf);
+      if (res == MGOS_VFS_DEV_ERR_NONE) {
+        for (; i < j; i++) reqs[i].res = res;
+        continue;
+      }
+      /* Repeat one by one to find the one that failed. */
+      res = MGOS_VFS_DEV_ERR_NONE;
+    }
+    for (; i < j && res == MGOS_VFS_DEV_ERR_NONE; i++) {
+      res = reqs[i].res = stm32_vfs_dev_flash_exec(dev, &reqs[i]);
+    }
+  }
+  stm32_flash_lock();
+  return res;
+}
+
 static size_t stm32_vfs_dev_flash_get_size(struct mgos_vfs_dev *dev) {
   struct dev_data *dd = (struct dev_data *) dev->dev_data;
   return dd->size;
@@ -215,6 +267,7 @@ static const struct mgos_vfs_dev_ops stm32_vfs_dev_flash_ops = {
     .get_size = stm32_vfs_dev_flash_get_size,
     .close = stm32_vfs_dev_flash_close,
     .get_erase_sizes = stm32_vfs_dev_flash_get_erase_sizes,
+    .submit = stm32_vfs_dev_flash_submit,
 };
 
 bool stm32_vfs_dev_flash_register_type(void) {
@@ -84,7 +84,7 @@ IRAM bool stm32_flash_write_region(int offset, int len, const void *src) {
   if (offset < 0 || len < 0 || offset + len > STM32_FLASH_SIZE) goto out;
   volatile uint8_t *dst = (uint8_t *) (FLASH_BASE + offset), *p = dst;
   const uint8_t *q = (const uint8_t *) src;
-  HAL_FLASH_Unlock();
+  stm32_flash_unlock();
   __HAL_FLASH_CLEAR_FLAG(FLASH_ERR_FLAGS);
   res = true;
   mgos_ints_disable();
@@ -111,7 +111,7 @@ IRAM bool stm32_flash_write_region(int offset, int len, const void *src) {
       LOG(LL_ERROR, ("Flash %s error, flags: 0x%lx", "verify", FLASH->SR));
     }
   }
-  HAL_FLASH_Lock();
+  stm32_flash_lock();
 out:
   return res;
 }
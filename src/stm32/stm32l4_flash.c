@@ -62,7 +62,7 @@ IRAM bool stm32_flash_write_region(int offset, int len, const void *src) {
   }
   volatile uint32_t *dst = (uint32_t *) (FLASH_BASE + offset), *p = dst;
   const uint32_t *q = (const uint32_t *) src;
-  HAL_FLASH_Unlock();
+  stm32_flash_unlock();
   __HAL_FLASH_CLEAR_FLAG(FLASH_ERR_FLAGS);
   res = true;
   mgos_ints_disable();
@@ -92,7 +92,7 @@ IRAM bool stm32_flash_write_region(int offset, int len, const void *src) {
                      (int) offset, FLASH->SR));
     }
   }
-  HAL_FLASH_Lock();
+  stm32_flash_lock();
 out:
   return res;
 }